@@ -2,14 +2,99 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 
+/*
+ * USDT probes of the adserver provider, see ngx_http_adfront_probes.h:
+ *
+ *  frame__send(r, magic, len, members)     body length, requests in it
+ *  frame__receive(r, magic, len)           header checked, body length
+ */
+#if (NGX_HAVE_SDT)
+
+#include <sys/sdt.h>
+
+#define ADSERVER_PROBE3(name, a1, a2, a3)                                     \
+    DTRACE_PROBE3(adserver, name, a1, a2, a3)
+#define ADSERVER_PROBE4(name, a1, a2, a3, a4)                                 \
+    DTRACE_PROBE4(adserver, name, a1, a2, a3, a4)
+
+#else
+
+#define ADSERVER_PROBE3(name, a1, a2, a3)
+#define ADSERVER_PROBE4(name, a1, a2, a3, a4)
+
+#endif
+
+typedef struct ngx_http_adserver_batch_s  ngx_http_adserver_batch_t;
+
+
+/*
+ * Response times in msec of the current and the previous window, log-linear
+ * buckets within 1/8 of their values like sharelib::Histogram. Percentiles
+ * are over both windows, they drive the adaptive read timeout.
+ */
+#define ADSERVER_SKETCH_SUB_BITS  3
+#define ADSERVER_SKETCH_BUCKETS   ((32 - ADSERVER_SKETCH_SUB_BITS + 1)         \
+                                   << ADSERVER_SKETCH_SUB_BITS)
+#define ADSERVER_SKETCH_WINDOW    10
+
+typedef struct {
+    time_t                       start;
+    ngx_uint_t                   current;
+    ngx_uint_t                   count[2];
+    uint32_t                     buckets[2][ADSERVER_SKETCH_BUCKETS];
+
+    /* worked out at most once a second */
+    ngx_msec_t                   timeout;
+    time_t                       timeout_sec;
+} ngx_http_adserver_sketch_t;
+
+
 typedef struct {
     ngx_http_upstream_conf_t     upstream;
+
+    ngx_flag_t                   batch;
+    ngx_int_t                    batch_size;
+    ngx_msec_t                   batch_window;
+
+    /* msec each member asks for, the batch takes the shortest; NULL if off */
+    ngx_http_complex_value_t    *batch_connect_timeout;
+    ngx_http_complex_value_t    *batch_read_timeout;
+
+    ngx_flag_t                   adaptive_timeout;
+    ngx_msec_t                   adaptive_timeout_min;
+    ngx_msec_t                   adaptive_timeout_max;
+
+    /* per worker, the batch being gathered right now */
+    ngx_http_adserver_batch_t   *pending;
+    ngx_event_t                  batch_event;
+
+    /* per worker, recent response times if adaptive_timeout is on */
+    ngx_http_adserver_sketch_t  *sketch;
+
+    /* traceparent for the trace extension, NULL if off */
+    ngx_http_complex_value_t    *trace;
 } ngx_http_adserver_loc_conf_t;
 
 
+/*
+ * Requests gathered into one adserver frame. The first live member (leader)
+ * owns the upstream, the others wait until the batched response is split.
+ * A member slot is cleared when its request pool goes away, the batch itself
+ * is freed when the last reference is released.
+ */
+struct ngx_http_adserver_batch_s {
+    ngx_uint_t                   refs;
+    ngx_uint_t                   n;
+    ngx_http_request_t          *members[1];
+};
+
+
 typedef struct {
-    ngx_http_request_t      *request;
-    ngx_str_t               key;
+    ngx_http_request_t          *request;
+    ngx_str_t                    key;
+
+    ngx_http_adserver_batch_t   *batch;
+    ngx_uint_t                   slot;
 } ngx_http_adserver_ctx_t;
 
 
@@ -27,12 +112,61 @@ static char *ngx_http_adserver_merge_loc_conf(ngx_conf_t *cf,
     void *parent, void *child);
 
 static ngx_int_t ngx_http_adserver_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_adserver_create_upstream(ngx_http_request_t *r,
+    ngx_http_adserver_ctx_t *ctx);
 static char *ngx_http_adserver_pass(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 
+static ngx_int_t ngx_http_adserver_batch_add(ngx_http_request_t *r,
+    ngx_http_adserver_loc_conf_t *mlcf, ngx_http_adserver_ctx_t *ctx);
+static void ngx_http_adserver_batch_handler(ngx_event_t *ev);
+static void ngx_http_adserver_batch_flush(ngx_http_adserver_loc_conf_t *mlcf);
+static ngx_int_t ngx_http_adserver_batch_create_request(ngx_http_request_t *r,
+    ngx_http_adserver_ctx_t *ctx);
+static void ngx_http_adserver_batch_split(ngx_http_request_t *r,
+    ngx_http_adserver_ctx_t *ctx, ngx_int_t rc);
+static void ngx_http_adserver_batch_deliver(ngx_http_request_t *r,
+    ngx_http_upstream_t *src, u_char *data, size_t len, ngx_uint_t status);
+static void ngx_http_adserver_batch_cleanup(void *data);
+static void ngx_http_adserver_batch_release(ngx_http_adserver_batch_t *batch);
+static void ngx_http_adserver_batch_timeouts(ngx_http_adserver_loc_conf_t *mlcf,
+    ngx_http_adserver_batch_t *batch, ngx_msec_t *connect_timeout,
+    ngx_msec_t *read_timeout);
+static ngx_msec_t ngx_http_adserver_member_timeout(ngx_http_request_t *r,
+    ngx_http_complex_value_t *cv, ngx_msec_t timeout);
+
+static ngx_msec_t ngx_http_adserver_adaptive_timeout(
+    ngx_http_adserver_loc_conf_t *mlcf);
+static void ngx_http_adserver_sketch_add(ngx_http_adserver_sketch_t *sketch,
+    ngx_msec_t msec);
+static void ngx_http_adserver_sketch_rotate(ngx_http_adserver_sketch_t *sketch);
+static ngx_uint_t ngx_http_adserver_sketch_index(uint32_t value);
+static uint32_t ngx_http_adserver_sketch_upper(ngx_uint_t i);
+
+/* adaptive read timeout is p99 plus 20%, once there are enough samples */
+#define ADSERVER_ADAPTIVE_QUANTILE  99
+#define ADSERVER_ADAPTIVE_PERCENT   120
+#define ADSERVER_ADAPTIVE_SAMPLES   200
+
 #define ADSERVER_HEADER_LENGTH  8
 #define ADSERVER_HEADER_MAGIC   0xE8
 
+/*
+ * Batched frame, same 8 bytes header with its own magic, the body is a
+ * sequence of (4 bytes network order length, payload) items. The adserver
+ * answers with the same layout, items in request order.
+ */
+#define ADSERVER_BATCH_MAGIC    0xE9
+#define ADSERVER_ITEM_LENGTH    4
+
+/*
+ * Single frame with the trace extension, for adservers that take it: the
+ * body starts with one item holding the W3C traceparent of the request,
+ * then the usual payload. The adserver answers with a plain 0xE8 frame.
+ * Batched frames carry none, their members have traces of their own.
+ */
+#define ADSERVER_TRACE_MAGIC    0xEA
+
 
 static ngx_conf_bitmask_t  ngx_http_adserver_next_upstream_masks[] = {
     { ngx_string("error"), NGX_HTTP_UPSTREAM_FT_ERROR },
@@ -88,6 +222,69 @@ static ngx_command_t  ngx_http_adserver_commands[] = {
       offsetof(ngx_http_adserver_loc_conf_t, upstream.next_upstream),
       &ngx_http_adserver_next_upstream_masks },
 
+    { ngx_string("adserver_batch"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_adserver_loc_conf_t, batch),
+      NULL },
+
+    { ngx_string("adserver_batch_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_adserver_loc_conf_t, batch_size),
+      NULL },
+
+    { ngx_string("adserver_batch_window"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_adserver_loc_conf_t, batch_window),
+      NULL },
+
+    { ngx_string("adserver_batch_connect_timeout"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_set_complex_value_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_adserver_loc_conf_t, batch_connect_timeout),
+      NULL },
+
+    { ngx_string("adserver_batch_read_timeout"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_set_complex_value_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_adserver_loc_conf_t, batch_read_timeout),
+      NULL },
+
+    { ngx_string("adserver_adaptive_timeout"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_adserver_loc_conf_t, adaptive_timeout),
+      NULL },
+
+    { ngx_string("adserver_adaptive_timeout_min"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_adserver_loc_conf_t, adaptive_timeout_min),
+      NULL },
+
+    { ngx_string("adserver_adaptive_timeout_max"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_adserver_loc_conf_t, adaptive_timeout_max),
+      NULL },
+
+    { ngx_string("adserver_trace"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_set_complex_value_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_adserver_loc_conf_t, trace),
+      NULL },
+
       ngx_null_command
 };
 
@@ -140,6 +337,11 @@ ngx_http_adserver_create_loc_conf(ngx_conf_t *cf)
      *     conf->upstream.temp_path = NULL;
      *     conf->upstream.uri = { 0, NULL };
      *     conf->upstream.location = NULL;
+     *     conf->pending = NULL;
+     *     conf->sketch = NULL;
+     *     conf->trace = NULL;
+     *     conf->batch_connect_timeout = NULL;
+     *     conf->batch_read_timeout = NULL;
      */
 
     conf->upstream.connect_timeout = NGX_CONF_UNSET_MSEC;
@@ -162,6 +364,14 @@ ngx_http_adserver_create_loc_conf(ngx_conf_t *cf)
     conf->upstream.pass_request_headers = 0;
     conf->upstream.pass_request_body = 0;
 
+    conf->batch = NGX_CONF_UNSET;
+    conf->batch_size = NGX_CONF_UNSET;
+    conf->batch_window = NGX_CONF_UNSET_MSEC;
+
+    conf->adaptive_timeout = NGX_CONF_UNSET;
+    conf->adaptive_timeout_min = NGX_CONF_UNSET_MSEC;
+    conf->adaptive_timeout_max = NGX_CONF_UNSET_MSEC;
+
     return conf;
 }
 
@@ -203,6 +413,59 @@ ngx_http_adserver_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
         conf->upstream.upstream = prev->upstream.upstream;
     }
 
+    ngx_conf_merge_value(conf->batch, prev->batch, 0);
+    ngx_conf_merge_value(conf->batch_size, prev->batch_size, 16);
+    ngx_conf_merge_msec_value(conf->batch_window, prev->batch_window, 0);
+
+    if (conf->batch_size < 1) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"adserver_batch_size\" must be at least 1");
+        return NGX_CONF_ERROR;
+    }
+
+    conf->batch_event.handler = ngx_http_adserver_batch_handler;
+    conf->batch_event.data = conf;
+
+    ngx_conf_merge_value(conf->adaptive_timeout, prev->adaptive_timeout, 0);
+    ngx_conf_merge_msec_value(conf->adaptive_timeout_min,
+                              prev->adaptive_timeout_min, 20);
+    /* unset, never below the min even with a shorter read timeout */
+    ngx_conf_merge_msec_value(conf->adaptive_timeout_max,
+                              prev->adaptive_timeout_max,
+                              ngx_max(conf->upstream.read_timeout,
+                                      conf->adaptive_timeout_min));
+
+    if (conf->adaptive_timeout
+        && (conf->adaptive_timeout_min == 0
+            || conf->adaptive_timeout_min > conf->adaptive_timeout_max))
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"adserver_adaptive_timeout_min\" must be in "
+                           "1..adserver_adaptive_timeout_max");
+        return NGX_CONF_ERROR;
+    }
+
+    /* ngx_http_set_complex_value_slot wants NULL for unset */
+    if (conf->trace == NULL) {
+        conf->trace = prev->trace;
+    }
+
+    if (conf->batch_connect_timeout == NULL) {
+        conf->batch_connect_timeout = prev->batch_connect_timeout;
+    }
+
+    if (conf->batch_read_timeout == NULL) {
+        conf->batch_read_timeout = prev->batch_read_timeout;
+    }
+
+    if (conf->adaptive_timeout && conf->upstream.upstream) {
+        conf->sketch = ngx_pcalloc(cf->pool,
+                                   sizeof(ngx_http_adserver_sketch_t));
+        if (conf->sketch == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
     return NGX_CONF_OK;
 }
 
@@ -249,7 +512,6 @@ static ngx_int_t
 ngx_http_adserver_handler(ngx_http_request_t *r)
 {
     ngx_int_t                       rc;
-    ngx_http_upstream_t            *u;
     ngx_http_adserver_ctx_t       *ctx;
     ngx_http_adserver_loc_conf_t  *mlcf;
 
@@ -267,10 +529,49 @@ ngx_http_adserver_handler(ngx_http_request_t *r)
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    if (ngx_http_upstream_create(r) != NGX_OK) {
+    ctx = ngx_palloc(r->pool, sizeof(ngx_http_adserver_ctx_t));
+    if (ctx == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ctx->request = r;
+    ctx->batch = NULL;
+    ctx->slot = 0;
+
+    ngx_http_set_ctx(r, ctx, ngx_http_adserver_module);
+
+    mlcf = ngx_http_get_module_loc_conf(r, ngx_http_adserver_module);
+
+    if (mlcf->batch && mlcf->batch_size > 1) {
+        return ngx_http_adserver_batch_add(r, mlcf, ctx);
+    }
+
+    if (ngx_http_adserver_create_upstream(r, ctx) != NGX_OK) {
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
+    r->main->count++;
+
+    ngx_http_upstream_init(r);
+
+    return NGX_DONE;
+}
+
+
+static ngx_int_t
+ngx_http_adserver_create_upstream(ngx_http_request_t *r,
+    ngx_http_adserver_ctx_t *ctx)
+{
+    size_t                          buffer_size;
+    ngx_msec_t                      timeout, connect_timeout, read_timeout;
+    ngx_http_upstream_t            *u;
+    ngx_http_upstream_conf_t       *conf;
+    ngx_http_adserver_loc_conf_t  *mlcf;
+
+    if (ngx_http_upstream_create(r) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
     u = r->upstream;
 
     ngx_str_set(&u->schema, "adserver://");
@@ -280,43 +581,85 @@ ngx_http_adserver_handler(ngx_http_request_t *r)
 
     u->conf = &mlcf->upstream;
 
+    timeout = mlcf->sketch ? ngx_http_adserver_adaptive_timeout(mlcf) : 0;
+
+    connect_timeout = mlcf->upstream.connect_timeout;
+    read_timeout = timeout ? timeout : mlcf->upstream.read_timeout;
+    buffer_size = mlcf->upstream.buffer_size;
+
+    /*
+     * the leader's upstream serves them all, and the batched reply is read
+     * whole into its buffer, adserver_buffer_size for each member
+     */
+    if (ctx->batch) {
+        ngx_http_adserver_batch_timeouts(mlcf, ctx->batch, &connect_timeout,
+                                         &read_timeout);
+
+        buffer_size *= ctx->batch->n;
+    }
+
+    if (connect_timeout != mlcf->upstream.connect_timeout
+        || read_timeout != mlcf->upstream.read_timeout
+        || buffer_size != mlcf->upstream.buffer_size)
+    {
+        conf = ngx_palloc(r->pool, sizeof(ngx_http_upstream_conf_t));
+        if (conf == NULL) {
+            return NGX_ERROR;
+        }
+
+        *conf = mlcf->upstream;
+        conf->connect_timeout = connect_timeout;
+        conf->read_timeout = read_timeout;
+        conf->buffer_size = buffer_size;
+        u->conf = conf;
+    }
+
     u->create_request = ngx_http_adserver_create_request;
     u->reinit_request = ngx_http_adserver_reinit_request;
     u->process_header = ngx_http_adserver_process_header;
     u->abort_request = ngx_http_adserver_abort_request;
     u->finalize_request = ngx_http_adserver_finalize_request;
 
-    ctx = ngx_palloc(r->pool, sizeof(ngx_http_adserver_ctx_t));
-    if (ctx == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
-    }
-
-    ctx->request = r;
-
-    ngx_http_set_ctx(r, ctx, ngx_http_adserver_module);
-
     u->input_filter_init = ngx_http_adserver_filter_init;
     u->input_filter = ngx_http_adserver_filter;
     u->input_filter_ctx = ctx;
 
-    r->main->count++;
-
-    ngx_http_upstream_init(r);
-
-    return NGX_DONE;
+    return NGX_OK;
 }
 
 
 static ngx_int_t
 ngx_http_adserver_create_request(ngx_http_request_t *r)
 {
-    size_t                          len;
-    uint32_t                        *p;
+    size_t                          len, ext;
+    uint32_t                        *p, magic;
+    ngx_str_t                       trace;
     ngx_buf_t                      *b;
     ngx_chain_t                    *cl;
     ngx_http_adserver_ctx_t       *ctx;
+    ngx_http_adserver_loc_conf_t  *mlcf;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_adserver_module);
+
+    if (ctx->batch) {
+        return ngx_http_adserver_batch_create_request(r, ctx);
+    }
+
+    mlcf = ngx_http_get_module_loc_conf(r, ngx_http_adserver_module);
+
+    ngx_str_null(&trace);
+
+    if (mlcf->trace
+        && ngx_http_complex_value(r, mlcf->trace, &trace) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
 
-    len = ADSERVER_HEADER_LENGTH + r->args.len;
+    /* no trace context, the adserver gets a plain frame */
+    ext = trace.len ? ADSERVER_ITEM_LENGTH + trace.len : 0;
+    magic = trace.len ? ADSERVER_TRACE_MAGIC : ADSERVER_HEADER_MAGIC;
+
+    len = ADSERVER_HEADER_LENGTH + ext + r->args.len;
 
     ngx_log_error(NGX_LOG_DEBUG, r->connection->log, 0, 
             "[adserver] protobuf length = %d", r->args.len);
@@ -337,16 +680,24 @@ ngx_http_adserver_create_request(ngx_http_request_t *r)
 
     /* set request header */
     p = (uint32_t *)b->last;
-    *p++ = ADSERVER_HEADER_MAGIC;
-    *p = htonl(r->args.len);
+    *p++ = magic;
+    *p = htonl(ext + r->args.len);
     b->last += ADSERVER_HEADER_LENGTH;
 
+    if (ext) {
+        p = (uint32_t *)b->last;
+        *p = htonl(trace.len);
+        b->last += ADSERVER_ITEM_LENGTH;
+        b->last = ngx_copy(b->last, trace.data, trace.len);
+    }
+
     /* set request body */
-    ctx = ngx_http_get_module_ctx(r, ngx_http_adserver_module);
     ctx->key.data = b->last;
     b->last = ngx_copy(b->last, r->args.data, r->args.len);
     ctx->key.len = b->last - ctx->key.data;
 
+    ADSERVER_PROBE4(frame__send, r, magic, ext + r->args.len, 1);
+
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http adserver request: \"%V\"", &ctx->key);
 
@@ -364,8 +715,9 @@ ngx_http_adserver_reinit_request(ngx_http_request_t *r)
 static ngx_int_t
 ngx_http_adserver_process_header(ngx_http_request_t *r)
 {
-    uint32_t                *p;
-    ngx_http_upstream_t     *u;
+    uint32_t                 *p, magic;
+    ngx_http_upstream_t      *u;
+    ngx_http_adserver_ctx_t  *ctx;
 
     u = r->upstream;
 
@@ -373,8 +725,11 @@ ngx_http_adserver_process_header(ngx_http_request_t *r)
         return NGX_AGAIN;
     } 
 
+    ctx = ngx_http_get_module_ctx(r, ngx_http_adserver_module);
+    magic = ctx->batch ? ADSERVER_BATCH_MAGIC : ADSERVER_HEADER_MAGIC;
+
     p = (uint32_t *)u->buffer.pos; 
-    if(*p++ != ADSERVER_HEADER_MAGIC) {
+    if(*p++ != magic) {
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
                   "adserver sent invalid response");
 
@@ -385,6 +740,8 @@ ngx_http_adserver_process_header(ngx_http_request_t *r)
     u->headers_in.status_n = 200;
     u->state->status = 200;
     u->buffer.pos += ADSERVER_HEADER_LENGTH;
+
+    ADSERVER_PROBE3(frame__receive, r, magic, u->headers_in.content_length_n);
     
     return NGX_OK;
 }
@@ -469,7 +826,634 @@ ngx_http_adserver_abort_request(ngx_http_request_t *r)
 static void
 ngx_http_adserver_finalize_request(ngx_http_request_t *r, ngx_int_t rc)
 {
+    ngx_msec_int_t                  ms;
+    ngx_http_upstream_t            *u;
+    ngx_http_adserver_ctx_t        *ctx;
+    ngx_http_adserver_loc_conf_t  *mlcf;
+
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "finalize http adserver request");
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_adserver_module);
+    mlcf = ngx_http_get_module_loc_conf(r, ngx_http_adserver_module);
+    u = r->upstream;
+
+    /*
+     * $upstream_response_time of this try, already made relative here. A
+     * timed out one counts with what it waited, leaving it out would pull
+     * the percentile below the timeout and shrink it further. The peer is
+     * set once the try connects, a reply within the same millisecond counts
+     * as 0 ms.
+     */
+    if (mlcf->sketch && u->state && u->state->peer) {
+        ms = (ngx_msec_int_t) (u->state->response_sec * 1000
+                               + u->state->response_msec);
+
+        ngx_http_adserver_sketch_add(mlcf->sketch, ngx_max(ms, 0));
+    }
+
+    if (ctx && ctx->batch) {
+        ngx_http_adserver_batch_split(r, ctx, rc);
+    }
+
     return;
 }
+
+
+/*------------------------------- batching -----------------------------------*/
+
+static ngx_int_t
+ngx_http_adserver_batch_add(ngx_http_request_t *r,
+    ngx_http_adserver_loc_conf_t *mlcf, ngx_http_adserver_ctx_t *ctx)
+{
+    ngx_pool_cleanup_t          *cln;
+    ngx_http_adserver_batch_t   *batch;
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    batch = mlcf->pending;
+
+    if (batch == NULL) {
+        batch = ngx_alloc(sizeof(ngx_http_adserver_batch_t)
+                          + (mlcf->batch_size - 1)
+                            * sizeof(ngx_http_request_t *),
+                          r->connection->log);
+        if (batch == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        /* the pending reference is dropped by ngx_http_adserver_batch_flush */
+        batch->refs = 1;
+        batch->n = 0;
+
+        mlcf->pending = batch;
+    }
+
+    ctx->batch = batch;
+    ctx->slot = batch->n;
+
+    batch->members[batch->n++] = r;
+    batch->refs++;
+
+    cln->handler = ngx_http_adserver_batch_cleanup;
+    cln->data = ctx;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "adserver batch add slot:%ui args:%uz",
+                   ctx->slot, r->args.len);
+
+    r->main->count++;
+
+    if (batch->n == (ngx_uint_t) mlcf->batch_size) {
+        ngx_http_adserver_batch_flush(mlcf);
+        return NGX_DONE;
+    }
+
+    if (batch->n == 1) {
+        mlcf->batch_event.log = ngx_cycle->log;
+
+        if (mlcf->batch_window) {
+            ngx_add_timer(&mlcf->batch_event, mlcf->batch_window);
+
+        } else {
+            /* flush once the current event loop iteration is over */
+            ngx_post_event(&mlcf->batch_event, &ngx_posted_events);
+        }
+    }
+
+    return NGX_DONE;
+}
+
+
+static void
+ngx_http_adserver_batch_handler(ngx_event_t *ev)
+{
+    ngx_http_adserver_batch_flush(ev->data);
+}
+
+
+static void
+ngx_http_adserver_batch_flush(ngx_http_adserver_loc_conf_t *mlcf)
+{
+    ngx_uint_t                   i;
+    ngx_connection_t            *c;
+    ngx_http_request_t          *r;
+    ngx_http_adserver_ctx_t     *ctx;
+    ngx_http_adserver_batch_t   *batch;
+
+    batch = mlcf->pending;
+    mlcf->pending = NULL;
+
+    if (mlcf->batch_event.timer_set) {
+        ngx_del_timer(&mlcf->batch_event);
+    }
+
+    /* a posted flush may arrive after the batch has been flushed on size */
+    if (batch == NULL) {
+        return;
+    }
+
+    r = NULL;
+
+    for (i = 0; i < batch->n; i++) {
+        if (batch->members[i]) {
+            r = batch->members[i];
+            break;
+        }
+    }
+
+    if (r == NULL) {
+        ngx_http_adserver_batch_release(batch);
+        return;
+    }
+
+    c = r->connection;
+    ctx = ngx_http_get_module_ctx(r, ngx_http_adserver_module);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "adserver batch flush members:%ui leader:%ui",
+                   batch->n, ctx->slot);
+
+    if (ngx_http_adserver_create_upstream(r, ctx) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "adserver batch create upstream failed");
+
+        batch->refs++;
+
+        for (i = 0; i < batch->n; i++) {
+            if (batch->members[i]) {
+                ngx_http_adserver_batch_deliver(batch->members[i], NULL,
+                                        NULL, 0, NGX_HTTP_INTERNAL_SERVER_ERROR);
+            }
+        }
+
+        ngx_http_adserver_batch_release(batch);
+        ngx_http_adserver_batch_release(batch);
+        return;
+    }
+
+    ngx_http_adserver_batch_release(batch);
+
+    ngx_http_upstream_init(r);
+    ngx_http_run_posted_requests(c);
+}
+
+
+static ngx_int_t
+ngx_http_adserver_batch_create_request(ngx_http_request_t *r,
+    ngx_http_adserver_ctx_t *ctx)
+{
+    size_t                       len;
+    uint32_t                    *p, n;
+    ngx_buf_t                   *b;
+    ngx_str_t                   *args;
+    ngx_uint_t                   i;
+    ngx_chain_t                 *cl;
+    ngx_http_adserver_batch_t   *batch;
+
+    static ngx_str_t  empty = ngx_null_string;
+
+    batch = ctx->batch;
+
+    /* members gone meanwhile keep their slot with an empty payload */
+    len = 0;
+
+    for (i = 0; i < batch->n; i++) {
+        len += ADSERVER_ITEM_LENGTH;
+
+        if (batch->members[i]) {
+            len += batch->members[i]->args.len;
+        }
+    }
+
+    b = ngx_create_temp_buf(r->pool, ADSERVER_HEADER_LENGTH + len);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    cl = ngx_alloc_chain_link(r->pool);
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    cl->buf = b;
+    cl->next = NULL;
+    r->upstream->request_bufs = cl;
+
+    /* set request header */
+    p = (uint32_t *)b->last;
+    *p++ = ADSERVER_BATCH_MAGIC;
+    *p = htonl(len);
+    b->last += ADSERVER_HEADER_LENGTH;
+
+    /* set request items */
+    ctx->key.data = b->last;
+
+    for (i = 0; i < batch->n; i++) {
+        args = batch->members[i] ? &batch->members[i]->args : &empty;
+
+        n = htonl(args->len);
+        b->last = ngx_cpymem(b->last, &n, ADSERVER_ITEM_LENGTH);
+        b->last = ngx_copy(b->last, args->data, args->len);
+    }
+
+    ctx->key.len = b->last - ctx->key.data;
+
+    ADSERVER_PROBE4(frame__send, r, ADSERVER_BATCH_MAGIC, len, batch->n);
+
+    ngx_log_error(NGX_LOG_DEBUG, r->connection->log, 0, 
+            "[adserver] batch members = %ui, protobuf length = %uz",
+            batch->n, len);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_adserver_batch_split(ngx_http_request_t *r,
+    ngx_http_adserver_ctx_t *ctx, ngx_int_t rc)
+{
+    size_t                       len;
+    u_char                      *p, *last, *data;
+    uint32_t                     n;
+    ngx_uint_t                   i, status;
+    ngx_http_request_t          *m;
+    ngx_http_upstream_t         *u;
+    ngx_http_adserver_batch_t   *batch;
+
+    u = r->upstream;
+    batch = ctx->batch;
+
+    /* members may be finalized and freed below, keep the batch meanwhile */
+    batch->refs++;
+
+    if (rc == NGX_OK && u->headers_in.status_n == NGX_HTTP_OK
+        && u->length == 0)
+    {
+        status = NGX_HTTP_OK;
+
+    } else if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+        status = rc;
+
+    } else {
+        status = NGX_HTTP_BAD_GATEWAY;
+    }
+
+    p = u->buffer.pos;
+    last = u->buffer.last;
+
+    for (i = 0; i < batch->n; i++) {
+        data = NULL;
+        len = 0;
+
+        if (status == NGX_HTTP_OK) {
+            if (last - p < ADSERVER_ITEM_LENGTH) {
+                status = NGX_HTTP_BAD_GATEWAY;
+
+            } else {
+                ngx_memcpy(&n, p, ADSERVER_ITEM_LENGTH);
+                p += ADSERVER_ITEM_LENGTH;
+                len = ntohl(n);
+
+                if ((size_t) (last - p) < len) {
+                    status = NGX_HTTP_BAD_GATEWAY;
+
+                } else {
+                    data = p;
+                    p += len;
+                }
+            }
+
+            if (status != NGX_HTTP_OK) {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                              "adserver sent truncated batch response");
+                len = 0;
+            }
+        }
+
+        m = batch->members[i];
+
+        if (m == NULL) {
+            continue;
+        }
+
+        if (m == r) {
+            u->buffer.pos = data ? data : last;
+            u->buffer.last = data ? data + len : last;
+
+            if (u->state && status != NGX_HTTP_OK) {
+                u->state->status = status;
+            }
+
+            continue;
+        }
+
+        ngx_http_adserver_batch_deliver(m, u, data, len, status);
+    }
+
+    ngx_http_adserver_batch_release(batch);
+}
+
+
+static void
+ngx_http_adserver_batch_deliver(ngx_http_request_t *r,
+    ngx_http_upstream_t *src, u_char *data, size_t len, ngx_uint_t status)
+{
+    ngx_connection_t     *c;
+    ngx_http_upstream_t  *u;
+
+    c = r->connection;
+
+    if (ngx_http_upstream_create(r) != NGX_OK) {
+        goto failed;
+    }
+
+    u = r->upstream;
+
+    if (r->upstream_states == NULL) {
+        r->upstream_states = ngx_array_create(r->pool, 1,
+                                            sizeof(ngx_http_upstream_state_t));
+        if (r->upstream_states == NULL) {
+            goto failed;
+        }
+    }
+
+    u->state = ngx_array_push(r->upstream_states);
+    if (u->state == NULL) {
+        goto failed;
+    }
+
+    ngx_memzero(u->state, sizeof(ngx_http_upstream_state_t));
+
+    u->state->status = status;
+    u->headers_in.status_n = status;
+
+    if (src && src->state) {
+        u->state->response_sec = src->state->response_sec;
+        u->state->response_msec = src->state->response_msec;
+        u->state->peer = src->state->peer;
+    }
+
+    /* the leader buffer lives in another request pool, copy our part */
+    if (len) {
+        u->buffer.start = ngx_pnalloc(r->pool, len);
+        if (u->buffer.start == NULL) {
+            goto failed;
+        }
+
+        u->buffer.pos = u->buffer.start;
+        u->buffer.last = ngx_cpymem(u->buffer.pos, data, len);
+        u->buffer.end = u->buffer.last;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "adserver batch deliver status:%ui length:%uz",
+                   status, len);
+
+    ngx_http_finalize_request(r, NGX_OK);
+    ngx_http_run_posted_requests(c);
+
+    return;
+
+failed:
+
+    ngx_http_finalize_request(r, NGX_ERROR);
+    ngx_http_run_posted_requests(c);
+}
+
+
+static void
+ngx_http_adserver_batch_cleanup(void *data)
+{
+    ngx_http_adserver_ctx_t  *ctx = data;
+
+    if (ctx->batch == NULL) {
+        return;
+    }
+
+    ctx->batch->members[ctx->slot] = NULL;
+
+    ngx_http_adserver_batch_release(ctx->batch);
+    ctx->batch = NULL;
+}
+
+
+static void
+ngx_http_adserver_batch_release(ngx_http_adserver_batch_t *batch)
+{
+    if (--batch->refs == 0) {
+        ngx_free(batch);
+    }
+}
+
+
+/*
+ * Shortest timeouts of the live members. A member without one of its own,
+ * or with a value that isn't a positive msec count, has the one passed in.
+ */
+static void
+ngx_http_adserver_batch_timeouts(ngx_http_adserver_loc_conf_t *mlcf,
+    ngx_http_adserver_batch_t *batch, ngx_msec_t *connect_timeout,
+    ngx_msec_t *read_timeout)
+{
+    ngx_uint_t           i;
+    ngx_msec_t           connect, read, timeout;
+    ngx_http_request_t  *m;
+
+    if (mlcf->batch_connect_timeout == NULL
+        && mlcf->batch_read_timeout == NULL)
+    {
+        return;
+    }
+
+    connect = 0;
+    read = 0;
+
+    for (i = 0; i < batch->n; i++) {
+        m = batch->members[i];
+
+        if (m == NULL) {
+            continue;
+        }
+
+        timeout = ngx_http_adserver_member_timeout(m,
+                                                   mlcf->batch_connect_timeout,
+                                                   *connect_timeout);
+        if (connect == 0 || timeout < connect) {
+            connect = timeout;
+        }
+
+        timeout = ngx_http_adserver_member_timeout(m, mlcf->batch_read_timeout,
+                                                   *read_timeout);
+        if (read == 0 || timeout < read) {
+            read = timeout;
+        }
+    }
+
+    if (connect == 0) {
+        return;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "adserver batch timeouts connect:%M read:%M",
+                   connect, read);
+
+    *connect_timeout = connect;
+    *read_timeout = read;
+}
+
+
+static ngx_msec_t
+ngx_http_adserver_member_timeout(ngx_http_request_t *r,
+    ngx_http_complex_value_t *cv, ngx_msec_t timeout)
+{
+    ngx_int_t  n;
+    ngx_str_t  value;
+
+    if (cv == NULL || ngx_http_complex_value(r, cv, &value) != NGX_OK) {
+        return timeout;
+    }
+
+    n = ngx_atoi(value.data, value.len);
+
+    return n > 0 ? (ngx_msec_t) n : timeout;
+}
+
+
+/*---------------------------- adaptive timeout ------------------------------*/
+
+/*
+ * Read timeout from the recent response times, clamped to the configured
+ * range. 0 keeps adserver_read_timeout until there are enough samples.
+ */
+static ngx_msec_t
+ngx_http_adserver_adaptive_timeout(ngx_http_adserver_loc_conf_t *mlcf)
+{
+    ngx_uint_t                   i, rank, seen, count;
+    ngx_msec_t                   timeout;
+    ngx_http_adserver_sketch_t  *sketch;
+
+    sketch = mlcf->sketch;
+
+    if (sketch->timeout_sec == ngx_time()) {
+        return sketch->timeout;
+    }
+
+    sketch->timeout_sec = ngx_time();
+    sketch->timeout = 0;
+
+    ngx_http_adserver_sketch_rotate(sketch);
+
+    count = sketch->count[0] + sketch->count[1];
+
+    if (count < ADSERVER_ADAPTIVE_SAMPLES) {
+        return 0;
+    }
+
+    rank = count * ADSERVER_ADAPTIVE_QUANTILE / 100;
+    seen = 0;
+
+    for (i = 0; i < ADSERVER_SKETCH_BUCKETS; i++) {
+        seen += sketch->buckets[0][i] + sketch->buckets[1][i];
+        if (seen >= rank) {
+            break;
+        }
+    }
+
+    if (i == ADSERVER_SKETCH_BUCKETS) {
+        i--;
+    }
+
+    timeout = (ngx_msec_t) ngx_http_adserver_sketch_upper(i)
+              * ADSERVER_ADAPTIVE_PERCENT / 100 + 1;
+
+    timeout = ngx_max(timeout, mlcf->adaptive_timeout_min);
+    timeout = ngx_min(timeout, mlcf->adaptive_timeout_max);
+
+    sketch->timeout = timeout;
+
+    return timeout;
+}
+
+
+static void
+ngx_http_adserver_sketch_add(ngx_http_adserver_sketch_t *sketch,
+    ngx_msec_t msec)
+{
+    ngx_uint_t  i;
+
+    ngx_http_adserver_sketch_rotate(sketch);
+
+    i = ngx_http_adserver_sketch_index(msec > 0xffffffff ? 0xffffffff
+                                                         : (uint32_t) msec);
+
+    sketch->buckets[sketch->current][i]++;
+    sketch->count[sketch->current]++;
+}
+
+
+/* an idle gap longer than two windows leaves nothing worth keeping */
+static void
+ngx_http_adserver_sketch_rotate(ngx_http_adserver_sketch_t *sketch)
+{
+    time_t  now;
+
+    now = ngx_time();
+
+    if (now - sketch->start < ADSERVER_SKETCH_WINDOW) {
+        return;
+    }
+
+    sketch->current ^= 1;
+    sketch->count[sketch->current] = 0;
+    ngx_memzero(sketch->buckets[sketch->current],
+                sizeof(sketch->buckets[0]));
+
+    if (now - sketch->start >= 2 * ADSERVER_SKETCH_WINDOW) {
+        sketch->count[sketch->current ^ 1] = 0;
+        ngx_memzero(sketch->buckets[sketch->current ^ 1],
+                    sizeof(sketch->buckets[0]));
+    }
+
+    sketch->start = now;
+}
+
+
+static ngx_uint_t
+ngx_http_adserver_sketch_index(uint32_t value)
+{
+    ngx_int_t  shift;
+    uint32_t   sub;
+
+    sub = 1 << ADSERVER_SKETCH_SUB_BITS;
+
+    if (value < sub) {
+        return value;
+    }
+
+    shift = 31 - __builtin_clz(value) - ADSERVER_SKETCH_SUB_BITS;
+
+    return ((shift + 1) << ADSERVER_SKETCH_SUB_BITS) + (value >> shift) - sub;
+}
+
+
+/* the largest value going to bucket i */
+static uint32_t
+ngx_http_adserver_sketch_upper(ngx_uint_t i)
+{
+    ngx_int_t  shift;
+    uint32_t   sub;
+
+    sub = 1 << ADSERVER_SKETCH_SUB_BITS;
+
+    if (i < sub) {
+        return i;
+    }
+
+    shift = (i >> ADSERVER_SKETCH_SUB_BITS) - 1;
+
+    return ((sub + (i & (sub - 1))) << shift) + ((1 << shift) - 1);
+}
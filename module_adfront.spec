@@ -8,6 +8,7 @@ License:        adplateform
 URL:	        %{_svn_path} 	
 
 BuildRequires: protobuf >= 5.0.0-1
+BuildRequires: systemtap-sdt-devel
 Requires: protobuf >= 5.0.0-1
 
 %description
@@ -27,6 +28,17 @@ mkdir -p $PWD/%{_prefix}/include/plugin_manager
 cp $OLDPWD/module_adfront/plugin_manager/plugin.h $PWD/%{_prefix}/include/plugin_manager
 cp $OLDPWD/module_adfront/plugin_manager/plugin_config.h $PWD/%{_prefix}/include/plugin_manager
 cp $OLDPWD/module_adfront/plugin_manager/plugin_manager.conf.pb.h $PWD/%{_prefix}/include/plugin_manager
+cp $OLDPWD/module_adfront/plugin_manager/task_scheduler.h $PWD/%{_prefix}/include/plugin_manager
+cp $OLDPWD/module_adfront/plugin_manager/coroutine_plugin.h $PWD/%{_prefix}/include/plugin_manager
+cp $OLDPWD/module_adfront/plugin_manager/endpoint.h $PWD/%{_prefix}/include/plugin_manager
+cp $OLDPWD/module_adfront/plugin_manager/histogram.h $PWD/%{_prefix}/include/plugin_manager
+cp $OLDPWD/module_adfront/plugin_manager/metrics.h $PWD/%{_prefix}/include/plugin_manager
+cp $OLDPWD/module_adfront/plugin_manager/perf_counters.h $PWD/%{_prefix}/include/plugin_manager
+cp $OLDPWD/module_adfront/plugin_manager/cpu_profiler.h $PWD/%{_prefix}/include/plugin_manager
+cp $OLDPWD/module_adfront/plugin_manager/alloc_tracker.h $PWD/%{_prefix}/include/plugin_manager
+cp $OLDPWD/module_adfront/plugin_manager/capture.h $PWD/%{_prefix}/include/plugin_manager
+cp $OLDPWD/module_adfront/plugin_manager/trace.h $PWD/%{_prefix}/include/plugin_manager
+cp $OLDPWD/module_adfront/plugin_manager/logger.h $PWD/%{_prefix}/include/plugin_manager
 
 #copy plugin manager dynamic library
 mkdir -p $PWD/%{_prefix}/lib64
@@ -38,9 +50,11 @@ mkdir -p $PWD/%{_prefix}/adplatform/nginx_adfront
 mkdir -p $PWD/%{_prefix}/adplatform/nginx_adfront/sbin
 mkdir -p $PWD/%{_prefix}/adplatform/nginx_adfront/logs
 mkdir -p $PWD/%{_prefix}/adplatform/nginx_adfront/plugin_manager
+mkdir -p $PWD/%{_prefix}/adplatform/nginx_adfront/tools
 
 cp $OLDPWD/objs/nginx $PWD/%{_prefix}/adplatform/nginx_adfront/sbin
 cp -r $OLDPWD/conf $PWD/%{_prefix}/adplatform/nginx_adfront
+cp $OLDPWD/module_adfront/tools/*.bt $PWD/%{_prefix}/adplatform/nginx_adfront/tools
 
 %post
 /sbin/ldconfig
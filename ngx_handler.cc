@@ -1,18 +1,101 @@
 #include "ngx_handler.h"
+#include "ngx_http_adfront_probes.h"
 
 #include <assert.h>
-#include <iostream>
+#include <errno.h>
+#include <execinfo.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
 
 using namespace std;
 using namespace sharelib;
 
 namespace ngx_handler {
 
-Handler::Handler(): plugin_manager_(NULL) {
+static const char* kPhaseNames[] = {"handle", "post_subhandle"};
+static const char* kRcNames[] = {"ok", "error", "again", "not_found", "yield", "other"};
+
+static int64_t NowUs() {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/*
+ * Watchdog for the sampled calls: a per thread timer armed for the slow call
+ * threshold around the call. If it fires, the call is still running and the
+ * signal lands on its stack. nginx uses no realtime signals, the watchdog
+ * takes SIGRTMAX - 1.
+ */
+#define WATCHDOG_SIGNAL     (SIGRTMAX - 1)
+#define WATCHDOG_FRAMES     64
+
+static __thread timer_t watchdog_timer;
+static __thread int watchdog_state = 0;         /* 0 unset, 1 ok, -1 failed */
+static __thread unsigned watchdog_calls = 0;
+static __thread const char* watchdog_plugin = NULL;
+static time_t watchdog_last = 0;               /* all threads, CAS only */
+
+/* opened by each thread on its first sampled call, kept for its life */
+static __thread PerfCounters* perf_counters = NULL;
+static __thread int perf_state = 0;             /* 0 unset, 1 ok, -1 failed */
+static __thread unsigned perf_calls = 0;
+
+/* async signal safe only: write and backtrace, which was loaded at init */
+static void WatchdogSignal(int signo) {
+    void* frames[WATCHDOG_FRAMES];
+    const char* plugin = watchdog_plugin;
+    time_t now = time(NULL);
+    time_t last = __atomic_load_n(&watchdog_last, __ATOMIC_RELAXED);
+
+    /* at most one dump a second, for all threads */
+    if(plugin == NULL || now == last
+            || !__sync_bool_compare_and_swap(&watchdog_last, last, now)) {
+        return;
+    }
+
+    const char head[] = "[adfront] slow plugin call still running, plugin=";
+    if(write(STDERR_FILENO, head, sizeof(head) - 1) < 0
+            || write(STDERR_FILENO, plugin, strlen(plugin)) < 0
+            || write(STDERR_FILENO, "\n", 1) < 0) {
+        return;
+    }
+
+    int n = backtrace(frames, WATCHDOG_FRAMES);
+    backtrace_symbols_fd(frames, n, STDERR_FILENO);
+}
+
+
+static void DisarmWatchdog() {
+    struct itimerspec its;
+
+    watchdog_plugin = NULL;
+
+    memset(&its, 0, sizeof(its));
+    timer_settime(watchdog_timer, 0, &its, NULL);
+}
+
+
+Handler::Handler(): plugin_manager_(NULL), offload_pool_(NULL), 
+    task_scheduler_(NULL), not_found_(NULL), slow_usec_(0), backtrace_every_(0),
+    perf_every_(0) {
 }
 
 
 Handler::~Handler() {
+    /* join offload threads before plugins go away */
+    if(offload_pool_)
+        delete offload_pool_;
+
+    if(task_scheduler_)
+        delete task_scheduler_;
+
     if(plugin_manager_)
         delete plugin_manager_;
 }
@@ -35,35 +118,547 @@ int Handler::InitProcess() {
         return PLUGIN_ERROR;
     }
 
-    return plugin_manager_->Init(config_file_); 
+    int rc = plugin_manager_->Init(config_file_); 
+    if (rc != PLUGIN_OK) {
+        return rc;
+    }
+
+    InitMetrics();
+
+    return PLUGIN_OK;
 }
 
 
 int Handler::Handle(PluginContext &ctx) {
-    STR_MAP::const_iterator iter = ctx.headers_in_.find(HTTP_REQUEST_PLUGINNAME);
+    Plugin* plugin = FindPlugin(ctx);
+    if (plugin == NULL) {
+        __sync_fetch_and_add(not_found_, 1);
+        return PLUGIN_NOT_FOUND;
+    }
+
+    return Call(plugin, ctx, OFFLOAD_HANDLE);
+}
 
-    assert(iter != ctx.headers_in_.end());
 
-    Plugin* plugin = static_cast<Plugin *>(plugin_manager_->GetPlugin(iter->second));
+int Handler::PostSubHandle(PluginContext &ctx) {
+    Plugin* plugin = FindPlugin(ctx);
     if (plugin == NULL) {
+        __sync_fetch_and_add(not_found_, 1);
         return PLUGIN_NOT_FOUND;
     }
 
-    return plugin->Handle(ctx);
+    return Call(plugin, ctx, OFFLOAD_POST_SUBHANDLE);
 }
 
 
-int Handler::PostSubHandle(PluginContext &ctx) {
+int Handler::Call(Plugin* plugin, PluginContext &ctx, OffloadPhase phase) {
+    int rc;
+
+    uint64_t before[PerfCounters::kCount];
+
+    ctx.StartSlice();
+
+    PerfCounters* perf = SamplePerf();
+    if (perf != NULL && perf->Read(before) != 0) {
+        perf = NULL;
+    }
+
+    const char* name = PluginName(plugin);
+
+    /* plugin spans go under this one */
+    int span = -1;
+    if (ctx.trace_.Sampled()) {
+        span = ctx.trace_.StartSpan(string(name) + "." + kPhaseNames[phase]);
+    }
+
+    AllocCounts allocs = {0, 0};
+    AllocCounts* outer = AllocTracker::Swap(&allocs);
+
+    const char* tag = CpuProfiler::SetTag(name);
+    bool armed = ArmWatchdog(ctx);
+    int64_t start = NowUs();
+
+    ADFRONT_PROBE3(plugin__entry, &ctx, name, phase);
+
+    if (phase == OFFLOAD_HANDLE) {
+        rc = plugin->Handle(ctx);
+    } else {
+        rc = plugin->PostSubHandle(ctx);
+    }
+
+    int64_t usec = NowUs() - start;
+    if (armed) {
+        DisarmWatchdog();
+    }
+
+    ADFRONT_PROBE5(plugin__return, &ctx, name, phase, rc, usec);
+
+    CpuProfiler::SetTag(tag);
+
+    AllocTracker::Swap(outer);
+    ctx.alloc_count_ += allocs.count;
+    ctx.alloc_bytes_ += allocs.bytes;
+
+    if (span >= 0) {
+        ctx.trace_.SetAttribute(span, "adfront.rc", 
+                kRcNames[rc <= 0 && rc >= PLUGIN_YIELD ? -rc : 5]);
+        if (rc == PLUGIN_ERROR) {
+            ctx.trace_.SetError(span);
+        }
+        ctx.trace_.EndSpan(span);
+    }
+
+    if (perf != NULL) {
+        RecordPerf(plugin, perf, before);
+    }
+
+    RecordMetrics(plugin, phase, usec, rc);
+
+    if (slow_usec_ > 0 && usec >= slow_usec_) {
+        SlowCall(plugin, ctx, phase, usec, 1);
+    }
+
+    return rc;
+}
+
+
+int Handler::HandleLocal(PluginContext &ctx, OffloadPhase phase) {
+    int rc;
+
+    /* the caller waits for the answer, so the time slice is the caller's */
+    do {
+        if(phase == OFFLOAD_HANDLE) {
+            rc = Handle(ctx);
+        } else {
+            rc = PostSubHandle(ctx);
+        }
+    } while(rc == PLUGIN_YIELD);
+
+    return rc;
+}
+
+
+void Handler::HandleBatch(PluginContext **ctxs, int *rcs, size_t n) {
+    vector<Plugin *> plugins(n);
+    vector<bool> done(n, false);
+
+    /* the whole batch shares one time slice */
+    for(size_t i = 0; i < n; i++) {
+        plugins[i] = FindPlugin(*ctxs[i]);
+        ctxs[i]->StartSlice();
+    }
+
+    vector<PluginContext *> batch_ctxs;
+    vector<size_t> batch_index;
+    vector<int> batch_rcs;
+
+    for(size_t i = 0; i < n; i++) {
+        if(done[i]) {
+            continue;
+        }
+
+        if(plugins[i] == NULL) {
+            __sync_fetch_and_add(not_found_, 1);
+            rcs[i] = PLUGIN_NOT_FOUND;
+            done[i] = true;
+            continue;
+        }
+
+        batch_ctxs.clear();
+        batch_index.clear();
+
+        for(size_t j = i; j < n; j++) {
+            if(!done[j] && plugins[j] == plugins[i]) {
+                batch_ctxs.push_back(ctxs[j]);
+                batch_index.push_back(j);
+                done[j] = true;
+            }
+        }
+
+        batch_rcs.assign(batch_ctxs.size(), PLUGIN_ERROR);
+
+        const char* name = PluginName(plugins[i]);
+
+        /* each sampled request gets a span of the whole batch */
+        vector<int> spans(batch_ctxs.size(), -1);
+        for(size_t k = 0; k < batch_ctxs.size(); k++) {
+            if (batch_ctxs[k]->trace_.Sampled()) {
+                spans[k] = batch_ctxs[k]->trace_.StartSpan(string(name) + ".handle_batch");
+            }
+        }
+
+        AllocCounts allocs = {0, 0};
+        AllocCounts* outer = AllocTracker::Swap(&allocs);
+
+        const char* tag = CpuProfiler::SetTag(name);
+        bool armed = ArmWatchdog(*batch_ctxs[0]);
+        int64_t start = NowUs();
+
+        ADFRONT_PROBE3(plugin__batch__entry, batch_ctxs[0], name, batch_ctxs.size());
+
+        plugins[i]->HandleBatch(&batch_ctxs[0], &batch_rcs[0], batch_ctxs.size());
+        int64_t total = NowUs() - start;
+        int64_t usec = total / batch_ctxs.size();
+
+        if (armed) {
+            DisarmWatchdog();
+        }
+
+        ADFRONT_PROBE4(plugin__batch__return, batch_ctxs[0], name, 
+                batch_ctxs.size(), total);
+
+        CpuProfiler::SetTag(tag);
+        AllocTracker::Swap(outer);
+
+        /* the loop was blocked for the whole batch */
+        if (slow_usec_ > 0 && total >= slow_usec_) {
+            SlowCall(plugins[i], *batch_ctxs[0], OFFLOAD_HANDLE, total, 
+                    batch_ctxs.size());
+        }
+
+        /* each request is charged its share of the batch */
+        for(size_t k = 0; k < batch_index.size(); k++) {
+            rcs[batch_index[k]] = batch_rcs[k];
+            batch_ctxs[k]->alloc_count_ += allocs.count / batch_ctxs.size();
+            batch_ctxs[k]->alloc_bytes_ += allocs.bytes / batch_ctxs.size();
+            RecordMetrics(plugins[i], OFFLOAD_HANDLE, usec, batch_rcs[k]);
+
+            if (spans[k] >= 0) {
+                char n[16];
+
+                snprintf(n, sizeof(n), "%zu", batch_ctxs.size());
+                batch_ctxs[k]->trace_.SetAttribute(spans[k], "adfront.batch", n);
+                batch_ctxs[k]->trace_.EndSpan(spans[k]);
+            }
+        }
+    }
+}
+
+
+int Handler::InitOffload(size_t threads, size_t task_threads) {
+    if(!plugin_manager_->HasOffload() || threads == 0) {
+        return PLUGIN_NOT_FOUND;
+    }
+
+    if(task_threads > 0) {
+        task_scheduler_ = new TaskScheduler();
+        if(task_scheduler_->Start(task_threads) != 0) {
+            delete task_scheduler_;
+            task_scheduler_ = NULL;
+
+            return PLUGIN_ERROR;
+        }
+    }
+
+    offload_pool_ = new ThreadPool();
+    if(offload_pool_->Start(threads) != 0) {
+        delete offload_pool_;
+        offload_pool_ = NULL;
+
+        return PLUGIN_ERROR;
+    }
+
+    return PLUGIN_OK;
+}
+
+
+bool Handler::IsOffload(const PluginContext &ctx) {
+    if(offload_pool_ == NULL) {
+        return false;
+    }
+
     STR_MAP::const_iterator iter = ctx.headers_in_.find(HTTP_REQUEST_PLUGINNAME);
 
     assert(iter != ctx.headers_in_.end());
 
-    Plugin* plugin = static_cast<Plugin *>(plugin_manager_->GetPlugin(iter->second));
-    if (plugin == NULL) {
-        return PLUGIN_NOT_FOUND;
+    return plugin_manager_->IsOffload(iter->second);
+}
+
+
+OffloadTask* Handler::Offload(PluginContext &ctx, OffloadPhase phase, void* data) {
+    OffloadTask* task = new OffloadTask(this, &ctx, phase, data);
+
+    if(offload_pool_->Post(task) != 0) {
+        delete task;
+        return NULL;
+    }
+
+    return task;
+}
+
+
+int Handler::OffloadFd() const {
+    return offload_pool_ ? offload_pool_->NotifyFd() : -1;
+}
+
+
+size_t Handler::OffloadDone(vector<OffloadTask*>& done) {
+    vector<ThreadTask*> tasks;
+
+    size_t n = offload_pool_->TakeDone(tasks);
+    for(size_t i = 0; i < n; i++) {
+        done.push_back(static_cast<OffloadTask*>(tasks[i]));
+    }
+
+    return n;
+}
+
+
+void Handler::OffloadStats(ThreadPoolStats& stats) {
+    if(offload_pool_ == NULL) {
+        memset(&stats, 0, sizeof(stats));
+        return;
+    }
+
+    offload_pool_->GetStats(stats);
+}
+
+
+void OffloadTask::Run() {
+    ctx_->task_scheduler_ = handler_->GetTaskScheduler();
+
+    /* nobody else waits for this thread, yielding makes no sense here */
+    do {
+        if(phase_ == OFFLOAD_HANDLE) {
+            rc_ = handler_->Handle(*ctx_);
+        } else {
+            rc_ = handler_->PostSubHandle(*ctx_);
+        }
+    } while(rc_ == PLUGIN_YIELD);
+
+    ctx_->task_scheduler_ = NULL;
+}
+
+
+void Handler::InitMetrics() {
+    not_found_ = Metrics::GetCounter("adfront_plugin_not_found_total");
+
+    const PluginInfoPtrMap& plugins = plugin_manager_->GetPlugins();
+
+    for(PluginInfoPtrMap::const_iterator it = plugins.begin(); 
+            it != plugins.end(); it++) {
+        /* a plugin under several names is labelled once, by its first name */
+        if (plugin_metrics_.find(it->second->plugin_ptr) != plugin_metrics_.end()) {
+            continue;
+        }
+
+        const string& name = it->second->plugin_conf.name(0);
+        PluginMetrics& metrics = plugin_metrics_[it->second->plugin_ptr];
+        string plugin = "plugin=\"" + name + "\"";
+
+        metrics.name = name.c_str();
+
+        for(size_t i = 0; i < 2; i++) {
+            metrics.usec[i] = Metrics::GetHistogram("adfront_plugin_usec", 
+                    plugin + ",phase=\"" + kPhaseNames[i] + "\"");
+        }
+
+        for(size_t i = 0; i < 6; i++) {
+            metrics.rc[i] = Metrics::GetCounter("adfront_plugin_calls_total", 
+                    plugin + ",rc=\"" + kRcNames[i] + "\"");
+        }
+
+        metrics.slow = Metrics::GetCounter("adfront_plugin_slow_calls_total", plugin);
+
+        metrics.allocs = NULL;
+        metrics.alloc_bytes = NULL;
+        if (AllocTracker::Enabled()) {
+            metrics.allocs = Metrics::GetHistogram("adfront_plugin_allocs", plugin);
+            metrics.alloc_bytes = Metrics::GetHistogram("adfront_plugin_alloc_bytes", plugin);
+        }
+
+        metrics.perf_calls = Metrics::GetCounter("adfront_plugin_perf_calls_total", plugin);
+        for(int i = 0; i < PerfCounters::kCount; i++) {
+            metrics.perf[i] = Metrics::GetCounter(string("adfront_plugin_") 
+                    + PerfCounters::Name(i) + "_total", plugin);
+        }
+    }
+}
+
+
+int Handler::InitPerf(unsigned sample_every) {
+    perf_every_ = sample_every;
+
+    if (sample_every == 0) {
+        return PLUGIN_OK;
+    }
+
+    /* find out now if the kernel lets us, not on the first request */
+    perf_counters = new PerfCounters();
+    perf_state = perf_counters->Open() == 0 ? 1 : -1;
+
+    if (perf_state < 0) {
+        Log(LOG_LEVEL_WARN, "[adfront] perf counters not available, disabled");
+        perf_every_ = 0;
+    }
+
+    return PLUGIN_OK;
+}
+
+
+void Handler::RecordAlloc(const PluginContext &ctx) {
+    STR_MAP::const_iterator name = ctx.headers_in_.find(HTTP_REQUEST_PLUGINNAME);
+    if (!AllocTracker::Enabled() || name == ctx.headers_in_.end()) {
+        return;
+    }
+
+    Plugin* plugin = static_cast<Plugin *>(plugin_manager_->GetPlugin(name->second));
+
+    map<Plugin*, PluginMetrics>::iterator it = plugin_metrics_.find(plugin);
+    if (it == plugin_metrics_.end() || it->second.allocs == NULL) {
+        return;
+    }
+
+    it->second.allocs->Add(ctx.alloc_count_);
+    it->second.alloc_bytes->Add(ctx.alloc_bytes_);
+}
+
+
+const char* Handler::PluginName(Plugin* plugin) {
+    map<Plugin*, PluginMetrics>::iterator it = plugin_metrics_.find(plugin);
+
+    return it != plugin_metrics_.end() ? it->second.name : NULL;
+}
+
+
+PerfCounters* Handler::SamplePerf() {
+    if (perf_every_ == 0 || ++perf_calls % perf_every_ != 0) {
+        return NULL;
     }
 
-    return plugin->PostSubHandle(ctx);
+    if (perf_state == 0) {
+        perf_counters = new PerfCounters();
+        perf_state = perf_counters->Open() == 0 ? 1 : -1;
+    }
+
+    return perf_state > 0 ? perf_counters : NULL;
+}
+
+
+void Handler::RecordPerf(Plugin* plugin, PerfCounters* perf, const uint64_t* before) {
+    uint64_t after[PerfCounters::kCount];
+
+    map<Plugin*, PluginMetrics>::iterator it = plugin_metrics_.find(plugin);
+    if (it == plugin_metrics_.end() || perf->Read(after) != 0) {
+        return;
+    }
+
+    __atomic_fetch_add(it->second.perf_calls, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < PerfCounters::kCount; i++) {
+        __atomic_fetch_add(it->second.perf[i], after[i] - before[i], __ATOMIC_RELAXED);
+    }
+}
+
+
+int Handler::InitWatchdog(int64_t slow_usec, unsigned backtrace_every) {
+    slow_usec_ = slow_usec;
+    backtrace_every_ = 0;
+
+    if (slow_usec <= 0 || backtrace_every == 0) {
+        return PLUGIN_OK;
+    }
+
+    /* the first backtrace loads libgcc, which isn't safe in a signal handler */
+    void* frame;
+    backtrace(&frame, 1);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = WatchdogSignal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+
+    if (sigaction(WATCHDOG_SIGNAL, &sa, NULL) != 0) {
+        Log(LOG_LEVEL_ERROR, "[adfront] watchdog sigaction error")
+            .Field("error", strerror(errno));
+        return PLUGIN_ERROR;
+    }
+
+    backtrace_every_ = backtrace_every;
+
+    return PLUGIN_OK;
+}
+
+
+bool Handler::ArmWatchdog(const PluginContext &ctx) {
+    if (backtrace_every_ == 0 || ++watchdog_calls % backtrace_every_ != 0) {
+        return false;
+    }
+
+    /* offload threads get their own timer on first use */
+    if (watchdog_state == 0) {
+        struct sigevent sev;
+
+        memset(&sev, 0, sizeof(sev));
+        sev.sigev_notify = SIGEV_THREAD_ID;
+        sev.sigev_signo = WATCHDOG_SIGNAL;
+        sev._sigev_un._tid = syscall(SYS_gettid);
+
+        watchdog_state = timer_create(CLOCK_MONOTONIC, &sev, &watchdog_timer) == 0 ? 1 : -1;
+        if (watchdog_state < 0) {
+            Log(LOG_LEVEL_ERROR, "[adfront] watchdog timer_create error")
+                .Field("error", strerror(errno));
+        }
+    }
+
+    if (watchdog_state < 0) {
+        return false;
+    }
+
+    STR_MAP::const_iterator iter = ctx.headers_in_.find(HTTP_REQUEST_PLUGINNAME);
+    watchdog_plugin = iter != ctx.headers_in_.end() ? iter->second.c_str() : "";
+
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = slow_usec_ / 1000000;
+    its.it_value.tv_nsec = slow_usec_ % 1000000 * 1000;
+
+    timer_settime(watchdog_timer, 0, &its, NULL);
+
+    return true;
+}
+
+
+void Handler::SlowCall(Plugin* plugin, const PluginContext &ctx, OffloadPhase phase,
+        int64_t usec, size_t batch) {
+    map<Plugin*, PluginMetrics>::iterator it = plugin_metrics_.find(plugin);
+    if (it != plugin_metrics_.end()) {
+        __sync_fetch_and_add(it->second.slow, 1);
+    }
+
+    STR_MAP::const_iterator name = ctx.headers_in_.find(HTTP_REQUEST_PLUGINNAME);
+    STR_MAP::const_iterator url = ctx.headers_in_.find(HTTP_REQUEST_URL);
+
+    /* queued, the event loop mustn't wait on stderr right after a slow call */
+    Log log(LOG_LEVEL_WARN, "[adfront] slow plugin call");
+    log.Field("plugin", name != ctx.headers_in_.end() ? name->second : "")
+        .Field("phase", kPhaseNames[phase]).Field("usec", (long)usec);
+
+    if (batch > 1) {
+        log.Field("batch", (unsigned long)batch);
+    }
+
+    log.Field("url", url != ctx.headers_in_.end() ? url->second : "");
+}
+
+
+void Handler::RecordMetrics(Plugin* plugin, OffloadPhase phase, int64_t usec, int rc) {
+    map<Plugin*, PluginMetrics>::iterator it = plugin_metrics_.find(plugin);
+    if(it == plugin_metrics_.end()) {
+        return;
+    }
+
+    it->second.usec[phase]->Add(usec > 0 ? usec : 0);
+    __sync_fetch_and_add(it->second.rc[rc <= 0 && rc >= PLUGIN_YIELD ? -rc : 5], 1);
+}
+
+
+Plugin* Handler::FindPlugin(const PluginContext &ctx) {
+    STR_MAP::const_iterator iter = ctx.headers_in_.find(HTTP_REQUEST_PLUGINNAME);
+
+    assert(iter != ctx.headers_in_.end());
+
+    return static_cast<Plugin *>(plugin_manager_->GetPlugin(iter->second));
 }
 
 }
@@ -9,10 +9,55 @@
 #include <plugin_manager/plugin.h>
 #include <plugin_manager/plugin_config.h>
 #include <plugin_manager/plugin_manager.h>
+#include <plugin_manager/thread_pool.h>
+#include <plugin_manager/task_scheduler.h>
+#include <plugin_manager/endpoint.h>
+#include <plugin_manager/histogram.h>
+#include <plugin_manager/metrics.h>
+#include <plugin_manager/perf_counters.h>
+#include <plugin_manager/cpu_profiler.h>
+#include <plugin_manager/alloc_tracker.h>
+#include <plugin_manager/capture.h>
 
 
 namespace ngx_handler{
 
+class Handler;
+
+enum OffloadPhase {
+    OFFLOAD_HANDLE,
+    OFFLOAD_POST_SUBHANDLE
+};
+
+// time of each phase and return codes of a plugin, in the metrics zone
+struct PluginMetrics {
+    const char* name;                   // plugin manager's, lives as long
+    sharelib::Histogram* usec[2];       // by OffloadPhase
+    uint64_t* rc[6];                    // ok, error, again, not_found, yield, other
+    uint64_t* slow;                     // calls over the slow call threshold
+    uint64_t* perf_calls;               // calls the perf counters were read for
+    uint64_t* perf[sharelib::PerfCounters::kCount];
+    sharelib::Histogram* allocs;        // per request, NULL without the hook
+    sharelib::Histogram* alloc_bytes;
+};
+
+// Handle/PostSubHandle call running on the offload thread pool
+class OffloadTask : public sharelib::ThreadTask {
+    public:
+        OffloadTask(Handler* handler, sharelib::PluginContext* ctx, 
+                OffloadPhase phase, void* data)
+            : handler_(handler), ctx_(ctx), phase_(phase), 
+              rc_(PLUGIN_ERROR), data_(data) {}
+
+        virtual void Run();
+
+        Handler* handler_;
+        sharelib::PluginContext* ctx_;
+        OffloadPhase phase_;
+        int rc_;
+        void* data_;        // owner's request, NULL if owner has gone
+};
+
 class Handler {
     public:
         Handler();
@@ -32,9 +77,80 @@ class Handler {
 
         int PostSubHandle(sharelib::PluginContext &ctx);
 
+        // call a plugin in process for a local UpstreamRequest, never yields
+        int HandleLocal(sharelib::PluginContext &ctx, OffloadPhase phase);
+
+        // handle n requests, requests of the same plugin go in one batch
+        void HandleBatch(sharelib::PluginContext **ctxs, int *rcs, size_t n);
+
+        // start offload threads if any plugin is configured with offload,
+        // task_threads run tasks fanned out by offloaded plugins
+        int InitOffload(size_t threads, size_t task_threads);
+
+        bool IsOffload(const sharelib::PluginContext &ctx);
+
+        // run the phase on a pool thread, NULL if it can't be queued
+        OffloadTask* Offload(sharelib::PluginContext &ctx, 
+                OffloadPhase phase, void* data);
+
+        // eventfd readable when offloaded tasks finish, -1 if no pool
+        int OffloadFd() const;
+
+        size_t OffloadDone(std::vector<OffloadTask*>& done);
+
+        void OffloadStats(sharelib::ThreadPoolStats& stats);
+
+        sharelib::TaskScheduler* GetTaskScheduler() { return task_scheduler_; }
+
+        // log calls taking slow_usec or more, 0 is off. One call in 
+        // backtrace_every dumps its stack to stderr if still running by then
+        int InitWatchdog(int64_t slow_usec, unsigned backtrace_every);
+
+        // read hardware counters around one call in sample_every, 0 is off
+        int InitPerf(unsigned sample_every);
+
+        // request is done, its allocations go to the plugin's histograms
+        void RecordAlloc(const sharelib::PluginContext &ctx);
+
+    private:
+        sharelib::Plugin* FindPlugin(const sharelib::PluginContext &ctx);
+
+        void InitMetrics();
+
+        void RecordMetrics(sharelib::Plugin* plugin, OffloadPhase phase, 
+                int64_t usec, int rc);
+
+        // Handle or PostSubHandle of one request, timed and watched
+        int Call(sharelib::Plugin* plugin, sharelib::PluginContext &ctx, 
+                OffloadPhase phase);
+
+        bool ArmWatchdog(const sharelib::PluginContext &ctx);
+
+        // plugin manager's name of the plugin, for profile tags and probes
+        const char* PluginName(sharelib::Plugin* plugin);
+
+        // this thread's counters if this call is sampled, else NULL
+        sharelib::PerfCounters* SamplePerf();
+
+        void RecordPerf(sharelib::Plugin* plugin, sharelib::PerfCounters* perf,
+                const uint64_t* before);
+
+        void SlowCall(sharelib::Plugin* plugin, const sharelib::PluginContext &ctx,
+                OffloadPhase phase, int64_t usec, size_t batch);
+
     private:
         sharelib::PluginManager* plugin_manager_;
+        sharelib::ThreadPool* offload_pool_;
+        sharelib::TaskScheduler* task_scheduler_;
         std::string config_file_;
+
+        // filled in InitProcess, read only afterwards, offload threads too
+        std::map<sharelib::Plugin*, PluginMetrics> plugin_metrics_;
+        uint64_t* not_found_;
+
+        int64_t slow_usec_;
+        unsigned backtrace_every_;
+        unsigned perf_every_;
 };
 
 }
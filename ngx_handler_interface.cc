@@ -6,6 +6,7 @@
 #include <ctype.h>
 #include <stdint.h>
 #include <string>
+#include <vector>
 #include <iostream>
 
 using namespace std;
@@ -30,6 +31,8 @@ string kCookiepath = "cookie_path";
 string kIscookieexpires = "is_cookie_expires";
 string kCookieexpires = "cookie_expires";
 
+string kIsTrace = "is_trace";
+
 
 static string ngx_http_get_cookie(ngx_http_request_t *r);
 static string ngx_http_get_forward(ngx_http_request_t* r);
@@ -43,15 +46,133 @@ static int ngx_url_parser(const string &url, STR_MAP& kv);
 static void ngx_query_map_print(ngx_http_request_t* r, const STR_MAP &query_map);
 static int ngx_url_jump(ngx_http_request_t* r, const STR_MAP &kv_out);
 static int ngx_write_cookie(ngx_http_request_t* r, const STR_MAP &kv_out);
-
-static ngx_int_t plugin_start_subrequest(ngx_http_request_t *r);
+static string ngx_http_get_traceparent(ngx_http_request_t* r);
+static int ngx_write_trace(ngx_http_request_t* r, const Trace &trace);
+
+static ngx_int_t plugin_handle_result(void *handle, ngx_http_request_t *r, int rc);
+static ngx_int_t plugin_offload(void *handle, ngx_http_request_t *r, OffloadPhase phase);
+static ngx_int_t plugin_start_subrequest(Handler *handler, ngx_http_request_t *r,
+        ngx_array_t **subrequests, PluginContext *plugin_ctx);
+static ngx_int_t plugin_launch_subrequest(Handler *handler, ngx_http_request_t *r,
+        ngx_array_t *subrequests, PluginContext *plugin_ctx);
+static ngx_int_t plugin_collect_subrequest(Handler *handler, ngx_http_request_t *r,
+        ngx_array_t *subrequests, PluginContext *plugin_ctx);
+static ngx_int_t plugin_local_result(Handler *handler, ngx_http_request_t *r,
+        subrequest_t *st, UpstreamRequest &ups, int rc);
+static void plugin_destroy_local(ngx_array_t *subrequests);
 static ngx_int_t plugin_create_ctx(ngx_http_request_t *r);
 static void plugin_destroy_ctx(ngx_http_request_t *r);
 static void plugin_post_body(ngx_http_request_t *r);
+static ngx_int_t plugin_create_subrequest(ngx_http_request_t *r, UpstreamRequest &ups,
+        Trace &trace, ngx_str_t *uri, ngx_str_t *args, ngx_http_request_t **sr, 
+        ngx_http_post_subrequest_pt handler, ngx_uint_t flags);
+static void plugin_subrequest_finish(ngx_http_request_t *r, void *data);
+static void plugin_subrequest_cleanup(void *data);
+static ngx_int_t plugin_subrequest_content_handler(ngx_http_request_t *r);
+static void plugin_subrequest_connected(ngx_http_request_t *r, ngx_http_upstream_t *u);
+static ngx_int_t plugin_subrequest_process_header(ngx_http_request_t *r);
+static void plugin_subrequest_timing(void *data, UpstreamRequest &ups);
+static int64_t plugin_now_usec();
 static ngx_int_t plugin_subrequest_post_handler(ngx_http_request_t *r, void *data, ngx_int_t rc);
+static void plugin_detach_subrequest(ngx_http_request_t *r, PluginContext *plugin_ctx);
+static void plugin_final_writer(ngx_http_request_t *r);
+static ngx_int_t plugin_detached_post_handler(ngx_http_request_t *r, void *data, ngx_int_t rc);
+static void plugin_capture_finish(ngx_http_adfront_ctx_t *ctx, PluginContext *plugin_ctx);
+static void plugin_trace_subrequest(Trace &trace, subrequest_t *st, UpstreamRequest &ups);
+static void plugin_trace_finish(ngx_http_request_t *r, ngx_http_adfront_ctx_t *ctx, 
+        PluginContext *plugin_ctx, bool failed);
 
 static void ReplaceAll(std::string &s, const std::string &t, const std::string &w);
 
+/* adaptive read timeout is p99 plus 20%, once there are enough samples */
+#define ADAPTIVE_TIMEOUT_QUANTILE   0.99
+#define ADAPTIVE_TIMEOUT_PERCENT    120
+#define ADAPTIVE_TIMEOUT_SAMPLES    200
+
+/* 
+ * Endpoints registered by plugins, loc_conf is learnt from the first 
+ * subrequest that reached the location without rewrites or redirects.
+ * Locations belong to a server, so it's only used within srv_conf.
+ */
+typedef struct {
+    ngx_str_t   uri;
+    void        **srv_conf;
+    void        **loc_conf;
+
+    /* adaptive read timeout, worked out at most once a second */
+    ngx_msec_t  read_timeout;
+    time_t      read_timeout_sec;
+} endpoint_t;
+
+static vector<endpoint_t> endpoints;
+
+static ngx_msec_t plugin_adaptive_timeout(ngx_http_adfront_main_conf_t *amcf, endpoint_t *ep);
+
+/* psr->data of the subrequests made by plugin_create_subrequest */
+typedef struct {
+    endpoint_t          *endpoint;
+    ngx_msec_t          connect_timeout;    /* 0 keeps the location's */
+    ngx_msec_t          read_timeout;
+    ngx_http_handler_pt content_handler;    /* location's, when wrapped */
+    unsigned            inflight:1;
+    unsigned            deferred:1;         /* upstream made later, unhooked */
+
+    /* upstream's handlers, wrapped to time connect and header */
+    ngx_http_upstream_handler_pt write_event_handler;
+    ngx_int_t           (*process_header)(ngx_http_request_t *r);
+
+    /* absolute times in usec, 0 if not reached */
+    int64_t             create_usec;
+    int64_t             start_usec;
+    int64_t             connect_usec;
+    int64_t             header_usec;
+    int64_t             done_usec;
+
+    size_t              bytes;
+    ngx_str_t           *peer;
+
+    uint64_t            span_id;            /* 0 if the request has no trace */
+    ngx_str_t           traceparent;        /* sent on as $adfront_traceparent */
+} subrequest_opt_t;
+
+/* subrequests of this worker not finished yet */
+static ngx_uint_t subrequest_inflight = 0;
+
+/* framework metrics, registered by each worker, adding up in the zone */
+static struct {
+    uint64_t    *requests;
+    uint64_t    *errors;
+    Histogram   *request_usec;
+    Histogram   *state_usec[ADFRONT_STATE_COUNT];
+    Histogram   *subrequest_rounds;
+    Histogram   *subrequest_fanout;
+    int64_t     *subrequest_inflight;
+    uint64_t    *detached_done;
+    uint64_t    *detached_failed;
+    Histogram   *loop_lag_usec;         /* this worker's own */
+    int64_t     *profile_until;         /* unix time, workers profile till then */
+    int64_t     *profile_hz;
+    Histogram   *ctx_allocs;            /* plugin_create_ctx, NULL without the hook */
+    Histogram   *ctx_alloc_bytes;
+    uint64_t    *captured;              /* requests that went to a capture ring */
+    int64_t     *capture_dump;          /* bumped to make workers dump their rings */
+    uint64_t    *traced;                /* sampled requests */
+    uint64_t    *trace_dropped;         /* exporter buffer full */
+    uint64_t    *log_dropped;           /* log ring full */
+    uint64_t    *subrequest_dropped[UPSTREAM_PRIORITY_LOW + 1];   /* by priority */
+} metrics;
+
+static CaptureRing *capture_ring = NULL;    /* NULL if capture is off */
+static int64_t capture_usec = 0;
+static int64_t capture_dumped = 0;          /* capture_dump last seen */
+
+static bool trace_on = false;               /* requests get a trace context */
+static ngx_uint_t trace_sample = 0;
+static ngx_uint_t trace_requests = 0;
+static bool trace_debug = false;
+
+static uint64_t log_dropped = 0;            /* Logger::Dropped() last counted */
+
 /*------------------------------ handler api ---------------------------------*/
 void *plugin_create_handler(void *config_file, size_t len) {
     Handler *request_handler = new Handler();
@@ -71,10 +192,51 @@ ngx_int_t plugin_init_handler(void *request_handler) {
         return NGX_ERROR;
     }
 
+    metrics.requests = Metrics::GetCounter("adfront_requests_total");
+    metrics.errors = Metrics::GetCounter("adfront_request_errors_total");
+    metrics.request_usec = Metrics::GetHistogram("adfront_request_usec");
+    for(size_t i = 0; i < ADFRONT_STATE_COUNT; i++) {
+        metrics.state_usec[i] = Metrics::GetHistogram("adfront_state_usec", 
+                string("state=\"") + ngx_http_adfront_state_names[i] + "\"");
+    }
+    metrics.subrequest_rounds = Metrics::GetHistogram("adfront_subrequest_rounds");
+    metrics.subrequest_fanout = Metrics::GetHistogram("adfront_subrequest_fanout");
+    metrics.subrequest_inflight = Metrics::GetGauge("adfront_subrequests_inflight");
+    metrics.subrequest_dropped[UPSTREAM_PRIORITY_NORMAL] = Metrics::GetCounter(
+            "adfront_subrequest_dropped_total", "priority=\"normal\"");
+    metrics.subrequest_dropped[UPSTREAM_PRIORITY_LOW] = Metrics::GetCounter(
+            "adfront_subrequest_dropped_total", "priority=\"low\"");
+    metrics.detached_done = Metrics::GetCounter("adfront_detached_total", 
+            "result=\"done\"");
+    metrics.detached_failed = Metrics::GetCounter("adfront_detached_total", 
+            "result=\"failed\"");
+    metrics.profile_until = Metrics::GetGauge("adfront_profile_until");
+    metrics.profile_hz = Metrics::GetGauge("adfront_profile_hz");
+    if(AllocTracker::Enabled()) {
+        metrics.ctx_allocs = Metrics::GetHistogram("adfront_ctx_allocs");
+        metrics.ctx_alloc_bytes = Metrics::GetHistogram("adfront_ctx_alloc_bytes");
+    }
+
     int rc = ((Handler *)request_handler)->InitProcess();
     if(rc != PLUGIN_OK)
         return NGX_ERROR;
 
+    /* plugins have registered their endpoints in Init */
+    endpoints.resize(Endpoints::Size());
+    for(size_t i = 0; i < endpoints.size(); i++) {
+        const string& uri = Endpoints::Uri(i);
+
+        endpoints[i].uri.len = uri.length();
+        endpoints[i].uri.data = (u_char *)ngx_pnalloc(ngx_cycle->pool, uri.length());
+        if(endpoints[i].uri.data == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(endpoints[i].uri.data, uri.c_str(), uri.length());
+        endpoints[i].srv_conf = NULL;
+        endpoints[i].loc_conf = NULL;
+    }
+
     return NGX_OK;
 }
 
@@ -89,6 +251,96 @@ void plugin_destroy_handler(void *request_handler) {
 }
 
 
+/*--------------------------------- offload api ------------------------------*/
+
+/* finished offload tasks not yet handed back to the event loop */
+static vector<OffloadTask *> offload_done;
+static size_t offload_done_pos = 0;
+
+/*
+ * @return
+ *      NGX_OK          offload threads started, fd is their notify eventfd
+ *      NGX_DECLINED    no plugin wants offload
+ *      NGX_ERROR       start threads fail
+ */
+ngx_int_t plugin_init_offload(void *request_handler, ngx_uint_t threads, 
+        ngx_uint_t task_threads, ngx_socket_t *fd) {
+    int rc = ((Handler *)request_handler)->InitOffload(threads, task_threads);
+
+    if(rc == PLUGIN_NOT_FOUND) {
+        return NGX_DECLINED;
+    } else if(rc != PLUGIN_OK) {
+        return NGX_ERROR;
+    }
+
+    *fd = ((Handler *)request_handler)->OffloadFd();
+
+    return NGX_OK;
+}
+
+
+ngx_uint_t plugin_is_offload(void *request_handler, ngx_http_request_t *r) {
+    ngx_http_adfront_ctx_t *ctx;
+
+    ctx = (ngx_http_adfront_ctx_t *)ngx_http_get_module_ctx(r, ngx_http_adfront_module);
+    if(ctx->plugin_ctx == NULL) {
+        return 0;
+    }
+
+    return ((Handler *)request_handler)->IsOffload(*(PluginContext *)ctx->plugin_ctx);
+}
+
+/*
+ * Pick up the next request whose offloaded phase has finished, its result
+ * is left in ctx->plugin_rc. Tasks of requests gone meanwhile are freed here.
+ *
+ * @return
+ *      request to resume, NULL if no more finished tasks
+ */
+ngx_http_request_t *plugin_offload_next(void *request_handler) {
+    ngx_http_request_t *r;
+    ngx_http_adfront_ctx_t *ctx;
+
+    for( ;; ) {
+        if(offload_done_pos == offload_done.size()) {
+            offload_done.clear();
+            offload_done_pos = 0;
+
+            if(((Handler *)request_handler)->OffloadDone(offload_done) == 0) {
+                return NULL;
+            }
+        }
+
+        OffloadTask *task = offload_done[offload_done_pos++];
+
+        if(task->data_ == NULL) {
+            delete task->ctx_;
+            delete task;
+            continue;
+        }
+
+        r = (ngx_http_request_t *)task->data_;
+        ctx = (ngx_http_adfront_ctx_t *)ngx_http_get_module_ctx(r, ngx_http_adfront_module);
+
+        ctx->offload = NULL;
+        ctx->offload_wait += task->wait_us_ / 1000;
+        ctx->plugin_rc = plugin_handle_result(request_handler, r, task->rc_);
+
+        delete task;
+        return r;
+    }
+}
+
+
+ngx_uint_t plugin_offload_queue(void *request_handler) {
+    ThreadPoolStats stats;
+
+    ((Handler *)request_handler)->OffloadStats(stats);
+
+    return stats.queue_depth;
+}
+
+
 /*--------------------------------- request api ------------------------------*/
 
 /*
@@ -113,280 +365,1669 @@ ngx_int_t plugin_init_request(ngx_http_request_t *r) {
     return NGX_ERROR;
 }
 
+/*
+ * Build plugin context for the request, it's done exactly once.
+ *
+ * @return
+ *      NGX_OK      context ready
+ *      NGX_ERROR   create context fail
+ */
+ngx_int_t plugin_prepare_request(ngx_http_request_t *r) {
+    ngx_http_adfront_ctx_t *ctx;
+
+    ctx = (ngx_http_adfront_ctx_t *)ngx_http_get_module_ctx(r, ngx_http_adfront_module);
+    if(ctx->plugin_ctx != NULL) {
+        return NGX_OK;
+    }
+
+    /* framework's share of the request's allocations */
+    AllocCounts allocs = {0, 0};
+    AllocCounts *outer = AllocTracker::Swap(&allocs);
+
+    ngx_int_t rc = plugin_create_ctx(r);
+
+    AllocTracker::Swap(outer);
+
+    if(metrics.ctx_allocs) {
+        metrics.ctx_allocs->Add(allocs.count);
+        metrics.ctx_alloc_bytes->Add(allocs.bytes);
+    }
+
+    if(rc != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, 
+                "[adfront] plugin create context error");
+
+        return NGX_ERROR;
+    }
+
+    ADFRONT_PROBE4(request__start, r, ctx->plugin_ctx, ctx->plugin.data, ctx->plugin.len);
+
+    /* what the plugin gets, before it has a chance to change it */
+    if(capture_ring != NULL) {
+        PluginContext *plugin_ctx = (PluginContext *)ctx->plugin_ctx;
+        CapturedRequest *capture = new CapturedRequest();
+
+        capture->start_usec = (int64_t)ctx->time_start.tv_sec * 1000000 
+            + ctx->time_start.tv_usec;
+        capture->time_stamp = plugin_ctx->time_stamp_;
+        capture->headers_in = plugin_ctx->headers_in_;
+        ctx->capture = capture;
+    }
+
+    return NGX_OK;
+}
+
 /*
  * @return 
  *      NGX_OK      plugin process request sucess   
  *      NGX_AGAIN   plugin has subrequest to be processed
+ *      NGX_BUSY    plugin runs on offload thread, see plugin_offload_next
+ *      NGX_DECLINED plugin yields, call it again on next event loop tick
  *      NGX_ERROR   plugin process reuquest fail
  */
 ngx_int_t plugin_process_request(void *request_handler, ngx_http_request_t *r) {
     ngx_int_t rc;
     ngx_http_adfront_ctx_t *ctx;
 
-    /* create context for each http request exactly once */
-    rc = plugin_create_ctx(r);
+    rc = plugin_prepare_request(r);
     if(rc != NGX_OK) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, 
-                "[adfront] plugin create context error");
-
         return NGX_ERROR;
     }
 
     ctx = (ngx_http_adfront_ctx_t *)ngx_http_get_module_ctx(r, ngx_http_adfront_module);
     PluginContext *plugin_ctx = (PluginContext *)ctx->plugin_ctx;
 
+    if(((Handler *)request_handler)->IsOffload(*plugin_ctx)) {
+        return plugin_offload(request_handler, r, OFFLOAD_HANDLE);
+    }
+
     rc = ((Handler *)request_handler)->Handle(*plugin_ctx);
-    if(rc == PLUGIN_NOT_FOUND) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                "[adfront] plugin not found, check plugin_manager.conf");
 
+    return plugin_handle_result(request_handler, r, rc);
+}
+
+/*
+ * Handle requests with prepared context in one go, the result of each 
+ * request is left in its ctx->plugin_rc, same as plugin_process_request.
+ */
+void plugin_process_batch(void *request_handler, ngx_http_request_t **rs, ngx_uint_t n) {
+    ngx_http_adfront_ctx_t *ctx;
+
+    vector<PluginContext *> plugin_ctxs(n);
+    vector<int> rcs(n, PLUGIN_ERROR);
+
+    for(ngx_uint_t i = 0; i < n; i++) {
+        ctx = (ngx_http_adfront_ctx_t *)ngx_http_get_module_ctx(rs[i], ngx_http_adfront_module);
+        plugin_ctxs[i] = (PluginContext *)ctx->plugin_ctx;
+    }
+
+    ngx_log_error(NGX_LOG_DEBUG, rs[0]->connection->log, 0, 
+            "[adfront] plugin process batch of %ui requests", n);
+
+    ((Handler *)request_handler)->HandleBatch(&plugin_ctxs[0], &rcs[0], n);
+
+    for(ngx_uint_t i = 0; i < n; i++) {
+        ctx = (ngx_http_adfront_ctx_t *)ngx_http_get_module_ctx(rs[i], ngx_http_adfront_module);
+        ctx->plugin_rc = plugin_handle_result(request_handler, rs[i], rcs[i]);
+    }
+}
+
+/*
+ * Collect responses of finished subrequests and launch the requests whose
+ * dependencies are all done.
+ *
+ * @return 
+ *      NGX_OK          all subrequests have been done, or any of them 
+ *                      if plugin waits for any
+ *      NGX_AGAIN       some subrequests haven't been done
+ */
+ngx_int_t plugin_check_subrequest(void *request_handler, ngx_http_request_t *r) {
+    ngx_int_t               rc;
+    ngx_http_adfront_ctx_t  *ctx;
+
+    ctx = (ngx_http_adfront_ctx_t *)ngx_http_get_module_ctx(r, ngx_http_adfront_module);
+
+    ngx_log_error(NGX_LOG_DEBUG, r->connection->log, 0, 
+            "[adfront] plugin check subrequest, count = %d", r->main->count);
+
+    rc = plugin_collect_subrequest((Handler *)request_handler, r, 
+            ctx->subrequests, (PluginContext *)ctx->plugin_ctx);
+
+    /* round settled, as PostSubHandle is going to see it */
+    if(rc == NGX_OK && ctx->capture != NULL) {
+        ((CapturedRequest *)ctx->capture)->rounds.push_back(
+                ((PluginContext *)ctx->plugin_ctx)->upstream_request_);
+    }
+
+    return rc;
+}
+
+
+/*
+ * @return 
+ *      NGX_OK      plugin process request sucess   
+ *      NGX_AGAIN   plugin has subrequest to be processed
+ *      NGX_BUSY    plugin runs on offload thread, see plugin_offload_next
+ *      NGX_DECLINED plugin yields, call it again on next event loop tick
+ *      NGX_ERROR   plugin process reuquest fail
+ */
+ngx_int_t plugin_post_subrequest(void *request_handler, ngx_http_request_t *r) {
+    ngx_int_t rc;
+    ngx_http_adfront_ctx_t *ctx;
+
+    ctx = (ngx_http_adfront_ctx_t *)ngx_http_get_module_ctx(r, ngx_http_adfront_module);
+    PluginContext *plugin_ctx = (PluginContext *)ctx->plugin_ctx;
+
+    if(((Handler *)request_handler)->IsOffload(*plugin_ctx)) {
+        return plugin_offload(request_handler, r, OFFLOAD_POST_SUBHANDLE);
+    }
+
+    rc = ((Handler *)request_handler)->PostSubHandle(*plugin_ctx);
+
+    return plugin_handle_result(request_handler, r, rc);
+}
+
+
+/*
+ * @return 
+ *      NGX_OK          output filter body complete
+ *      NGX_AGAIN       output filter body incomplete
+ *      NGX_DONE        body incomplete, detached calls sent once it's written
+ *      NGX_ERROR       plugin finalize request fail
+ */
+ngx_int_t plugin_final_request(ngx_http_request_t *r) {
+    ngx_int_t               rc;
+    ngx_buf_t               *b;
+    ngx_chain_t             out;
+    ngx_event_t             *wev;
+    ngx_http_adfront_ctx_t  *ctx;
+    ngx_http_core_loc_conf_t *clcf;
+
+    ctx = (ngx_http_adfront_ctx_t *)ngx_http_get_module_ctx(r, ngx_http_adfront_module);
+    PluginContext *plugin_ctx = (PluginContext *)ctx->plugin_ctx;
+
+    if(ctx->capture != NULL) {
+        plugin_capture_finish(ctx, plugin_ctx);
+    }
+
+    plugin_trace_finish(r, ctx, plugin_ctx, plugin_ctx->handle_result_.empty());
+
+    ngx_url_jump(r, plugin_ctx->headers_out_);
+    ngx_write_cookie(r, plugin_ctx->headers_out_);
+    
+    if(plugin_ctx->handle_result_.empty()) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, 
+                "[adfront] plugin finalize with empty result");
+
+        plugin_destroy_ctx(r);
         return NGX_ERROR;
     }
 
-    if(rc == PLUGIN_AGAIN) {
-        rc = plugin_start_subrequest(r);
-        if(rc != NGX_OK) {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                    "[adfront] plugin start subrequest error");
-            
+    b = ngx_create_temp_buf(r->pool, plugin_ctx->handle_result_.length()); 
+    if(b == NULL) {
+        plugin_destroy_ctx(r);
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(b->pos, plugin_ctx->handle_result_.c_str(), 
+            plugin_ctx->handle_result_.length());
+    b->last = b->pos + plugin_ctx->handle_result_.length();
+    b->last_buf = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    /* 302 url jump */
+    if(r->headers_out.status != NGX_HTTP_MOVED_TEMPORARILY)
+       r->headers_out.status = NGX_HTTP_OK; 
+
+    ngx_str_t type = ngx_string("text/plain; charset=utf-8");
+    r->headers_out.content_type = type;
+    r->headers_out.content_length_n = plugin_ctx->handle_result_.length();
+
+    rc = ngx_http_send_header(r);
+    if(rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, 
+                "[adfront] send header fail");
+
+        plugin_destroy_ctx(r);
+        return NGX_ERROR;
+    }    
+
+    rc = ngx_http_output_filter(r, &out);
+
+    /* 
+     * Detached calls are subrequests of this request, the postpone filter
+     * would hold what's left of the response until they're done. So they
+     * wait for the last byte, the context with them.
+     */
+    if(rc == NGX_AGAIN && !plugin_ctx->detached_request_.empty()) {
+        wev = r->connection->write;
+        clcf = (ngx_http_core_loc_conf_t *)ngx_http_get_module_loc_conf(r, 
+                ngx_http_core_module);
+
+        if(!wev->delayed) {
+            ngx_add_timer(wev, clcf->send_timeout);
+        }
+
+        if(ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+            plugin_destroy_ctx(r);
             return NGX_ERROR;
         }
 
-        return NGX_AGAIN;
+        r->write_event_handler = plugin_final_writer;
+        r->main->count++;
+        return NGX_DONE;
+    }
+
+    if(rc != NGX_ERROR) {
+        plugin_detach_subrequest(r, plugin_ctx);
+    }
+
+    /* destroy request context exactly once */
+    plugin_destroy_ctx(r);
+    return rc;
+}
+
+
+/* 
+ * ngx_http_writer for a response plugin_final_request couldn't write at
+ * once, then the detached calls go. If the client times out or the write
+ * fails they're dropped with the request.
+ */
+static void plugin_final_writer(ngx_http_request_t *r) {
+    ngx_int_t                   rc;
+    ngx_event_t                 *wev;
+    ngx_connection_t            *c;
+    ngx_http_adfront_ctx_t      *ctx;
+    ngx_http_core_loc_conf_t    *clcf;
+
+    c = r->connection;
+    wev = c->write;
+    clcf = (ngx_http_core_loc_conf_t *)ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if(wev->timedout) {
+        if(!wev->delayed) {
+            ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT, 
+                    "[adfront] client timed out, detached subrequests dropped");
+            c->timedout = 1;
+            ngx_http_finalize_request(r, NGX_HTTP_REQUEST_TIME_OUT);
+            return;
+        }
+
+        wev->timedout = 0;
+        wev->delayed = 0;
+
+        if(!wev->ready) {
+            ngx_add_timer(wev, clcf->send_timeout);
+            if(ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+                ngx_http_finalize_request(r, NGX_ERROR);
+            }
+            return;
+        }
+    }
+
+    if(wev->delayed) {
+        if(ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+            ngx_http_finalize_request(r, NGX_ERROR);
+        }
+        return;
+    }
+
+    rc = ngx_http_output_filter(r, NULL);
+    if(rc == NGX_ERROR) {
+        ngx_http_finalize_request(r, rc);
+        return;
+    }
+
+    if(r->buffered || r->postponed || c->buffered) {
+        if(!wev->delayed) {
+            ngx_add_timer(wev, clcf->send_timeout);
+        }
+
+        if(ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+            ngx_http_finalize_request(r, NGX_ERROR);
+        }
+        return;
+    }
+
+    r->write_event_handler = ngx_http_request_empty_handler;
+
+    ctx = (ngx_http_adfront_ctx_t *)ngx_http_get_module_ctx(r, ngx_http_adfront_module);
+    if(ctx->plugin_ctx) {
+        plugin_detach_subrequest(r, (PluginContext *)ctx->plugin_ctx);
+        plugin_destroy_ctx(r);
+    }
+
+    ngx_http_finalize_request(r, rc);
+}
+
+ngx_int_t plugin_done_request(ngx_http_request_t *r) {
+    ngx_log_error(NGX_LOG_DEBUG, r->connection->log, 0, 
+            "[adfront] done request, count = %d", r->main->count);
+
+    return ngx_http_output_filter(r, NULL);
+}
+
+/*
+ * PREACCESS phase handler for subrequests. Ours get the content handler of
+ * their location wrapped, it's set by now, to time the upstream and apply
+ * their own timeouts.
+ */
+ngx_int_t plugin_prepare_subrequest(ngx_http_request_t *r) {
+    subrequest_opt_t *opt;
+
+    if(r->post_subrequest == NULL 
+            || (r->post_subrequest->handler != plugin_subrequest_post_handler
+                && r->post_subrequest->handler != plugin_detached_post_handler)) {
+        return NGX_DECLINED;
+    }
+
+    opt = (subrequest_opt_t *)r->post_subrequest->data;
+
+    if(r->content_handler == NULL 
+            || r->content_handler == plugin_subrequest_content_handler) {
+        return NGX_DECLINED;
+    }
+
+    opt->content_handler = r->content_handler;
+    r->content_handler = plugin_subrequest_content_handler;
+
+    return NGX_DECLINED;
+}
+
+
+/*
+ * For modules that create the upstream after their content handler has 
+ * returned, out of reach of plugin_subrequest_content_handler, as 
+ * adserver_batch does.
+ *
+ * @return
+ *      NGX_OK          timeouts of the subrequest, 0 keeps the location's
+ *      NGX_DECLINED    not one of our subrequests
+ */
+ngx_int_t plugin_subrequest_timeouts(ngx_http_request_t *r, ngx_msec_t *connect_timeout,
+        ngx_msec_t *read_timeout) {
+    subrequest_opt_t *opt;
+
+    if(r->post_subrequest == NULL 
+            || (r->post_subrequest->handler != plugin_subrequest_post_handler
+                && r->post_subrequest->handler != plugin_detached_post_handler)) {
+        return NGX_DECLINED;
+    }
+
+    opt = (subrequest_opt_t *)r->post_subrequest->data;
+
+    *connect_timeout = opt->connect_timeout;
+    *read_timeout = opt->read_timeout;
+
+    return NGX_OK;
+}
+
+
+void plugin_destroy_request(ngx_http_request_t *r) {
+    ngx_log_error(NGX_LOG_DEBUG, r->connection->log, 0,
+            "[adfront] destroy request context, count = %d", r->main->count);
+
+    plugin_destroy_ctx(r); 
+}
+
+
+/* detached subrequests finished in this worker, failed ones included */
+static ngx_uint_t detached_done = 0;
+static ngx_uint_t detached_failed = 0;
+
+void plugin_detached_stats(ngx_uint_t *done, ngx_uint_t *failed) {
+    *done = detached_done;
+    *failed = detached_failed;
+}
+
+/*------------------------------ watchdog api --------------------------------*/
+ngx_int_t plugin_init_watchdog(void *request_handler, ngx_msec_t slow_call, 
+        ngx_uint_t backtrace_every) {
+    char worker[32];
+
+    /* a stall shows on one worker, don't add them up */
+    snprintf(worker, sizeof(worker), "worker=\"%d\"", (int)ngx_process_slot);
+    metrics.loop_lag_usec = Metrics::GetHistogram("adfront_loop_lag_usec", worker);
+
+    int rc = ((Handler *)request_handler)->InitWatchdog((int64_t)slow_call * 1000, 
+            backtrace_every);
+
+    return rc == PLUGIN_OK ? NGX_OK : NGX_ERROR;
+}
+
+
+void plugin_loop_lag(ngx_msec_t lag) {
+    if(metrics.loop_lag_usec) {
+        metrics.loop_lag_usec->Add((uint64_t)lag * 1000);
+    }
+}
+
+
+ngx_int_t plugin_init_perf(void *request_handler, ngx_uint_t sample_every) {
+    int rc = ((Handler *)request_handler)->InitPerf(sample_every);
+
+    return rc == PLUGIN_OK ? NGX_OK : NGX_ERROR;
+}
+
+/*------------------------------ profiler api --------------------------------*/
+#define PROFILE_MAX_SAMPLES     32768
+
+static string profile_prefix;
+
+void plugin_profile_request(ngx_uint_t seconds, ngx_uint_t hz) {
+    __atomic_store_n(metrics.profile_hz, (int64_t)hz, __ATOMIC_RELAXED);
+    __atomic_store_n(metrics.profile_until, seconds ? (int64_t)(ngx_time() + seconds) : 0, 
+            __ATOMIC_RELAXED);
+}
+
+
+void plugin_profile_tick(ngx_str_t *dir) {
+    char name[64];
+    time_t now = ngx_time();
+    int64_t until = __atomic_load_n(metrics.profile_until, __ATOMIC_RELAXED);
+    int64_t hz = __atomic_load_n(metrics.profile_hz, __ATOMIC_RELAXED);
+
+    if(CpuProfiler::Running()) {
+        if(now >= until) {
+            CpuProfiler::Stop(profile_prefix);
+        }
+        return;
+    }
+
+    /* the next one starts once the last one is on disk */
+    if(now >= until || hz <= 0 || CpuProfiler::Writing()) {
+        return;
+    }
+
+    /* twice the samples of one busy thread, offload threads take some */
+    size_t max_samples = (size_t)(hz * (until - now) * 2);
+    if(max_samples > PROFILE_MAX_SAMPLES) {
+        max_samples = PROFILE_MAX_SAMPLES;
+    }
+
+    snprintf(name, sizeof(name), "/adfront.%d.%ld", (int)ngx_pid, (long)now);
+    profile_prefix = string((char *)dir->data, dir->len) + name;
+
+    if(CpuProfiler::Start(hz, max_samples) != 0) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, 
+                "[adfront] cpu profiler start fail");
+        /* don't retry every tick */
+        __atomic_store_n(metrics.profile_until, 0, __ATOMIC_RELAXED);
+    }
+}
+
+
+void plugin_exit_profile(void) {
+    CpuProfiler::Wait();
+}
+
+/*------------------------------ allocation api ------------------------------*/
+ngx_int_t plugin_init_alloc(ngx_uint_t site_every) {
+    if(site_every == 0) {
+        return NGX_OK;
+    }
+
+    if(!AllocTracker::Enabled()) {
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, "[adfront] allocation sites "
+                "need libplugin_manager.so built with ALLOC_HOOK=1, ignored");
+        return NGX_OK;
+    }
+
+    AllocTracker::EnableSites(site_every);
+
+    return NGX_OK;
+}
+
+
+/* this worker's allocation call sites, as text */
+ngx_buf_t *plugin_alloc_sites(ngx_http_request_t *r) {
+    ngx_buf_t *b;
+    string out;
+    char head[64];
+
+    snprintf(head, sizeof(head), "# worker %d\n", (int)ngx_pid);
+    out = head;
+    AllocTracker::WriteSites(out);
+
+    b = ngx_create_temp_buf(r->pool, out.length());
+    if(b == NULL) {
+        return NULL;
+    }
+
+    b->last = ngx_cpymem(b->pos, out.data(), out.length());
+    b->last_buf = 1;
+
+    return b;
+}
+
+/*------------------------------- capture api --------------------------------*/
+ngx_int_t plugin_init_capture(ngx_msec_t slow, ngx_uint_t size) {
+    if(slow == 0) {
+        return NGX_OK;
+    }
+
+    metrics.captured = Metrics::GetCounter("adfront_captured_total");
+    metrics.capture_dump = Metrics::GetGauge("adfront_capture_dump");
+
+    /* a dump asked for before this worker started isn't its business */
+    capture_dumped = __atomic_load_n(metrics.capture_dump, __ATOMIC_RELAXED);
+    capture_usec = (int64_t)slow * 1000;
+    capture_ring = new CaptureRing(size);
+
+    return NGX_OK;
+}
+
+
+void plugin_capture_request(void) {
+    __atomic_add_fetch(metrics.capture_dump, 1, __ATOMIC_RELAXED);
+}
+
+
+void plugin_capture_tick(ngx_str_t *dir) {
+    char name[64];
+
+    if(capture_ring == NULL) {
+        return;
+    }
+
+    int64_t dump = __atomic_load_n(metrics.capture_dump, __ATOMIC_RELAXED);
+    if(dump == capture_dumped) {
+        return;
+    }
+
+    capture_dumped = dump;
+
+    snprintf(name, sizeof(name), "/adfront.%d.%ld.capture", (int)ngx_pid, 
+            (long)ngx_time());
+
+    if(capture_ring->Write(string((char *)dir->data, dir->len) + name) != 0) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, 
+                "[adfront] capture ring dump fail");
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0, 
+            "[adfront] capture ring of %uz requests dumped to %V%s", 
+            capture_ring->Size(), dir, name);
+}
+
+/*-------------------------------- trace api ---------------------------------*/
+ngx_int_t plugin_init_trace(ngx_str_t *file, ngx_uint_t sample, ngx_flag_t debug) {
+    if(file->len == 0 && !debug) {
+        return NGX_OK;
+    }
+
+    if(file->len > 0 
+            && SpanExporter::Start(string((char *)file->data, file->len), "adfront") != 0) {
+        return NGX_ERROR;
+    }
+
+    metrics.traced = Metrics::GetCounter("adfront_traced_total");
+    metrics.trace_dropped = Metrics::GetCounter("adfront_trace_dropped_total");
+
+    /* without a file only debug requests are worth recording */
+    trace_on = true;
+    trace_sample = file->len > 0 ? sample : 0;
+    trace_debug = debug;
+
+    return NGX_OK;
+}
+
+
+/*
+ * @return
+ *      NGX_OK          traceparent of the request, or the one the subrequest
+ *                      is to send on
+ *      NGX_DECLINED    no trace context, not one of our subrequests
+ */
+ngx_int_t plugin_traceparent(ngx_http_request_t *r, ngx_str_t *traceparent) {
+    subrequest_opt_t *opt;
+    ngx_http_adfront_ctx_t *ctx;
+
+    if(r != r->main) {
+        if(r->post_subrequest == NULL 
+                || (r->post_subrequest->handler != plugin_subrequest_post_handler
+                    && r->post_subrequest->handler != plugin_detached_post_handler)) {
+            return NGX_DECLINED;
+        }
+
+        opt = (subrequest_opt_t *)r->post_subrequest->data;
+        if(opt->traceparent.len == 0) {
+            return NGX_DECLINED;
+        }
+
+        *traceparent = opt->traceparent;
+        return NGX_OK;
+    }
+
+    ctx = (ngx_http_adfront_ctx_t *)ngx_http_get_module_ctx(r, ngx_http_adfront_module);
+    if(ctx == NULL || ctx->traceparent.len == 0) {
+        return NGX_DECLINED;
+    }
+
+    *traceparent = ctx->traceparent;
+    return NGX_OK;
+}
+
+
+void plugin_exit_trace(void) {
+    SpanExporter::Stop();
+}
+
+/*-------------------------------- log api -----------------------------------*/
+ngx_int_t plugin_init_log(ngx_str_t *file, ngx_uint_t level, size_t rotate_size, 
+        time_t rotate_interval) {
+    Logger::SetLevel((int)level);
+
+    if(file->len == 0) {
+        return NGX_OK;
+    }
+
+    if(Logger::Start(string((char *)file->data, file->len), rotate_size, 
+                (int)rotate_interval) != 0) {
+        return NGX_ERROR;
+    }
+
+    metrics.log_dropped = Metrics::GetCounter("adfront_log_dropped_total");
+
+    return NGX_OK;
+}
+
+
+void plugin_log_tick(void) {
+    if(metrics.log_dropped == NULL) {
+        return;
+    }
+
+    uint64_t dropped = Logger::Dropped();
+    __sync_fetch_and_add(metrics.log_dropped, dropped - log_dropped);
+    log_dropped = dropped;
+}
+
+
+void plugin_exit_log(void) {
+    Logger::Stop();
+}
+
+/*------------------------------ metrics api ---------------------------------*/
+ngx_int_t plugin_init_metrics(void *addr, size_t size) {
+    return Metrics::Attach(addr, size) == 0 ? NGX_OK : NGX_ERROR;
+}
+
+
+/* request is going away, whatever state it ended in */
+void plugin_metrics_request(ngx_http_request_t *r) {
+    int64_t usec = 0;
+    ngx_http_adfront_ctx_t *ctx;
+
+    ctx = (ngx_http_adfront_ctx_t *)ngx_http_get_module_ctx(r, ngx_http_adfront_module);
+    if(ctx == NULL || metrics.requests == NULL) {
+        return;
+    }
+
+    ngx_http_adfront_set_state(ctx, ctx->state);
+
+    for(size_t i = 0; i < ADFRONT_STATE_COUNT; i++) {
+        if(ctx->state_usec[i] > 0) {
+            metrics.state_usec[i]->Add(ctx->state_usec[i]);
+            usec += ctx->state_usec[i];
+        }
+    }
+
+    __sync_fetch_and_add(metrics.requests, 1);
+    if(ctx->state == ADFRONT_STATE_ERROR) {
+        __sync_fetch_and_add(metrics.errors, 1);
+    }
+
+    metrics.request_usec->Add(usec);
+    metrics.subrequest_rounds->Add(ctx->subrequest_rounds);
+    metrics.subrequest_fanout->Add(ctx->subrequest_fanout);
+}
+
+
+/* whole zone in Prometheus text or JSON */
+ngx_buf_t *plugin_metrics_status(ngx_http_request_t *r, ngx_uint_t json) {
+    string out;
+    ngx_buf_t *b;
+
+    if(json) {
+        Metrics::WriteJson(out);
+    } else {
+        Metrics::WritePrometheus(out);
+    }
+
+    b = ngx_create_temp_buf(r->pool, out.length() + 1);
+    if(b == NULL) {
+        return NULL;
+    }
+
+    b->last = ngx_cpymem(b->pos, out.c_str(), out.length());
+    b->last_buf = 1;
+
+    return b;
+}
+
+/*---------------------------- local function --------------------------------*/
+
+/* translate plugin Handle return code, start subrequests if any */
+static ngx_int_t plugin_handle_result(void *request_handler, ngx_http_request_t *r, int rc) {
+    if(rc == PLUGIN_YIELD) {
+        return NGX_DECLINED;
+    }
+
+    if(rc == PLUGIN_NOT_FOUND) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "[adfront] plugin not found, check plugin_manager.conf");
+
+        return NGX_ERROR;
+    }
+
+    if(rc == PLUGIN_AGAIN) {
+        ngx_http_adfront_ctx_t *ctx;
+
+        ctx = (ngx_http_adfront_ctx_t *)ngx_http_get_module_ctx(r, ngx_http_adfront_module);
+
+        rc = plugin_start_subrequest((Handler *)request_handler, r, 
+                &ctx->subrequests, (PluginContext *)ctx->plugin_ctx);
+        if(rc != NGX_OK) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "[adfront] plugin start subrequest error");
+            
+            return NGX_ERROR;
+        }
+
+        return NGX_AGAIN;
+    }
+
+    /* assert(rc = PLUGIN_OK/PLUGIN_ERROR) */
+    return NGX_OK;
+}
+
+
+/* hand the plugin phase over to offload threads, fall back to inline call */
+static ngx_int_t plugin_offload(void *request_handler, ngx_http_request_t *r, 
+        OffloadPhase phase) {
+    int rc;
+    ngx_http_adfront_ctx_t *ctx;
+
+    ctx = (ngx_http_adfront_ctx_t *)ngx_http_get_module_ctx(r, ngx_http_adfront_module);
+    PluginContext *plugin_ctx = (PluginContext *)ctx->plugin_ctx;
+
+    ctx->offload = ((Handler *)request_handler)->Offload(*plugin_ctx, phase, r);
+    if(ctx->offload != NULL) {
+        ctx->plugin_rc = NGX_DONE;
+
+        return NGX_BUSY;
+    }
+
+    ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+            "[adfront] plugin offload fail, run in event loop");
+
+    if(phase == OFFLOAD_HANDLE) {
+        rc = ((Handler *)request_handler)->Handle(*plugin_ctx);
+    } else {
+        rc = ((Handler *)request_handler)->PostSubHandle(*plugin_ctx);
+    }
+
+    return plugin_handle_result(request_handler, r, rc);
+}
+
+
+/*
+ * Create subrequests for plugin_ctx->upstream_request_, either the request's
+ * own or those of a local call, and launch the ones with no dependencies.
+ */
+static ngx_int_t plugin_start_subrequest(Handler *handler, ngx_http_request_t *r,
+        ngx_array_t **subrequests, PluginContext *plugin_ctx) {
+    size_t n;
+    subrequest_t *st;
+    ngx_http_adfront_ctx_t *ctx;
+
+    /* destroy subrequests created before */
+    if(*subrequests) {
+        plugin_destroy_local(*subrequests);
+        ngx_array_destroy(*subrequests);
+    }
+
+    n = plugin_ctx->upstream_request_.size();
+
+    /* local calls' subrequests count for the request they serve */
+    ctx = (ngx_http_adfront_ctx_t *)ngx_http_get_module_ctx(r, ngx_http_adfront_module);
+    ctx->subrequest_rounds++;
+    ctx->subrequest_fanout += n;
+
+    *subrequests = ngx_array_create(r->pool, n ? n : 1, sizeof(subrequest_t));
+    if(*subrequests == NULL) {
+        return NGX_ERROR;
+    }
+
+    for(size_t i = 0; i < n; i++) {
+        UpstreamRequest& ups = plugin_ctx->upstream_request_[i];
+
+        for(size_t j = 0; j < ups.deps_.size(); j++) {
+            if(ups.deps_[j] >= i) {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                        "[adfront] subrequest %uz depends on later one %uz", 
+                        i, ups.deps_[j]);
+
+                return NGX_ERROR;
+            }
+        }
+
+        ups.done_ = false;
+
+        st = (subrequest_t *)ngx_array_push(*subrequests); 
+        if(st == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memzero(st, sizeof(subrequest_t));
+    }
+
+    return plugin_launch_subrequest(handler, r, *subrequests, plugin_ctx);
+}
+
+
+/* 
+ * Launch every subrequest whose dependencies are done, a request depending
+ * on a skipped one is skipped too, http status is left to the builder.
+ * Dependencies always point to earlier entries, so one pass settles the 
+ * whole graph.
+ */
+static ngx_int_t plugin_launch_subrequest(Handler *handler, ngx_http_request_t *r,
+        ngx_array_t *subrequests, PluginContext *plugin_ctx) {
+    size_t n;
+    ngx_int_t rc;
+    subrequest_t *st, *sts;
+
+    n = subrequests->nelts;
+    sts = (subrequest_t *)subrequests->elts;
+
+    for(size_t i = 0; i < n; i++) {
+        UpstreamRequest& ups = plugin_ctx->upstream_request_[i];
+        st = &sts[i];
+
+        if(st->subr != NULL || st->local != NULL || st->finished) {
+            continue;
+        }
+
+        bool ready = true, failed = false;
+        for(size_t j = 0; j < ups.deps_.size(); j++) {
+            if(!sts[ups.deps_[j]].finished) {
+                ready = false;
+            } else if(!plugin_ctx->upstream_request_[ups.deps_[j]].done_) {
+                failed = true;
+            }
+        }
+
+        if(ready && !failed && ups.builder_ != NULL) {
+            failed = (ups.builder_->Build(*plugin_ctx, ups) != PLUGIN_OK);
+        }
+
+        if(failed) {
+            ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                    "[adfront] subrequest %uz skipped, dependency failed", i);
+
+            st->finished = 1;
+            continue;
+        }
+
+        if(!ready) {
+            continue;
+        }
+
+        /* local plugin, called in process with a child context */
+        if(!ups.plugin_.empty()) {
+            PluginContext *local_ctx = new PluginContext();
+
+            STR_MAP kv;
+            string args = UriDecode(ups.args_);
+            ngx_url_parser(args, kv);
+
+            local_ctx->headers_in_ = plugin_ctx->headers_in_;
+            for(STR_MAP::iterator it = kv.begin(); it != kv.end(); it++) {
+                local_ctx->headers_in_[it->first] = it->second;
+            }
+            local_ctx->headers_in_[HTTP_REQUEST_URL] = args;
+            local_ctx->headers_in_[HTTP_REQUEST_PLUGINNAME] = ups.plugin_;
+            local_ctx->time_stamp_ = plugin_ctx->time_stamp_;
+            local_ctx->trace_.Inherit(plugin_ctx->trace_, plugin_now_usec());
+
+            ngx_log_error(NGX_LOG_DEBUG, r->connection->log, 0,
+                    "[adfront] local subrequest %s?%s", 
+                    ups.plugin_.c_str(), ups.args_.c_str());
+
+            st->local = local_ctx;
+
+            rc = plugin_local_result(handler, r, st, ups, 
+                    handler->HandleLocal(*local_ctx, OFFLOAD_HANDLE));
+            if(rc != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            continue;
+        }
+
+        int flags = NGX_HTTP_SUBREQUEST_IN_MEMORY | NGX_HTTP_SUBREQUEST_WAITED;
+
+        rc = plugin_create_subrequest(r, ups, plugin_ctx->trace_, &st->uri, &st->args, 
+                &st->subr, plugin_subrequest_post_handler, flags);
+
+        if(rc == NGX_DECLINED) {
+            ups.status_ = NGX_HTTP_SERVICE_UNAVAILABLE;
+            st->finished = 1;
+            continue;
+        }
+
+        if(rc != NGX_OK) 
+            return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * @return 
+ *      NGX_OK          all subrequests settled, or any of them if the
+ *                      plugin waits for any
+ *      NGX_AGAIN       wait for more subrequests
+ *      NGX_ERROR       error
+ */
+static ngx_int_t plugin_collect_subrequest(Handler *handler, ngx_http_request_t *r,
+        ngx_array_t *subrequests, PluginContext *plugin_ctx) {
+    size_t              n, finished;
+    ngx_int_t           rc;
+    subrequest_t        *st;
+    ngx_http_upstream_t *up;
+
+    st = (subrequest_t *)subrequests->elts; 
+    n = subrequests->nelts;
+    for(size_t i = 0; i < n; i++, st++) {
+        if(st->finished) {
+            continue;
+        }
+
+        UpstreamRequest& ups = plugin_ctx->upstream_request_[i];
+
+        /* local call waiting for its own subrequests */
+        if(st->local != NULL) {
+            PluginContext *local_ctx = (PluginContext *)st->local;
+
+            rc = plugin_collect_subrequest(handler, r, st->children, local_ctx);
+            if(rc == NGX_AGAIN) {
+                continue;
+            } else if(rc != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            rc = plugin_local_result(handler, r, st, ups, 
+                    handler->HandleLocal(*local_ctx, OFFLOAD_POST_SUBHANDLE));
+            if(rc != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            continue;
+        }
+
+        if(st->subr == NULL || st->subr->done != 1) {
+            continue;
+        } 
+
+        up = st->subr->upstream;
+        if(up == NULL) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, 
+                    "[adfront] plugin subrequest upstream null, location not found ?");
+
+            return NGX_ERROR;
+        }
+
+        ups.status_ = up->state->status;
+        ups.up_sec_ = up->state->response_sec;
+        ups.up_msec_ = up->state->response_msec;
+        ups.response_ = string((char *)up->buffer.pos, up->buffer.last - up->buffer.pos);  
+        ups.done_ = true;
+
+        plugin_subrequest_timing(st->subr->post_subrequest->data, ups);
+        plugin_trace_subrequest(plugin_ctx->trace_, st, ups);
+
+        st->finished = 1;
+    }
+
+    if(plugin_launch_subrequest(handler, r, subrequests, plugin_ctx) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "[adfront] plugin start subrequest error");
+
+        return NGX_ERROR;
+    }
+
+    st = (subrequest_t *)subrequests->elts; 
+    finished = 0;
+    for(size_t i = 0; i < n; i++, st++) {
+        if(st->finished) {
+            finished++;
+        }
+    }
+
+    /* given up ones finish in background and are ignored */
+    if(finished < n && (finished == 0 || !plugin_ctx->wait_any_)) {
+        return NGX_AGAIN;
+    }
+
+    ngx_log_error(NGX_LOG_DEBUG, r->connection->log, 0, 
+            "[adfront] %uz of %uz subrequest done", finished, n);
+
+    return NGX_OK;
+}
+
+
+/* 
+ * Result of a local call: finish it, or start its subrequests. Those that
+ * complete at once, local ones included, are collected right away.
+ */
+static ngx_int_t plugin_local_result(Handler *handler, ngx_http_request_t *r,
+        subrequest_t *st, UpstreamRequest &ups, int rc) {
+    PluginContext *local_ctx = (PluginContext *)st->local;
+
+    while(rc == PLUGIN_AGAIN) {
+        if(plugin_start_subrequest(handler, r, &st->children, local_ctx) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        ngx_int_t crc = plugin_collect_subrequest(handler, r, st->children, local_ctx);
+        if(crc == NGX_AGAIN) {
+            return NGX_OK;
+        } else if(crc != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        rc = handler->HandleLocal(*local_ctx, OFFLOAD_POST_SUBHANDLE);
+    }
+
+    if(rc == PLUGIN_OK) {
+        ups.status_ = NGX_HTTP_OK;
+        ups.response_ = local_ctx->handle_result_;
+        ups.done_ = true;
+    } else {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                "[adfront] local subrequest %s fail, rc = %d", 
+                ups.plugin_.c_str(), rc);
+
+        ups.status_ = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        ups.done_ = false;
+    }
+
+    ups.up_sec_ = 0;
+    ups.up_msec_ = 0;
+
+    /* the local call's spans join the request's */
+    if(local_ctx->trace_.Sampled()) {
+        ngx_http_adfront_ctx_t *ctx;
+
+        ctx = (ngx_http_adfront_ctx_t *)ngx_http_get_module_ctx(r, ngx_http_adfront_module);
+
+        int span = local_ctx->trace_.Finish("local " + ups.plugin_, SPAN_KIND_INTERNAL, 
+                plugin_now_usec());
+        if(rc != PLUGIN_OK) {
+            local_ctx->trace_.SetError(span);
+        }
+
+        ((PluginContext *)ctx->plugin_ctx)->trace_.Merge(local_ctx->trace_);
+    }
+
+    if(st->children) {
+        plugin_destroy_local(st->children);
+    }
+
+    delete local_ctx;
+    st->local = NULL;
+    st->finished = 1;
+
+    return NGX_OK;
+}
+
+
+/* free child contexts of local calls still in flight */
+static void plugin_destroy_local(ngx_array_t *subrequests) {
+    subrequest_t *st = (subrequest_t *)subrequests->elts;
+
+    for(size_t i = 0; i < subrequests->nelts; i++, st++) {
+        if(st->local == NULL) {
+            continue;
+        }
+
+        if(st->children) {
+            plugin_destroy_local(st->children);
+        }
+
+        ((Handler *)adfront_handle)->RecordAlloc(*(PluginContext *)st->local);
+        delete (PluginContext *)st->local;
+        st->local = NULL;
+    }
+}
+
+
+/*
+ * Drops come in bursts while the worker is overloaded, so they're counted
+ * and warned about at most once a second. Args may be binary, never logged.
+ */
+static void plugin_subrequest_dropped(ngx_http_request_t *r, UpstreamRequest &ups) {
+    static time_t warned = 0;
+    static ngx_uint_t dropped = 0;
+
+    int priority = ngx_min(ups.priority_, UPSTREAM_PRIORITY_LOW);
+
+    if(metrics.subrequest_dropped[priority] != NULL) {
+        __sync_fetch_and_add(metrics.subrequest_dropped[priority], 1);
+    }
+
+    dropped++;
+
+    ngx_log_error(NGX_LOG_DEBUG, r->connection->log, 0,
+            "[adfront] subrequest %s, endpoint %d, priority %d dropped", 
+            ups.uri_.c_str(), ups.endpoint_, ups.priority_);
+
+    if(warned == ngx_time()) {
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+            "[adfront] %ui subrequests dropped since the last warning, "
+            "%ui in flight", dropped, subrequest_inflight);
+
+    warned = ngx_time();
+    dropped = 0;
+}
+
+
+/*
+ * Create a subrequest for ups. An endpoint's uri is shared instead of copied,
+ * once its location is known the subrequest starts right in there.
+ *
+ * @return
+ *      NGX_OK          subrequest created
+ *      NGX_DECLINED    dropped, too many subrequests in flight for its priority
+ *      NGX_ERROR       error
+ */
+static ngx_int_t plugin_create_subrequest(ngx_http_request_t *r, UpstreamRequest &ups,
+        Trace &trace, ngx_str_t *uri, ngx_str_t *args, ngx_http_request_t **sr, 
+        ngx_http_post_subrequest_pt handler, ngx_uint_t flags) {
+    ngx_uint_t limit;
+    endpoint_t *ep = NULL;
+    subrequest_opt_t *opt;
+    ngx_http_request_t *s;
+    ngx_pool_cleanup_t *cln;
+    ngx_http_core_main_conf_t *cmcf;
+    ngx_http_post_subrequest_t *psr;
+    ngx_http_adfront_main_conf_t *amcf;
+
+    /* low priority ones are dropped at half of the limit, high never */
+    amcf = (ngx_http_adfront_main_conf_t *)ngx_http_get_module_main_conf(r, 
+            ngx_http_adfront_module);
+
+    limit = amcf->subrequest_limit;
+    if(ups.priority_ >= UPSTREAM_PRIORITY_LOW) {
+        limit /= 2;
+    }
+
+    if(limit > 0 && ups.priority_ > UPSTREAM_PRIORITY_HIGH 
+            && subrequest_inflight >= limit) {
+        plugin_subrequest_dropped(r, ups);
+        return NGX_DECLINED;
+    }
+
+    if(ups.endpoint_ >= 0) {
+        if((size_t)ups.endpoint_ >= endpoints.size()) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "[adfront] endpoint %d not registered in plugin Init", 
+                    ups.endpoint_);
+
+            return NGX_ERROR;
+        }
+
+        ep = &endpoints[ups.endpoint_];
+        *uri = ep->uri;
+    } else {
+        uri->len = ups.uri_.length();
+        uri->data = (u_char *)ngx_pnalloc(r->pool, uri->len);
+        if(uri->data == NULL) {
+            return NGX_ERROR;
+        }
+        ngx_memcpy(uri->data, ups.uri_.c_str(), uri->len);
+    }
+
+    args->len = ups.args_.length();
+    args->data = (u_char *)ngx_pnalloc(r->pool, args->len);
+    if(args->data == NULL) {
+        return NGX_ERROR;
+    }
+    ngx_memcpy(args->data, ups.args_.c_str(), args->len);
+
+    opt = (subrequest_opt_t *)ngx_pcalloc(r->pool, sizeof(subrequest_opt_t));
+    if(opt == NULL) {
+        return NGX_ERROR;
+    }
+
+    opt->endpoint = ep;
+    opt->connect_timeout = ups.connect_timeout_msec_ > 0 ? ups.connect_timeout_msec_ : 0;
+    opt->read_timeout = ups.read_timeout_msec_ > 0 ? ups.read_timeout_msec_ : 0;
+    if(opt->read_timeout == 0 && ep != NULL && amcf->adaptive_timeout) {
+        opt->read_timeout = plugin_adaptive_timeout(amcf, ep);
+    }
+    opt->create_usec = plugin_now_usec();
+
+    /* the subrequest's span, a child of the request's or the local call's */
+    if(trace.SpanId() != 0) {
+        opt->span_id = Trace::NewId();
+
+        string traceparent = trace.TraceParent(opt->span_id);
+        opt->traceparent.len = traceparent.length();
+        opt->traceparent.data = (u_char *)ngx_pnalloc(r->pool, traceparent.length());
+        if(opt->traceparent.data == NULL) {
+            return NGX_ERROR;
+        }
+        ngx_memcpy(opt->traceparent.data, traceparent.data(), traceparent.length());
+    }
+
+    psr = (ngx_http_post_subrequest_t *)ngx_palloc(r->pool, 
+            sizeof(ngx_http_post_subrequest_t));
+    if(psr == NULL) {
+        return NGX_ERROR;
+    }
+
+    psr->handler = handler;
+    psr->data = opt;
+
+    /* post handler isn't called if the request is aborted, count down here */
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if(cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    if(ngx_http_subrequest(r, uri, args, sr, psr, flags) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = plugin_subrequest_cleanup;
+    cln->data = opt;
+
+    opt->inflight = 1;
+    subrequest_inflight++;
+    __sync_fetch_and_add(metrics.subrequest_inflight, 1);
+
+    ADFRONT_PROBE5(subrequest__start, r, *sr, uri->data, uri->len, args->len);
+
+    s = *sr;
+    if(ep == NULL || ep->loc_conf == NULL || ep->srv_conf != s->srv_conf) {
+        return NGX_OK;
+    }
+
+    /* what ngx_http_handler does, but past server rewrite and find config */
+    cmcf = (ngx_http_core_main_conf_t *)ngx_http_get_module_main_conf(s, ngx_http_core_module);
+
+    s->loc_conf = ep->loc_conf;
+    ngx_http_update_location_config(s);
+
+    s->phase_handler = cmcf->phase_engine.location_rewrite_index;
+    s->valid_location = 1;
+    s->write_event_handler = ngx_http_core_run_phases;
+
+    return NGX_OK;
+}
+
+
+/*
+ * Run the location's content handler, then hook the upstream it has created
+ * to time connect and header, and give it our timeouts. Connecting or 
+ * sending may have started with the location's, so the pending timer is
+ * armed again.
+ */
+static ngx_int_t plugin_subrequest_content_handler(ngx_http_request_t *r) {
+    ngx_int_t rc;
+    ngx_connection_t *c;
+    ngx_http_upstream_t *u;
+    ngx_http_upstream_conf_t *conf;
+    subrequest_opt_t *opt;
+
+    opt = (subrequest_opt_t *)r->post_subrequest->data;
+
+    if(opt->start_usec == 0) {
+        opt->start_usec = plugin_now_usec();
+    }
+
+    rc = opt->content_handler(r);
+
+    u = r->upstream;
+    if(u == NULL || u->conf == NULL) {
+        opt->deferred = (rc == NGX_DONE);
+        return rc;
+    }
+
+    c = u->peer.connection;
+    if(c != NULL && !u->request_sent) {
+        opt->write_event_handler = u->write_event_handler;
+        u->write_event_handler = plugin_subrequest_connected;
+    } else if(c != NULL) {
+        opt->connect_usec = plugin_now_usec();
+    }
+
+    if(u->process_header != NULL) {
+        opt->process_header = u->process_header;
+        u->process_header = plugin_subrequest_process_header;
+    }
+
+    if(opt->connect_timeout == 0 && opt->read_timeout == 0) {
+        return rc;
+    }
+
+    conf = (ngx_http_upstream_conf_t *)ngx_palloc(r->pool, sizeof(ngx_http_upstream_conf_t));
+    if(conf == NULL) {
+        return rc;
+    }
+
+    *conf = *u->conf;
+    if(opt->connect_timeout) {
+        conf->connect_timeout = opt->connect_timeout;
+    }
+    if(opt->read_timeout) {
+        conf->read_timeout = opt->read_timeout;
+    }
+    u->conf = conf;
+
+    if(c == NULL) {
+        return rc;
+    }
+
+    if(!u->request_sent && opt->connect_timeout && c->write->timer_set) {
+        ngx_del_timer(c->write);
+        ngx_add_timer(c->write, opt->connect_timeout);
+    } else if(u->request_sent && opt->read_timeout && c->read->timer_set) {
+        ngx_del_timer(c->read);
+        ngx_add_timer(c->read, opt->read_timeout);
+    }
+
+    return rc;
+}
+
+
+/* first write event of the upstream connection, connect is done */
+static void plugin_subrequest_connected(ngx_http_request_t *r, ngx_http_upstream_t *u) {
+    subrequest_opt_t *opt = (subrequest_opt_t *)r->post_subrequest->data;
+
+    opt->connect_usec = plugin_now_usec();
+
+    u->write_event_handler = opt->write_event_handler;
+    u->write_event_handler(r, u);
+}
+
+
+/* modules swap process_header as they parse, keep ours in front */
+static ngx_int_t plugin_subrequest_process_header(ngx_http_request_t *r) {
+    ngx_int_t rc;
+    ngx_http_upstream_t *u = r->upstream;
+    subrequest_opt_t *opt = (subrequest_opt_t *)r->post_subrequest->data;
+
+    rc = opt->process_header(r);
+
+    if(rc == NGX_AGAIN && u->process_header != plugin_subrequest_process_header) {
+        opt->process_header = u->process_header;
+        u->process_header = plugin_subrequest_process_header;
     }
 
-    /* assert(rc = PLUGIN_OK/PLUGIN_ERROR) */
-    return NGX_OK;
+    if(rc == NGX_OK) {
+        opt->header_usec = plugin_now_usec();
+    }
+
+    return rc;
 }
 
+
 /*
- * @return 
- *      NGX_OK          all subrequests have been done
- *      NGX_AGAIN       some subrequests haven't been done
+ * Read timeout of an endpoint from its recent latency, clamped to the 
+ * configured range. 0 keeps the location's until there are enough samples.
  */
-ngx_int_t plugin_check_subrequest(ngx_http_request_t *r) {
-    size_t                  n;
-    subrequest_t            *st;
-    ngx_http_upstream_t     *up;
-    ngx_http_adfront_ctx_t  *ctx;
-
-    ctx = (ngx_http_adfront_ctx_t *)ngx_http_get_module_ctx(r, ngx_http_adfront_module);
-    PluginContext *plugin_ctx = (PluginContext *)ctx->plugin_ctx;
-
-    ngx_log_error(NGX_LOG_DEBUG, r->connection->log, 0, 
-            "[adfront] plugin check subrequest, count = %d", r->main->count);
+static ngx_msec_t plugin_adaptive_timeout(ngx_http_adfront_main_conf_t *amcf, endpoint_t *ep) {
+    uint64_t msec;
+    time_t now = ngx_time();
 
-    st = (subrequest_t *)ctx->subrequests->elts; 
-    n = ctx->subrequests->nelts;
-    for(size_t i = 0; i < n; i++, st++) {
-        if(st->subr->done != 1) {
-            return NGX_AGAIN;
-        } 
+    if(ep->read_timeout_sec == now) {
+        return ep->read_timeout;
     }
 
-    ngx_log_error(NGX_LOG_DEBUG, r->connection->log, 0, 
-            "[adfront] all subrequest done");
+    ep->read_timeout_sec = now;
+    ep->read_timeout = 0;
 
-    st = (subrequest_t *)ctx->subrequests->elts; 
-    vector<UpstreamRequest>::iterator it = plugin_ctx->upstream_request_.begin();
-    for(size_t i = 0; i < n; i++, st++, it++) {
-        up = st->subr->upstream;
-        if(up == NULL) {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, 
-                    "[adfront] plugin subrequest upstream null, location not found ?");
+    RollingHistogram& sketch = Endpoints::Stats(ep - &endpoints[0]).response_usec;
 
-            return NGX_ERROR;
-        }
+    if(sketch.Count(now) < ADAPTIVE_TIMEOUT_SAMPLES) {
+        return 0;
+    }
 
-        it->status_ = up->state->status;
-        it->up_sec_ = up->state->response_sec;
-        it->up_msec_ = up->state->response_msec;
-        it->response_ = string((char *)up->buffer.pos, up->buffer.last - up->buffer.pos);  
+    msec = sketch.Quantile(ADAPTIVE_TIMEOUT_QUANTILE, now) 
+        * ADAPTIVE_TIMEOUT_PERCENT / 100 / 1000 + 1;
+
+    if(msec < amcf->adaptive_timeout_min) {
+        msec = amcf->adaptive_timeout_min;
+    } else if(msec > amcf->adaptive_timeout_max) {
+        msec = amcf->adaptive_timeout_max;
     }
 
-    return NGX_OK;
+    ep->read_timeout = (ngx_msec_t)msec;
+
+    return ep->read_timeout;
 }
 
 
 /*
- * @return 
- *      NGX_OK      plugin process request sucess   
- *      NGX_AGAIN   plugin has subrequest to be processed
- *      NGX_ERROR   plugin process reuquest fail
+ * An upstream made after the content handler returned, by adserver_batch
+ * for one, wasn't hooked: connect and header aren't known and their 
+ * histograms get nothing. The try's $upstream_response_time, the leader's 
+ * for a batch member, still feeds the adaptive timeout, connect included.
  */
-ngx_int_t plugin_post_subrequest(void *request_handler, ngx_http_request_t *r) {
-    ngx_int_t rc;
-    ngx_http_adfront_ctx_t *ctx;
+static void plugin_subrequest_deferred(EndpointStats &stats, ngx_http_upstream_state_t *state) {
+    ngx_msec_int_t ms;
 
-    ctx = (ngx_http_adfront_ctx_t *)ngx_http_get_module_ctx(r, ngx_http_adfront_module);
-    PluginContext *plugin_ctx = (PluginContext *)ctx->plugin_ctx;
+    ms = (ngx_msec_int_t)(state->response_sec * 1000 + state->response_msec);
 
-    rc = ((Handler *)request_handler)->PostSubHandle(*plugin_ctx);
+    stats.response_usec.Add((uint64_t)ngx_max(ms, 0) * 1000, ngx_time());
+}
 
-    if(rc == PLUGIN_AGAIN) {
-        rc = plugin_start_subrequest(r);
-        if(rc != NGX_OK) {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                    "[adfront] plugin start subrequest error");
-            
-            return NGX_ERROR;
-        }
 
-        return NGX_AGAIN;
-    } 
+/* usec breakdown of a finished subrequest */
+static void plugin_subrequest_timing(void *data, UpstreamRequest &ups) {
+    subrequest_opt_t *opt = (subrequest_opt_t *)data;
 
-    /* assert(rc = PLUGIN_OK/PLUGIN_ERROR) */
-    return NGX_OK;
+    ups.queue_usec_ = opt->start_usec ? opt->start_usec - opt->create_usec : 0;
+    ups.connect_usec_ = opt->connect_usec ? opt->connect_usec - opt->start_usec : 0;
+    ups.header_usec_ = opt->header_usec ? opt->header_usec - opt->start_usec : 0;
+    ups.total_usec_ = opt->done_usec - opt->create_usec;
+    ups.bytes_ = opt->bytes;
+
+    if(opt->peer) {
+        ups.peer_.assign((char *)opt->peer->data, opt->peer->len);
+    }
 }
 
 
-/*
- * @return 
- *      NGX_OK          output filter body complete
- *      NGX_AGAIN       output filter body incomplete
- *      NGX_ERROR       plugin finalize request fail
+/* 
+ * Subrequest done: it's no longer in flight, its timings go to the endpoint
+ * histograms, and the endpoint's location is remembered unless the uri was
+ * rewritten on the way.
  */
-ngx_int_t plugin_final_request(ngx_http_request_t *r) {
-    ngx_int_t               rc;
-    ngx_buf_t               *b;
-    ngx_chain_t             out;
-    ngx_http_adfront_ctx_t  *ctx;
+static void plugin_subrequest_finish(ngx_http_request_t *r, void *data) {
+    subrequest_opt_t *opt = (subrequest_opt_t *)data;
+    endpoint_t *ep = opt->endpoint;
+    ngx_http_upstream_t *u = r->upstream;
 
-    ctx = (ngx_http_adfront_ctx_t *)ngx_http_get_module_ctx(r, ngx_http_adfront_module);
-    PluginContext *plugin_ctx = (PluginContext *)ctx->plugin_ctx;
+    if(!opt->inflight) {
+        return;
+    }
 
-    ngx_url_jump(r, plugin_ctx->headers_out_);
-    ngx_write_cookie(r, plugin_ctx->headers_out_);
-    
-    if(plugin_ctx->handle_result_.empty()) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, 
-                "[adfront] plugin finalize with empty result");
+    opt->inflight = 0;
+    subrequest_inflight--;
+    __sync_fetch_and_sub(metrics.subrequest_inflight, 1);
 
-        plugin_destroy_ctx(r);
-        return NGX_ERROR;
+    opt->done_usec = plugin_now_usec();
+    if(u != NULL) {
+        opt->bytes = u->buffer.last - u->buffer.start;
+        opt->peer = u->state ? u->state->peer : NULL;
     }
 
-    b = ngx_create_temp_buf(r->pool, plugin_ctx->handle_result_.length()); 
-    if(b == NULL) {
-        plugin_destroy_ctx(r);
-        return NGX_ERROR;
+    ADFRONT_PROBE5(subrequest__done, r->parent, r, 
+            u && u->state ? u->state->status : 0, opt->bytes, 
+            opt->done_usec - opt->create_usec);
+
+    if(ep == NULL) {
+        return;
     }
 
-    ngx_memcpy(b->pos, plugin_ctx->handle_result_.c_str(), 
-            plugin_ctx->handle_result_.length());
-    b->last = b->pos + plugin_ctx->handle_result_.length();
-    b->last_buf = 1;
+    EndpointStats& stats = Endpoints::Stats(ep - &endpoints[0]);
 
-    out.buf = b;
-    out.next = NULL;
+    stats.total_usec.Add(opt->done_usec - opt->create_usec);
+    if(opt->connect_usec) {
+        stats.connect_usec.Add(opt->connect_usec - opt->start_usec);
+    }
+    if(opt->header_usec) {
+        stats.header_usec.Add(opt->header_usec - opt->start_usec);
+    }
 
-    /* 302 url jump */
-    if(r->headers_out.status != NGX_HTTP_MOVED_TEMPORARILY)
-       r->headers_out.status = NGX_HTTP_OK; 
+    /* 
+     * timed out ones count with what they waited, leaving them out would
+     * pull the percentile below the timeout and shrink it further
+     */
+    if(opt->connect_usec) {
+        stats.response_usec.Add((opt->header_usec ? opt->header_usec : opt->done_usec)
+                - opt->connect_usec, ngx_time());
+    } else if(opt->deferred && u != NULL && u->state != NULL && u->state->peer != NULL) {
+        plugin_subrequest_deferred(stats, u->state);
+    }
 
-    ngx_str_t type = ngx_string("text/plain; charset=utf-8");
-    r->headers_out.content_type = type;
-    r->headers_out.content_length_n = plugin_ctx->handle_result_.length();
+    if(u == NULL || u->state == NULL || u->state->status >= NGX_HTTP_SPECIAL_RESPONSE
+            || u->state->status == 0) {
+        __sync_fetch_and_add(&stats.failed, 1);
+    }
 
-    rc = ngx_http_send_header(r);
-    if(rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, 
-                "[adfront] send header fail");
+    if(ep->loc_conf != NULL) {
+        return;
+    }
 
-        plugin_destroy_ctx(r);
-        return NGX_ERROR;
-    }    
+    if(r->uri_changes != NGX_HTTP_MAX_URI_CHANGES + 1) {
+        return;
+    }
 
-    /* destroy request context exactly once */
-    plugin_destroy_ctx(r);
-    return ngx_http_output_filter(r, &out);
+    ep->srv_conf = r->srv_conf;
+    ep->loc_conf = r->loc_conf;
+
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+            "[adfront] endpoint %V resolved", &ep->uri);
 }
 
-ngx_int_t plugin_done_request(ngx_http_request_t *r) {
-    ngx_log_error(NGX_LOG_DEBUG, r->connection->log, 0, 
-            "[adfront] done request, count = %d", r->main->count);
 
-    return ngx_http_output_filter(r, NULL);
-}
+/* kept if it took the capture threshold so far, sending left out */
+static void plugin_capture_finish(ngx_http_adfront_ctx_t *ctx, PluginContext *plugin_ctx) {
+    CapturedRequest *capture = (CapturedRequest *)ctx->capture;
 
-void plugin_destroy_request(ngx_http_request_t *r) {
-    ngx_log_error(NGX_LOG_DEBUG, r->connection->log, 0,
-            "[adfront] destroy request context, count = %d", r->main->count);
+    ctx->capture = NULL;
 
-    plugin_destroy_ctx(r); 
+    capture->total_usec = plugin_now_usec() - capture->start_usec;
+    if(capture->total_usec < capture_usec) {
+        delete capture;
+        return;
+    }
+
+    capture->handle_result = plugin_ctx->handle_result_;
+    capture_ring->Add(capture);
+
+    __sync_fetch_and_add(metrics.captured, 1);
 }
 
-/*---------------------------- local function --------------------------------*/
-static ngx_int_t plugin_start_subrequest(ngx_http_request_t *r) {
-    size_t n;
-    subrequest_t *st;
-    ngx_http_adfront_ctx_t *ctx;
-    ngx_http_post_subrequest_t *psr;
 
-    ctx = (ngx_http_adfront_ctx_t *)ngx_http_get_module_ctx(r, ngx_http_adfront_module);
-    PluginContext *plugin_ctx = (PluginContext *)ctx->plugin_ctx;
+/* span of a collected subrequest, under the span that sent it */
+static void plugin_trace_subrequest(Trace &trace, subrequest_t *st, UpstreamRequest &ups) {
+    char buf[32];
+    subrequest_opt_t *opt = (subrequest_opt_t *)st->subr->post_subrequest->data;
 
-    /* destroy subrequests created before */
-    if(ctx->subrequests) {
-        ngx_array_destroy(ctx->subrequests);
+    if(!trace.Sampled() || opt->span_id == 0) {
+        return;
     }
-    ctx->subrequests = ngx_array_create(r->pool, 1, sizeof(subrequest_t));
 
-    n = plugin_ctx->upstream_request_.size();
-    for(size_t i = 0; i < n; i++) {
-        UpstreamRequest& ups = plugin_ctx->upstream_request_[i];
-        
-        st = (subrequest_t *)ngx_array_push(ctx->subrequests); 
-        if(st == NULL) {
-            return NGX_ERROR;
-        }
+    int span = trace.AddSpan(string((char *)st->uri.data, st->uri.len), opt->span_id,
+            trace.SpanId(), SPAN_KIND_CLIENT, opt->create_usec, opt->done_usec);
 
-        st->uri.data = (u_char *)ngx_pcalloc(r->pool, ups.uri_.length());
-        if(st->uri.data == NULL) {
-            return NGX_ERROR;
-        }
-        ngx_memcpy(st->uri.data, ups.uri_.c_str(), ups.uri_.length()); 
-        st->uri.len = ups.uri_.length();
+    snprintf(buf, sizeof(buf), "%d", ups.status_);
+    trace.SetAttribute(span, "http.status_code", buf);
 
-        st->args.data = (u_char *)ngx_pcalloc(r->pool, ups.args_.length());
-        if(st->args.data == NULL) {
-            return NGX_ERROR;
-        }
-        ngx_memcpy(st->args.data, ups.args_.c_str(), ups.args_.length()); 
-        st->args.len = ups.args_.length();
+    snprintf(buf, sizeof(buf), "%lu", (unsigned long)ups.bytes_);
+    trace.SetAttribute(span, "adfront.bytes", buf);
 
+    if(!ups.peer_.empty()) {
+        trace.SetAttribute(span, "net.peer.name", ups.peer_);
     }
 
-    n = ctx->subrequests->nelts;
-    st = (subrequest_t *)ctx->subrequests->elts;
-    for(size_t i = 0; i < n; i++, st++) {
-        int flags = NGX_HTTP_SUBREQUEST_IN_MEMORY | NGX_HTTP_SUBREQUEST_WAITED;
+    if(ups.status_ == 0 || ups.status_ >= NGX_HTTP_SPECIAL_RESPONSE) {
+        trace.SetError(span);
+    }
+}
 
-        psr = (ngx_http_post_subrequest_t *)ngx_palloc(r->pool, 
-                sizeof(ngx_http_post_subrequest_t));
-        if(psr == NULL) {
-            return NGX_ERROR;
-        }
 
-        psr->handler = plugin_subrequest_post_handler;
-        psr->data = NULL;
+/* 
+ * The request's own span ends here and the trace is exported, once. A debug
+ * trace goes back in the response headers too, unless there's no response.
+ */
+static void plugin_trace_finish(ngx_http_request_t *r, ngx_http_adfront_ctx_t *ctx, 
+        PluginContext *plugin_ctx, bool failed) {
+    char buf[32];
+    Trace &trace = plugin_ctx->trace_;
 
-        ngx_int_t rc = ngx_http_subrequest(r, &st->uri, &st->args, 
-                &st->subr, psr, flags);
+    if(ctx->traced || !trace.Sampled()) {
+        return;
+    }
 
-        if(rc != NGX_OK) 
-            return NGX_ERROR;
+    ctx->traced = 1;
+
+    string name = ctx->plugin.len ? string((char *)ctx->plugin.data, ctx->plugin.len) 
+        : string("adfront");
+
+    int span = trace.Finish(name, SPAN_KIND_SERVER, plugin_now_usec());
+
+    snprintf(buf, sizeof(buf), "%lu", (unsigned long)ctx->subrequest_rounds);
+    trace.SetAttribute(span, "adfront.rounds", buf);
+
+    if(failed) {
+        trace.SetError(span);
+    } else if(trace.Debug()) {
+        ngx_write_trace(r, trace);
     }
 
-    return NGX_OK;
+    __sync_fetch_and_add(metrics.traced, 1);
+
+    if(!SpanExporter::Export(trace)) {
+        __sync_fetch_and_add(metrics.trace_dropped, 1);
+    }
+
+    trace.Clear();
+}
+
+
+static void plugin_subrequest_cleanup(void *data) {
+    subrequest_opt_t *opt = (subrequest_opt_t *)data;
+
+    if(opt->inflight) {
+        opt->inflight = 0;
+        subrequest_inflight--;
+        __sync_fetch_and_sub(metrics.subrequest_inflight, 1);
+    }
 }
 
 
 static ngx_int_t
 plugin_subrequest_post_handler(ngx_http_request_t *r, void *data, ngx_int_t rc) {
-    (void)data;
     (void)rc;
 
+    plugin_subrequest_finish(r, data);
+
     ngx_log_error(NGX_LOG_DEBUG, r->connection->log, 0,
             "[adfront] subrequest finish %V?%V", &r->uri, &r->args);
 
@@ -396,6 +2037,66 @@ plugin_subrequest_post_handler(ngx_http_request_t *r, void *data, ngx_int_t rc)
 }
 
 
+/*
+ * Send plugin_ctx->detached_request_ as in-memory subrequests nobody waits
+ * for, once the response has been written. They hold r->main->count: the
+ * request is logged, $request_time included, and its connection goes to
+ * keepalive only after the last of them, so on a persistent connection the
+ * next request waits for them. They carry the trace context, but the trace
+ * has been exported without them.
+ */
+static void plugin_detach_subrequest(ngx_http_request_t *r, PluginContext *plugin_ctx) {
+    ngx_int_t rc;
+    ngx_str_t uri, args;
+    ngx_http_request_t *sr;
+
+    for(size_t i = 0; i < plugin_ctx->detached_request_.size(); i++) {
+        UpstreamRequest& ups = plugin_ctx->detached_request_[i];
+
+        rc = plugin_create_subrequest(r, ups, plugin_ctx->trace_, &uri, &args, &sr,
+                plugin_detached_post_handler, NGX_HTTP_SUBREQUEST_IN_MEMORY);
+        if(rc == NGX_ERROR) {
+            ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                    "[adfront] detached subrequest %s?%s, endpoint %d start fail", 
+                    ups.uri_.c_str(), ups.args_.c_str(), ups.endpoint_);
+        }
+
+        if(rc != NGX_OK) {
+            detached_done++;
+            detached_failed++;
+            __sync_fetch_and_add(metrics.detached_done, 1);
+            __sync_fetch_and_add(metrics.detached_failed, 1);
+        }
+    }
+}
+
+
+/* only counted, unlike plugin_subrequest_post_handler the parent isn't woken */
+static ngx_int_t
+plugin_detached_post_handler(ngx_http_request_t *r, void *data, ngx_int_t rc) {
+    plugin_subrequest_finish(r, data);
+
+    detached_done++;
+    __sync_fetch_and_add(metrics.detached_done, 1);
+
+    if(rc != NGX_OK || r->upstream == NULL 
+            || r->headers_out.status >= NGX_HTTP_SPECIAL_RESPONSE) {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                "[adfront] detached subrequest %V?%V fail, rc = %i, status = %ui", 
+                &r->uri, &r->args, rc, r->headers_out.status);
+
+        detached_failed++;
+        __sync_fetch_and_add(metrics.detached_failed, 1);
+        return NGX_OK;
+    }
+
+    ngx_log_error(NGX_LOG_DEBUG, r->connection->log, 0,
+            "[adfront] detached subrequest finish %V?%V", &r->uri, &r->args);
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t plugin_create_ctx(ngx_http_request_t *r) {
     ngx_int_t rc;
     ngx_http_adfront_ctx_t *ctx;
@@ -426,6 +2127,41 @@ static ngx_int_t plugin_create_ctx(ngx_http_request_t *r) {
 
     ctx = (ngx_http_adfront_ctx_t *)ngx_http_get_module_ctx(r, ngx_http_adfront_module);
     ctx->plugin_ctx = plugin_ctx;
+
+    /* continue the caller's trace, or start one */
+    if(trace_on) {
+        Trace &trace = plugin_ctx->trace_;
+
+        STR_MAP::const_iterator it = plugin_ctx->headers_in_.find(kIsTrace);
+        if(trace_debug && it != plugin_ctx->headers_in_.end() && it->second == "1") {
+            trace.SetDebug();
+        }
+
+        bool sample = trace_sample > 0 && ++trace_requests % trace_sample == 0;
+        int64_t start = (int64_t)ctx->time_start.tv_sec * 1000000 + ctx->time_start.tv_usec;
+
+        if(!trace.Start(ngx_http_get_traceparent(r), sample, start)) {
+            ngx_log_error(NGX_LOG_INFO, r->connection->log, 0, 
+                    "[adfront] invalid traceparent, new trace started");
+        }
+
+        string traceparent = trace.TraceParent(trace.SpanId());
+        ctx->traceparent.data = (u_char *)ngx_pnalloc(r->pool, traceparent.length());
+        if(ctx->traceparent.data != NULL) {
+            ngx_memcpy(ctx->traceparent.data, traceparent.data(), traceparent.length());
+            ctx->traceparent.len = traceparent.length();
+        }
+    }
+
+    /* the plugin context is gone by the log phase */
+    STR_MAP::const_iterator it = plugin_ctx->headers_in_.find(HTTP_REQUEST_PLUGINNAME);
+    if(it != plugin_ctx->headers_in_.end() && !it->second.empty()) {
+        ctx->plugin.data = (u_char *)ngx_pnalloc(r->pool, it->second.length());
+        if(ctx->plugin.data != NULL) {
+            ngx_memcpy(ctx->plugin.data, it->second.data(), it->second.length());
+            ctx->plugin.len = it->second.length();
+        }
+    }
    
     return NGX_OK;
 }
@@ -436,8 +2172,34 @@ static void plugin_destroy_ctx(ngx_http_request_t *r) {
 
     ctx = (ngx_http_adfront_ctx_t *)ngx_http_get_module_ctx(r, ngx_http_adfront_module);
 
-    if(ctx->plugin_ctx)
+    if(ctx->subrequests) {
+        plugin_destroy_local(ctx->subrequests);
+    }
+
+    /* failed or aborted before its result, not kept */
+    if(ctx->capture) {
+        delete (CapturedRequest *)ctx->capture;
+        ctx->capture = NULL;
+    }
+
+    /* ended before its response, exported as failed */
+    if(ctx->plugin_ctx && !ctx->offload) {
+        plugin_trace_finish(r, ctx, (PluginContext *)ctx->plugin_ctx, true);
+    }
+
+    /* offload thread still uses the context, task frees it when done */
+    if(ctx->offload) {
+        ((OffloadTask *)ctx->offload)->data_ = NULL;
+        ctx->offload = NULL;
+        ctx->plugin_ctx = NULL;
+
+        return;
+    }
+
+    if(ctx->plugin_ctx) {
+        ((Handler *)adfront_handle)->RecordAlloc(*(PluginContext *)ctx->plugin_ctx);
         delete (PluginContext *)ctx->plugin_ctx;
+    }
 
     ctx->plugin_ctx = NULL;
 }
@@ -456,7 +2218,7 @@ static void plugin_post_body(ngx_http_request_t *r) {
     }
 
     /* read request body in multiple times */
-    ctx->state = ADFRONT_STATE_PROCESS;
+    ngx_http_adfront_set_state(ctx, ADFRONT_STATE_PROCESS);
 
     ngx_http_finalize_request(r, r->content_handler(r));
     ngx_http_run_posted_requests(r->connection);
@@ -551,6 +2313,36 @@ static string ngx_http_get_referer(ngx_http_request_t* r) {
 }
 
 
+static string ngx_http_get_traceparent(ngx_http_request_t* r) {
+    ngx_uint_t i;
+    ngx_list_part_t *part;
+    ngx_table_elt_t *h;
+
+    part = &r->headers_in.headers.part;
+    h = (ngx_table_elt_t *)part->elts;
+
+    for (i = 0; /* void */; i++) {
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            h = (ngx_table_elt_t *)part->elts;
+            i = 0;
+        }
+
+        if (h[i].key.len == sizeof("traceparent") - 1 
+                && ngx_strncasecmp(h[i].key.data, (u_char *)"traceparent", 
+                    h[i].key.len) == 0) {
+            return string((char *)h[i].value.data, h[i].value.len);
+        }
+    }
+
+    return "";
+}
+
+
 static string ngx_http_get_user_agent(ngx_http_request_t* r) {
     if (NULL == r->headers_in.user_agent) {
         return "";
@@ -844,6 +2636,46 @@ static int ngx_write_cookie(ngx_http_request_t* r, const STR_MAP &kv_out) {
 }
 
 
+/* span tree of a debug request, one X-Adfront-Span header per span */
+static int ngx_write_trace(ngx_http_request_t* r, const Trace &trace) {
+    vector<string> lines;
+
+    trace.WriteTree(lines);
+
+    for(size_t i = 0; i < lines.size(); i++) {
+        ngx_table_elt_t *h = (ngx_table_elt_t *)ngx_list_push(&r->headers_out.headers);
+        if(h == NULL) {
+            return NGX_ERROR;
+        }
+
+        /* names and attributes come from plugins */
+        ReplaceAll(lines[i], "\r", " ");
+        ReplaceAll(lines[i], "\n", " ");
+
+        h->hash = 1;
+        h->key.len = sizeof("X-Adfront-Span") - 1;
+        h->key.data = (u_char *)"X-Adfront-Span";
+
+        h->value.data = (u_char *)ngx_pnalloc(r->pool, lines[i].length());
+        if(h->value.data == NULL) {
+            return NGX_ERROR;
+        }
+        ngx_memcpy(h->value.data, lines[i].data(), lines[i].length());
+        h->value.len = lines[i].length();
+    }
+
+    return NGX_OK;
+}
+
+
+static int64_t plugin_now_usec() {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
 static void ReplaceAll(std::string &s, const std::string &t, const std::string &w) {  
     std::string::size_type pos = s.find(t), t_size = t.size(), r_size = w.size();  
 
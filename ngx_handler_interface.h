@@ -16,21 +16,91 @@ ngx_int_t plugin_init_handler(void *handle);
 
 void plugin_destroy_handler(void *handle);
 
+/* offload api */
+ngx_int_t plugin_init_offload(void *handle, ngx_uint_t threads, 
+        ngx_uint_t task_threads, ngx_socket_t *fd);
+
+ngx_uint_t plugin_is_offload(void *handle, ngx_http_request_t *r);
+
+ngx_http_request_t *plugin_offload_next(void *handle);
+
+ngx_uint_t plugin_offload_queue(void *handle);
+
 /* request api */
 ngx_int_t plugin_init_request(ngx_http_request_t *r);
 
+ngx_int_t plugin_prepare_request(ngx_http_request_t *r);
+
 ngx_int_t plugin_process_request(void *handle, ngx_http_request_t *r);
 
-ngx_int_t plugin_check_subrequest(ngx_http_request_t *r);
+void plugin_process_batch(void *handle, ngx_http_request_t **rs, ngx_uint_t n);
+
+ngx_int_t plugin_check_subrequest(void *handle, ngx_http_request_t *r);
 
 ngx_int_t plugin_post_subrequest(void *handle, ngx_http_request_t *r);
 
+ngx_int_t plugin_prepare_subrequest(ngx_http_request_t *r);
+
+ngx_int_t plugin_subrequest_timeouts(ngx_http_request_t *r, ngx_msec_t *connect_timeout,
+        ngx_msec_t *read_timeout);
+
 ngx_int_t plugin_final_request(ngx_http_request_t *r);
 
 ngx_int_t plugin_done_request(ngx_http_request_t *r);
 
 void plugin_destroy_request(ngx_http_request_t *r);
 
+void plugin_detached_stats(ngx_uint_t *done, ngx_uint_t *failed);
+
+/* watchdog api */
+ngx_int_t plugin_init_watchdog(void *handle, ngx_msec_t slow_call, 
+        ngx_uint_t backtrace_every);
+
+void plugin_loop_lag(ngx_msec_t lag);
+
+ngx_int_t plugin_init_perf(void *handle, ngx_uint_t sample_every);
+
+/* allocation api */
+ngx_int_t plugin_init_alloc(ngx_uint_t site_every);
+
+ngx_buf_t *plugin_alloc_sites(ngx_http_request_t *r);
+
+/* profiler api */
+void plugin_profile_request(ngx_uint_t seconds, ngx_uint_t hz);
+
+void plugin_profile_tick(ngx_str_t *dir);
+
+void plugin_exit_profile(void);
+
+/* capture api */
+ngx_int_t plugin_init_capture(ngx_msec_t slow, ngx_uint_t size);
+
+void plugin_capture_request(void);
+
+void plugin_capture_tick(ngx_str_t *dir);
+
+/* trace api */
+ngx_int_t plugin_init_trace(ngx_str_t *file, ngx_uint_t sample, ngx_flag_t debug);
+
+ngx_int_t plugin_traceparent(ngx_http_request_t *r, ngx_str_t *traceparent);
+
+void plugin_exit_trace(void);
+
+/* log api */
+ngx_int_t plugin_init_log(ngx_str_t *file, ngx_uint_t level, size_t rotate_size, 
+        time_t rotate_interval);
+
+void plugin_log_tick(void);
+
+void plugin_exit_log(void);
+
+/* metrics api */
+ngx_int_t plugin_init_metrics(void *addr, size_t size);
+
+void plugin_metrics_request(ngx_http_request_t *r);
+
+ngx_buf_t *plugin_metrics_status(ngx_http_request_t *r, ngx_uint_t json);
+
 
 #if __cplusplus
 }
@@ -1,14 +1,98 @@
 #include "ngx_handler_interface.h"
 #include "ngx_http_adfront_module.h"
 
+#include <sys/eventfd.h>
+
+static void *ngx_http_adfront_create_main_conf(ngx_conf_t *cf);
+static char *ngx_http_adfront_init_main_conf(ngx_conf_t *cf, void *conf);
 static void *ngx_http_adfront_create_loc_conf(ngx_conf_t *cf);
 static char *ngx_http_adfront_merge_loc_conf(ngx_conf_t *cf,
     void *parent, void *child);
 
+static ngx_int_t ngx_http_adfront_add_variables(ngx_conf_t *cf);
 static ngx_int_t ngx_http_adfront_init_process(ngx_cycle_t *cycle);
+static void ngx_http_adfront_exit_process(ngx_cycle_t *cycle);
 
 static char *ngx_http_adfront(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static ngx_int_t ngx_http_adfront_handler(ngx_http_request_t *r);
+static char *ngx_http_adfront_metrics_zone(ngx_conf_t *cf, ngx_command_t *cmd, 
+    void *conf);
+static ngx_int_t ngx_http_adfront_metrics_init_zone(ngx_shm_zone_t *shm_zone, 
+    void *data);
+static char *ngx_http_adfront_status(ngx_conf_t *cf, ngx_command_t *cmd, 
+    void *conf);
+static ngx_int_t ngx_http_adfront_status_handler(ngx_http_request_t *r);
+static char *ngx_http_adfront_profile(ngx_conf_t *cf, ngx_command_t *cmd, 
+    void *conf);
+static ngx_int_t ngx_http_adfront_profile_handler(ngx_http_request_t *r);
+static char *ngx_http_adfront_inflight(ngx_conf_t *cf, ngx_command_t *cmd, 
+    void *conf);
+static ngx_int_t ngx_http_adfront_inflight_handler(ngx_http_request_t *r);
+static char *ngx_http_adfront_capture(ngx_conf_t *cf, ngx_command_t *cmd, 
+    void *conf);
+static ngx_int_t ngx_http_adfront_capture_handler(ngx_http_request_t *r);
+static size_t ngx_http_adfront_inflight_len(ngx_array_t *subrequests);
+static u_char *ngx_http_adfront_inflight_pending(u_char *p, 
+    ngx_array_t *subrequests);
+static void ngx_http_adfront_cleanup(void *data);
+
+static ngx_int_t ngx_http_adfront_batch_add(ngx_http_request_t *r, 
+    ngx_http_adfront_main_conf_t *amcf);
+static void ngx_http_adfront_batch_remove(ngx_http_request_t *r);
+static void ngx_http_adfront_batch_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_adfront_offload_init(ngx_cycle_t *cycle, 
+    ngx_http_adfront_main_conf_t *amcf);
+static void ngx_http_adfront_offload_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_adfront_init(ngx_conf_t *cf);
+static ngx_int_t ngx_http_adfront_subrequest_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_adfront_yield_init(ngx_cycle_t *cycle);
+static ngx_int_t ngx_http_adfront_yield(ngx_http_request_t *r);
+static void ngx_http_adfront_yield_handler(ngx_event_t *ev);
+static void ngx_http_adfront_loop_lag_handler(ngx_event_t *ev);
+
+static ngx_int_t ngx_http_adfront_offload_wait_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_adfront_offload_queue_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_adfront_detached_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_adfront_state_time_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_adfront_rounds_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_adfront_plugin_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_adfront_traceparent_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_adfront_timeout_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+
+
+/*
+ * Requests ready for plugin Handle, gathered during one event loop iteration
+ * and dispatched together by a posted event. Requests resumed by a flush
+ * may queue again, so they go to the other array meanwhile.
+ */
+typedef struct {
+    ngx_uint_t              n;
+    ngx_http_request_t      **requests;
+
+    ngx_uint_t              nflushing;
+    ngx_http_request_t      **flushing;
+
+    ngx_http_request_t      **spare;
+    ngx_event_t             event;
+} ngx_http_adfront_batch_t;
+
+
+/* sharelib LOG_LEVEL_* */
+static ngx_conf_enum_t ngx_http_adfront_log_levels[] = {
+    { ngx_string("debug"), 0 },
+    { ngx_string("info"), 1 },
+    { ngx_string("warn"), 2 },
+    { ngx_string("error"), 3 },
+    { ngx_null_string, 0 }
+};
 
 
 static ngx_command_t  ngx_http_adfront_commands[] = {
@@ -27,16 +111,258 @@ static ngx_command_t  ngx_http_adfront_commands[] = {
         offsetof(ngx_http_adfront_loc_conf_t, plugin_manager_config_file),
         NULL },
 
+    { ngx_string("plugin_manager_batch_size"),
+        NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_num_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(ngx_http_adfront_main_conf_t, batch_size),
+        NULL },
+
+    { ngx_string("plugin_manager_offload_threads"),
+        NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_num_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(ngx_http_adfront_main_conf_t, offload_threads),
+        NULL },
+
+    { ngx_string("plugin_manager_task_threads"),
+        NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_num_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(ngx_http_adfront_main_conf_t, task_threads),
+        NULL },
+
+    { ngx_string("plugin_manager_subrequest_limit"),
+        NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_num_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(ngx_http_adfront_main_conf_t, subrequest_limit),
+        NULL },
+
+    { ngx_string("plugin_manager_adaptive_timeout"),
+        NGX_HTTP_MAIN_CONF | NGX_CONF_FLAG,
+        ngx_conf_set_flag_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(ngx_http_adfront_main_conf_t, adaptive_timeout),
+        NULL },
+
+    { ngx_string("plugin_manager_adaptive_timeout_min"),
+        NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_msec_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(ngx_http_adfront_main_conf_t, adaptive_timeout_min),
+        NULL },
+
+    { ngx_string("plugin_manager_adaptive_timeout_max"),
+        NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_msec_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(ngx_http_adfront_main_conf_t, adaptive_timeout_max),
+        NULL },
+
+    { ngx_string("plugin_manager_slow_call"),
+        NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_msec_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(ngx_http_adfront_main_conf_t, slow_call),
+        NULL },
+
+    { ngx_string("plugin_manager_slow_call_backtrace"),
+        NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_num_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(ngx_http_adfront_main_conf_t, slow_call_backtrace),
+        NULL },
+
+    { ngx_string("plugin_manager_perf_counters"),
+        NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_num_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(ngx_http_adfront_main_conf_t, perf_counters),
+        NULL },
+
+    { ngx_string("plugin_manager_alloc_sites"),
+        NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_num_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(ngx_http_adfront_main_conf_t, alloc_sites),
+        NULL },
+
+    { ngx_string("plugin_manager_capture"),
+        NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_msec_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(ngx_http_adfront_main_conf_t, capture),
+        NULL },
+
+    { ngx_string("plugin_manager_capture_size"),
+        NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_num_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(ngx_http_adfront_main_conf_t, capture_size),
+        NULL },
+
+    { ngx_string("plugin_manager_trace"),
+        NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_str_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(ngx_http_adfront_main_conf_t, trace_file),
+        NULL },
+
+    { ngx_string("plugin_manager_trace_sample"),
+        NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_num_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(ngx_http_adfront_main_conf_t, trace_sample),
+        NULL },
+
+    { ngx_string("plugin_manager_trace_debug"),
+        NGX_HTTP_MAIN_CONF | NGX_CONF_FLAG,
+        ngx_conf_set_flag_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(ngx_http_adfront_main_conf_t, trace_debug),
+        NULL },
+
+    { ngx_string("plugin_manager_log"),
+        NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_str_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(ngx_http_adfront_main_conf_t, log_file),
+        NULL },
+
+    { ngx_string("plugin_manager_log_level"),
+        NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_enum_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(ngx_http_adfront_main_conf_t, log_level),
+        &ngx_http_adfront_log_levels },
+
+    { ngx_string("plugin_manager_log_rotate_size"),
+        NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_size_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(ngx_http_adfront_main_conf_t, log_rotate_size),
+        NULL },
+
+    { ngx_string("plugin_manager_log_rotate_interval"),
+        NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_sec_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(ngx_http_adfront_main_conf_t, log_rotate_interval),
+        NULL },
+
+    { ngx_string("plugin_manager_metrics_zone"),
+        NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+        ngx_http_adfront_metrics_zone,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        0,
+        NULL },
+
+    { ngx_string("adfront_status"),
+      NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS,
+      ngx_http_adfront_status,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("adfront_profile"),
+      NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+      ngx_http_adfront_profile,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("adfront_inflight"),
+      NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS,
+      ngx_http_adfront_inflight,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("adfront_capture"),
+      NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+      ngx_http_adfront_capture,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
     ngx_null_command
 };
 
 
+static ngx_http_variable_t  ngx_http_adfront_vars[] = {
+
+    { ngx_string("adfront_offload_wait"), NULL,
+      ngx_http_adfront_offload_wait_variable, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("adfront_offload_queue"), NULL,
+      ngx_http_adfront_offload_queue_variable, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("adfront_detached"), NULL,
+      ngx_http_adfront_detached_variable, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    /* body read and context build */
+    { ngx_string("adfront_parse_time"), NULL,
+      ngx_http_adfront_state_time_variable,
+      ADFRONT_STATE_MASK(ADFRONT_STATE_INIT),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    /* Handle and PostSubHandle, queued for batch or offload included */
+    { ngx_string("adfront_handle_time"), NULL,
+      ngx_http_adfront_state_time_variable,
+      ADFRONT_STATE_MASK(ADFRONT_STATE_PROCESS)
+      |ADFRONT_STATE_MASK(ADFRONT_STATE_WAIT_BATCH)
+      |ADFRONT_STATE_MASK(ADFRONT_STATE_WAIT_OFFLOAD)
+      |ADFRONT_STATE_MASK(ADFRONT_STATE_POST_SUBREQUEST),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    /* waiting for subrequests, all rounds */
+    { ngx_string("adfront_upstream_time"), NULL,
+      ngx_http_adfront_state_time_variable,
+      ADFRONT_STATE_MASK(ADFRONT_STATE_WAIT_SUBREQUEST),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    /* response built and passed to the output filters */
+    { ngx_string("adfront_send_time"), NULL,
+      ngx_http_adfront_state_time_variable,
+      ADFRONT_STATE_MASK(ADFRONT_STATE_FINAL),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("adfront_rounds"), NULL,
+      ngx_http_adfront_rounds_variable, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("adfront_plugin"), NULL,
+      ngx_http_adfront_plugin_variable, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    /* the request's own, or the one a subrequest is to send on */
+    { ngx_string("adfront_traceparent"), NULL,
+      ngx_http_adfront_traceparent_variable, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    /* timeouts in msec a subrequest asked for, for adserver_batch */
+    { ngx_string("adfront_connect_timeout"), NULL,
+      ngx_http_adfront_timeout_variable, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("adfront_read_timeout"), NULL,
+      ngx_http_adfront_timeout_variable, 1,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_null_string, NULL, NULL, 0, 0, 0 }
+};
+
+
 static ngx_http_module_t  ngx_http_adfront_module_ctx = {
-    NULL,                                   /* preconfiguration */
-    NULL,                                   /* postconfiguration */
+    ngx_http_adfront_add_variables,         /* preconfiguration */
+    ngx_http_adfront_init,                  /* postconfiguration */
 
-    NULL,                                   /* create main configuration */
-    NULL,                                   /* init main configuration */
+    ngx_http_adfront_create_main_conf,      /* create main configuration */
+    ngx_http_adfront_init_main_conf,        /* init main configuration */
 
     NULL,                                   /* create server configuration */
     NULL,                                   /* merge server configuration */
@@ -56,14 +382,223 @@ ngx_module_t  ngx_http_adfront_module = {
     ngx_http_adfront_init_process,          /* init process */
     NULL,                                   /* init thread */
     NULL,                                   /* exit thread */
-    NULL,                                   /* exit process */
+    ngx_http_adfront_exit_process,          /* exit process */
     NULL,                                   /* exit master */
     NGX_MODULE_V1_PADDING
 };
 
-/* plugin manager handle (Handler *) */
 void *adfront_handle = NULL;
 
+const char *ngx_http_adfront_state_names[ADFRONT_STATE_COUNT] = {
+    "init", "process", "wait_batch", "wait_offload", "wait_subrequest",
+    "post_subrequest", "final", "done", "error"
+};
+
+static ngx_http_adfront_batch_t ngx_http_adfront_batch;
+
+/* live requests of the worker, oldest first, see adfront_inflight */
+static ngx_queue_t ngx_http_adfront_inflight_requests;
+
+/* requests yielded by plugins, resumed on next event loop tick */
+static ngx_queue_t ngx_http_adfront_yielded;
+static ngx_socket_t ngx_http_adfront_yield_fd = -1;
+
+/* fires every interval, how late it fires is how long the loop was blocked */
+#define ADFRONT_LOOP_LAG_INTERVAL   100
+
+static ngx_event_t ngx_http_adfront_loop_lag;
+static ngx_msec_t ngx_http_adfront_loop_lag_due;
+
+
+static void *ngx_http_adfront_create_main_conf(ngx_conf_t *cf) {
+    ngx_http_adfront_main_conf_t *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_adfront_main_conf_t));
+    if(conf == NULL) {
+        return NULL;
+    }
+
+    conf->batch_size = NGX_CONF_UNSET;
+    conf->offload_threads = NGX_CONF_UNSET;
+    conf->task_threads = NGX_CONF_UNSET;
+    conf->subrequest_limit = NGX_CONF_UNSET;
+    conf->adaptive_timeout = NGX_CONF_UNSET;
+    conf->adaptive_timeout_min = NGX_CONF_UNSET_MSEC;
+    conf->adaptive_timeout_max = NGX_CONF_UNSET_MSEC;
+    conf->slow_call = NGX_CONF_UNSET_MSEC;
+    conf->slow_call_backtrace = NGX_CONF_UNSET;
+    conf->perf_counters = NGX_CONF_UNSET;
+    conf->alloc_sites = NGX_CONF_UNSET;
+    conf->capture = NGX_CONF_UNSET_MSEC;
+    conf->capture_size = NGX_CONF_UNSET;
+    conf->trace_sample = NGX_CONF_UNSET;
+    conf->trace_debug = NGX_CONF_UNSET;
+    conf->log_level = NGX_CONF_UNSET_UINT;
+    conf->log_rotate_size = NGX_CONF_UNSET_SIZE;
+    conf->log_rotate_interval = NGX_CONF_UNSET;
+
+    return conf;
+}
+
+
+static char *ngx_http_adfront_init_main_conf(ngx_conf_t *cf, void *conf) {
+    ngx_http_adfront_main_conf_t *amcf = conf;
+
+    /* 0 or 1 means handle each request on its own */
+    ngx_conf_init_value(amcf->batch_size, 0);
+
+    /* only started if some plugin is configured with offload */
+    ngx_conf_init_value(amcf->offload_threads, 4);
+
+    /* 0 means offloaded plugins run their tasks inline */
+    ngx_conf_init_value(amcf->task_threads, 0);
+
+    /* 0 means subrequests are never dropped */
+    ngx_conf_init_value(amcf->subrequest_limit, 0);
+
+    /* off keeps the endpoint locations' own read timeouts */
+    ngx_conf_init_value(amcf->adaptive_timeout, 0);
+    ngx_conf_init_msec_value(amcf->adaptive_timeout_min, 20);
+    ngx_conf_init_msec_value(amcf->adaptive_timeout_max, 1000);
+
+    ngx_conf_init_msec_value(amcf->slow_call, 50);
+    ngx_conf_init_value(amcf->slow_call_backtrace, 0);
+    ngx_conf_init_value(amcf->perf_counters, 0);
+    ngx_conf_init_value(amcf->alloc_sites, 0);
+    ngx_conf_init_msec_value(amcf->capture, 0);
+    ngx_conf_init_value(amcf->capture_size, 64);
+    ngx_conf_init_value(amcf->trace_sample, 0);
+    ngx_conf_init_value(amcf->trace_debug, 0);
+    ngx_conf_init_uint_value(amcf->log_level, 1);
+    ngx_conf_init_size_value(amcf->log_rotate_size, 0);
+    ngx_conf_init_value(amcf->log_rotate_interval, 0);
+
+    if(amcf->batch_size < 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
+                "[adfront] plugin_manager_batch_size can't be negative");
+        return NGX_CONF_ERROR;
+    }
+
+    if(amcf->offload_threads < 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
+                "[adfront] plugin_manager_offload_threads can't be negative");
+        return NGX_CONF_ERROR;
+    }
+
+    if(amcf->task_threads < 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
+                "[adfront] plugin_manager_task_threads can't be negative");
+        return NGX_CONF_ERROR;
+    }
+
+    if(amcf->subrequest_limit < 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
+                "[adfront] plugin_manager_subrequest_limit can't be negative");
+        return NGX_CONF_ERROR;
+    }
+
+    if(amcf->adaptive_timeout_min == 0 
+            || amcf->adaptive_timeout_min > amcf->adaptive_timeout_max) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
+                "[adfront] plugin_manager_adaptive_timeout_min must be in "
+                "1..plugin_manager_adaptive_timeout_max");
+        return NGX_CONF_ERROR;
+    }
+
+    if(amcf->slow_call_backtrace < 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
+                "[adfront] plugin_manager_slow_call_backtrace can't be negative");
+        return NGX_CONF_ERROR;
+    }
+
+    if(amcf->slow_call_backtrace > 0 && amcf->slow_call == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
+                "[adfront] plugin_manager_slow_call_backtrace needs "
+                "plugin_manager_slow_call");
+        return NGX_CONF_ERROR;
+    }
+
+    if(amcf->perf_counters < 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
+                "[adfront] plugin_manager_perf_counters can't be negative");
+        return NGX_CONF_ERROR;
+    }
+
+    if(amcf->alloc_sites < 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
+                "[adfront] plugin_manager_alloc_sites can't be negative");
+        return NGX_CONF_ERROR;
+    }
+
+    if(amcf->capture_size < 1) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
+                "[adfront] plugin_manager_capture_size must be positive");
+        return NGX_CONF_ERROR;
+    }
+
+    if(amcf->trace_sample < 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
+                "[adfront] plugin_manager_trace_sample can't be negative");
+        return NGX_CONF_ERROR;
+    }
+
+    if(amcf->trace_file.len 
+            && ngx_conf_full_name(cf->cycle, &amcf->trace_file, 0) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if(amcf->log_file.len 
+            && ngx_conf_full_name(cf->cycle, &amcf->log_file, 0) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t ngx_http_adfront_add_variables(ngx_conf_t *cf) {
+    ngx_http_variable_t *var, *v;
+
+    for(v = ngx_http_adfront_vars; v->name.len; v++) {
+        var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if(var == NULL) {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+
+    return NGX_OK;
+}
+
+
+/* subrequests of plugins pass here before the content handler of their location */
+static ngx_int_t ngx_http_adfront_init(ngx_conf_t *cf) {
+    ngx_http_handler_pt *h;
+    ngx_http_core_main_conf_t *cmcf;
+
+    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+    h = ngx_array_push(&cmcf->phases[NGX_HTTP_PREACCESS_PHASE].handlers);
+    if(h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_http_adfront_subrequest_handler;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t ngx_http_adfront_subrequest_handler(ngx_http_request_t *r) {
+    if(r == r->main) {
+        return NGX_DECLINED;
+    }
+
+    return plugin_prepare_subrequest(r);
+}
+
 
 static void *ngx_http_adfront_create_loc_conf(ngx_conf_t *cf) {
     ngx_http_adfront_loc_conf_t *conf;
@@ -102,6 +637,8 @@ static char *ngx_http_adfront_merge_loc_conf(ngx_conf_t *cf,
 
 
 static ngx_int_t ngx_http_adfront_init_process(ngx_cycle_t *cycle) {
+    ngx_http_adfront_main_conf_t *amcf;
+
     ngx_log_error(NGX_LOG_DEBUG, cycle->log, 0, "[adfront] init process start");
    
     if(adfront_handle == NULL) {
@@ -109,16 +646,87 @@ static ngx_int_t ngx_http_adfront_init_process(ngx_cycle_t *cycle) {
         return NGX_ERROR;
     } 
 
+    amcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_adfront_module);
+
+    /* first, so what plugins log from InitProcess on is written by the thread */
+    if(amcf && plugin_init_log(&amcf->log_file, amcf->log_level, 
+                amcf->log_rotate_size, amcf->log_rotate_interval) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, cycle->log, 0, "[adfront] log init fail");
+        return NGX_ERROR;
+    }
+
     if(plugin_init_handler(adfront_handle) != NGX_OK) {
         ngx_log_error(NGX_LOG_ERR, cycle->log, 0, "[adfront] handle init fail");
         return NGX_ERROR;
     }
 
+    ngx_queue_init(&ngx_http_adfront_inflight_requests);
+
+    if(amcf && plugin_init_watchdog(adfront_handle, amcf->slow_call, 
+                amcf->slow_call_backtrace) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, cycle->log, 0, "[adfront] watchdog init fail");
+        return NGX_ERROR;
+    }
+
+    if(amcf && plugin_init_perf(adfront_handle, amcf->perf_counters) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, cycle->log, 0, "[adfront] perf counters init fail");
+        return NGX_ERROR;
+    }
+
+    if(amcf && plugin_init_alloc(amcf->alloc_sites) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if(amcf && plugin_init_capture(amcf->capture, amcf->capture_size) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if(amcf && plugin_init_trace(&amcf->trace_file, amcf->trace_sample, 
+                amcf->trace_debug) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, cycle->log, 0, "[adfront] trace init fail");
+        return NGX_ERROR;
+    }
+
+    ngx_http_adfront_loop_lag.handler = ngx_http_adfront_loop_lag_handler;
+    ngx_http_adfront_loop_lag.log = cycle->log;
+    ngx_http_adfront_loop_lag_due = ngx_current_msec + ADFRONT_LOOP_LAG_INTERVAL;
+    ngx_add_timer(&ngx_http_adfront_loop_lag, ADFRONT_LOOP_LAG_INTERVAL);
+
+    if(amcf && amcf->batch_size > 1) {
+        ngx_http_adfront_batch.requests = ngx_palloc(cycle->pool, 
+                2 * amcf->batch_size * sizeof(ngx_http_request_t *));
+        if(ngx_http_adfront_batch.requests == NULL) {
+            return NGX_ERROR;
+        }
+        ngx_http_adfront_batch.spare = ngx_http_adfront_batch.requests 
+            + amcf->batch_size;
+
+        ngx_http_adfront_batch.event.handler = ngx_http_adfront_batch_handler;
+        ngx_http_adfront_batch.event.data = &ngx_http_adfront_batch;
+        ngx_http_adfront_batch.event.log = cycle->log;
+    }
+
+    if(amcf && ngx_http_adfront_offload_init(cycle, amcf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if(ngx_http_adfront_yield_init(cycle) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
     ngx_log_error(NGX_LOG_DEBUG, cycle->log, 0, "[adfront] init process success");
     return NGX_OK;
 }
 
 
+/* write out the cpu profile, plugin spans and log lines still queued */
+static void ngx_http_adfront_exit_process(ngx_cycle_t *cycle) {
+    plugin_exit_profile();
+    plugin_exit_trace();
+    plugin_exit_log();
+}
+
+
 static char *ngx_http_adfront(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
     ngx_http_core_loc_conf_t *clcf;
 
@@ -131,7 +739,9 @@ static char *ngx_http_adfront(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
 
 static ngx_int_t ngx_http_adfront_handler(ngx_http_request_t *r) {
     ngx_int_t rc;
+    ngx_pool_cleanup_t *cln;
     ngx_http_adfront_ctx_t *ctx;
+    ngx_http_adfront_main_conf_t *amcf;
     
     ctx = ngx_http_get_module_ctx(r, ngx_http_adfront_module);    
     if(ctx == NULL) {
@@ -140,25 +750,56 @@ static ngx_int_t ngx_http_adfront_handler(ngx_http_request_t *r) {
             return NGX_ERROR;
         }
 
+        /* release plugin context even if the request is aborted halfway */
+        cln = ngx_pool_cleanup_add(r->pool, 0);
+        if(cln == NULL) {
+            return NGX_ERROR;
+        }
+        cln->handler = ngx_http_adfront_cleanup;
+        cln->data = r;
+
         /*
          * set by ngx_pcalloc():
          *
          *  ctx->subrequests = NULL;
          *  ctx->plugin_ctx = NULL;
+         *  ctx->yielded = 0;
+         *  ctx->state_usec = { 0 };
+         *  ctx->subrequest_rounds = 0;
+         *  ctx->subrequest_fanout = 0;
+         *  ctx->plugin = { 0, NULL };
+         *  ctx->traceparent = { 0, NULL };
+         *  ctx->traced = 0;
          */
 
         ngx_http_set_ctx(r, ctx, ngx_http_adfront_module);
 
+        ctx->request = r;
+        ngx_queue_insert_tail(&ngx_http_adfront_inflight_requests, 
+                &ctx->inflight_queue);
+
         ctx->state= ADFRONT_STATE_INIT;
         gettimeofday(&ctx->time_start, NULL);
+        ctx->state_start = (int64_t)ctx->time_start.tv_sec * 1000000 
+            + ctx->time_start.tv_usec;
+    }
+
+    /* woken by a subrequest given up earlier, wait for our tick */
+    if(ctx->yielded) {
+        r->main->count++;
+        return NGX_DONE;
     }
 
     if(ctx->state == ADFRONT_STATE_INIT) {
         rc = plugin_init_request(r);
 
         if(rc == NGX_OK) {              
-            /* GET or POST body read completely */
-            ctx->state = ADFRONT_STATE_PROCESS;
+            /* GET or POST body read completely, context build counts as parse */
+            rc = plugin_prepare_request(r);
+        }
+
+        if(rc == NGX_OK) {
+            ngx_http_adfront_set_state(ctx, ADFRONT_STATE_PROCESS);
         } else if(rc == NGX_AGAIN) {    
             /* 
              * POST body read incompletely
@@ -167,37 +808,87 @@ static ngx_int_t ngx_http_adfront_handler(ngx_http_request_t *r) {
              */
             return NGX_DONE;
         } else {
-            ctx->state = ADFRONT_STATE_ERROR;
+            ngx_http_adfront_set_state(ctx, ADFRONT_STATE_ERROR);
         }
     }
 
     if(ctx->state == ADFRONT_STATE_PROCESS) {
-        rc = plugin_process_request(adfront_handle, r);
+        amcf = ngx_http_get_module_main_conf(r, ngx_http_adfront_module);
+        rc = NGX_DECLINED;
+
+        if(amcf->batch_size > 1) {
+            rc = plugin_prepare_request(r);
+
+            /* offloaded plugins leave the event loop anyway */
+            if(rc == NGX_OK && !plugin_is_offload(adfront_handle, r)) {
+                rc = ngx_http_adfront_batch_add(r, amcf);
+            } else if(rc == NGX_OK) {
+                rc = NGX_DECLINED;
+            }
+        }
 
         if(rc == NGX_OK) {
-            ctx->state = ADFRONT_STATE_FINAL;
+            /* queued, plugin Handle is called by the batch flush */
+            ngx_http_adfront_set_state(ctx, ADFRONT_STATE_WAIT_BATCH);
+        } else if(rc == NGX_DECLINED) {
+            rc = plugin_process_request(adfront_handle, r);
+        }
+
+        if(ctx->state == ADFRONT_STATE_WAIT_BATCH) {
+            r->main->count++;
+            return NGX_DONE;
+        } else if(rc == NGX_BUSY) {
+            ngx_http_adfront_set_state(ctx, ADFRONT_STATE_WAIT_OFFLOAD);
+
+            r->main->count++;
+            return NGX_DONE;
+        } else if(rc == NGX_DECLINED) {
+            /* ctx->state = ADFRONT_STATE_PROCESS; */
+            return ngx_http_adfront_yield(r);
+        } else if(rc == NGX_OK) {
+            ngx_http_adfront_set_state(ctx, ADFRONT_STATE_FINAL);
         } else if(rc == NGX_AGAIN) {
-            ctx->state = ADFRONT_STATE_WAIT_SUBREQUEST;
+            /* local subrequests may have been done already, check below */
+            ngx_http_adfront_set_state(ctx, ADFRONT_STATE_WAIT_SUBREQUEST);
+        } else {
+            ngx_http_adfront_set_state(ctx, ADFRONT_STATE_ERROR);
+        }
+    }
 
+    if(ctx->state == ADFRONT_STATE_WAIT_BATCH 
+            || ctx->state == ADFRONT_STATE_WAIT_OFFLOAD) {
+        rc = ctx->plugin_rc;
+
+        if(rc == NGX_DONE) {
+            /* still queued or running on offload thread */
             r->main->count++;
             return NGX_DONE;
+        } else if(rc == NGX_DECLINED) {
+            /* yielded in batch, redo Handle next tick */
+            ngx_http_adfront_set_state(ctx, ADFRONT_STATE_PROCESS);
+            return ngx_http_adfront_yield(r);
+        } else if(rc == NGX_OK) {
+            ngx_http_adfront_set_state(ctx, ADFRONT_STATE_FINAL);
+        } else if(rc == NGX_AGAIN) {
+            /* local subrequests may have been done already, check below */
+            ngx_http_adfront_set_state(ctx, ADFRONT_STATE_WAIT_SUBREQUEST);
         } else {
-            ctx->state = ADFRONT_STATE_ERROR;
+            ngx_http_adfront_set_state(ctx, ADFRONT_STATE_ERROR);
         }
     }
 
     if(ctx->state == ADFRONT_STATE_WAIT_SUBREQUEST) {
-        rc = plugin_check_subrequest(r);
+        rc = plugin_check_subrequest(adfront_handle, r);
 
         if(rc == NGX_OK) {
-            ctx->state = ADFRONT_STATE_POST_SUBREQUEST;
+            ngx_http_adfront_set_state(ctx, ADFRONT_STATE_POST_SUBREQUEST);
         } else if(rc == NGX_AGAIN) {
             /* ctx->state = ADFRONT_STATE_WAIT_SUBREQUEST; */
             r->main->count++;
 
             return NGX_DONE;
         } else {
-            ctx->state = ADFRONT_STATE_ERROR;
+            ngx_http_adfront_set_state(ctx, ADFRONT_STATE_ERROR);
         }
     }
 
@@ -205,19 +896,29 @@ static ngx_int_t ngx_http_adfront_handler(ngx_http_request_t *r) {
         rc = plugin_post_subrequest(adfront_handle, r); 
 
         if(rc == NGX_OK) {
-            ctx->state = ADFRONT_STATE_FINAL;
-        } else if(rc == NGX_AGAIN) {
-            ctx->state = ADFRONT_STATE_WAIT_SUBREQUEST;
+            ngx_http_adfront_set_state(ctx, ADFRONT_STATE_FINAL);
+        } else if(rc == NGX_BUSY) {
+            ngx_http_adfront_set_state(ctx, ADFRONT_STATE_WAIT_OFFLOAD);
             r->main->count++;
 
             return NGX_DONE;
+        } else if(rc == NGX_DECLINED) {
+            /* ctx->state = ADFRONT_STATE_POST_SUBREQUEST; */
+            return ngx_http_adfront_yield(r);
+        } else if(rc == NGX_AGAIN) {
+            /* local subrequests may have been done already, check again */
+            ngx_http_adfront_set_state(ctx, ADFRONT_STATE_WAIT_SUBREQUEST);
+
+            return ngx_http_adfront_handler(r);
         } else {
-            ctx->state = ADFRONT_STATE_ERROR;
+            ngx_http_adfront_set_state(ctx, ADFRONT_STATE_ERROR);
         }
     }   
 
     if(ctx->state == ADFRONT_STATE_FINAL) {
-        ctx->state = ADFRONT_STATE_DONE; 
+        rc = plugin_final_request(r);
+
+        ngx_http_adfront_set_state(ctx, ADFRONT_STATE_DONE);
 
         gettimeofday(&ctx->time_end, NULL);
         int ts = ctx->time_end.tv_sec- ctx->time_start.tv_sec;
@@ -231,7 +932,7 @@ static ngx_int_t ngx_http_adfront_handler(ngx_http_request_t *r) {
         ngx_log_error(NGX_LOG_DEBUG, r->connection->log, 0, 
                 "[adfront] final request, time consume: %ds.%dms", ts, tms);
 
-        return plugin_final_request(r);
+        return rc;
     }
 
     if(ctx->state == ADFRONT_STATE_DONE) {
@@ -250,3 +951,1007 @@ static ngx_int_t ngx_http_adfront_handler(ngx_http_request_t *r) {
 
     return NGX_OK;
 }
+
+
+static void ngx_http_adfront_cleanup(void *data) {
+    ngx_http_request_t *r = data;
+    ngx_http_adfront_ctx_t *ctx;
+
+    ngx_http_adfront_batch_remove(r);
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_adfront_module);
+    if(ctx->yielded) {
+        ngx_queue_remove(&ctx->yield_queue);
+        ctx->yielded = 0;
+    }
+
+    ngx_queue_remove(&ctx->inflight_queue);
+
+    plugin_metrics_request(r);
+
+    /* no-op if the context has been destroyed already */
+    plugin_destroy_request(r);
+}
+
+
+/*
+ * @return
+ *      NGX_OK          request queued for the next batch flush
+ *      NGX_DECLINED    batch is full, handle the request alone
+ */
+static ngx_int_t ngx_http_adfront_batch_add(ngx_http_request_t *r, 
+        ngx_http_adfront_main_conf_t *amcf) {
+    ngx_http_adfront_ctx_t *ctx;
+    ngx_http_adfront_batch_t *batch = &ngx_http_adfront_batch;
+
+    if(batch->n == (ngx_uint_t)amcf->batch_size) {
+        return NGX_DECLINED;
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_adfront_module);
+    ctx->plugin_rc = NGX_DONE;
+
+    batch->requests[batch->n++] = r;
+
+    /* flush once the current event loop iteration is over */
+    if(batch->n == 1) {
+        ngx_post_event(&batch->event, &ngx_posted_events);
+    }
+
+    return NGX_OK;
+}
+
+
+static void ngx_http_adfront_batch_remove(ngx_http_request_t *r) {
+    ngx_uint_t i;
+    ngx_http_adfront_batch_t *batch = &ngx_http_adfront_batch;
+
+    for(i = 0; i < batch->n; i++) {
+        if(batch->requests[i] == r) {
+            batch->requests[i] = NULL;
+        }
+    }
+
+    for(i = 0; i < batch->nflushing; i++) {
+        if(batch->flushing[i] == r) {
+            batch->flushing[i] = NULL;
+        }
+    }
+}
+
+
+static void ngx_http_adfront_batch_handler(ngx_event_t *ev) {
+    ngx_uint_t i, n;
+    ngx_connection_t *c;
+    ngx_http_request_t *r, **requests;
+    ngx_http_adfront_batch_t *batch = ev->data;
+
+    requests = batch->requests;
+
+    /* skip requests finalized while queued */
+    for(i = 0, n = 0; i < batch->n; i++) {
+        if(requests[i] != NULL) {
+            requests[n++] = requests[i];
+        }
+    }
+
+    batch->requests = batch->spare;
+    batch->n = 0;
+    batch->flushing = requests;
+    batch->nflushing = n;
+
+    if(n > 0) {
+        plugin_process_batch(adfront_handle, requests, n);
+    }
+
+    for(i = 0; i < n; i++) {
+        r = requests[i];
+        if(r == NULL) {
+            continue;
+        }
+
+        c = r->connection;
+
+        ngx_http_finalize_request(r, r->content_handler(r));
+        ngx_http_run_posted_requests(c);
+    }
+
+    batch->spare = requests;
+    batch->flushing = NULL;
+    batch->nflushing = 0;
+}
+
+
+static ngx_int_t ngx_http_adfront_offload_init(ngx_cycle_t *cycle, 
+        ngx_http_adfront_main_conf_t *amcf) {
+    ngx_int_t rc;
+    ngx_socket_t fd;
+    ngx_connection_t *c;
+
+    rc = plugin_init_offload(adfront_handle, amcf->offload_threads, 
+            amcf->task_threads, &fd);
+    if(rc == NGX_DECLINED) {
+        return NGX_OK;
+    } else if(rc != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, cycle->log, 0, "[adfront] offload init fail");
+        return NGX_ERROR;
+    }
+
+    /* offload threads signal finished tasks through the eventfd */
+    c = ngx_get_connection(fd, cycle->log);
+    if(c == NULL) {
+        return NGX_ERROR;
+    }
+
+    c->read->handler = ngx_http_adfront_offload_handler;
+    c->read->log = cycle->log;
+
+    if(ngx_add_event(c->read, NGX_READ_EVENT, 0) != NGX_OK) {
+        ngx_free_connection(c);
+        return NGX_ERROR;
+    }
+
+    ngx_log_error(NGX_LOG_DEBUG, cycle->log, 0, 
+            "[adfront] offload %i threads started", amcf->offload_threads);
+
+    return NGX_OK;
+}
+
+
+static void ngx_http_adfront_offload_handler(ngx_event_t *ev) {
+    ngx_connection_t *c;
+    ngx_http_request_t *r;
+
+    while((r = plugin_offload_next(adfront_handle)) != NULL) {
+        c = r->connection;
+
+        ngx_http_finalize_request(r, r->content_handler(r));
+        ngx_http_run_posted_requests(c);
+    }
+}
+
+
+/*
+ * A posted event doesn't give up the event loop: ngx_event_process_posted()
+ * keeps running events posted meanwhile. An eventfd written on yield makes
+ * the next epoll_wait() return at once together with other ready sockets.
+ */
+static ngx_int_t ngx_http_adfront_yield_init(ngx_cycle_t *cycle) {
+    ngx_connection_t *c;
+
+    ngx_queue_init(&ngx_http_adfront_yielded);
+
+    ngx_http_adfront_yield_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(ngx_http_adfront_yield_fd == -1) {
+        ngx_log_error(NGX_LOG_ERR, cycle->log, ngx_errno, 
+                "[adfront] yield eventfd fail");
+        return NGX_ERROR;
+    }
+
+    c = ngx_get_connection(ngx_http_adfront_yield_fd, cycle->log);
+    if(c == NULL) {
+        return NGX_ERROR;
+    }
+
+    c->read->handler = ngx_http_adfront_yield_handler;
+    c->read->log = cycle->log;
+
+    if(ngx_add_event(c->read, NGX_READ_EVENT, 0) != NGX_OK) {
+        ngx_free_connection(c);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+/* ngx_current_msec is taken when the loop wakes up, no clock read here */
+static void ngx_http_adfront_loop_lag_handler(ngx_event_t *ev) {
+    ngx_msec_int_t lag;
+    ngx_http_adfront_main_conf_t *amcf;
+
+    lag = (ngx_msec_int_t) (ngx_current_msec - ngx_http_adfront_loop_lag_due);
+    plugin_loop_lag(lag > 0 ? (ngx_msec_t) lag : 0);
+
+    /* profiling and capture dumps reach all workers through the metrics zone */
+    amcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_adfront_module);
+    if(amcf && amcf->profile_dir.len) {
+        plugin_profile_tick(&amcf->profile_dir);
+    }
+
+    if(amcf && amcf->capture_dir.len) {
+        plugin_capture_tick(&amcf->capture_dir);
+    }
+
+    plugin_log_tick();
+
+    /* a pending timer keeps a gracefully exiting worker alive */
+    if(ngx_exiting) {
+        return;
+    }
+
+    ngx_http_adfront_loop_lag_due = ngx_current_msec + ADFRONT_LOOP_LAG_INTERVAL;
+    ngx_add_timer(ev, ADFRONT_LOOP_LAG_INTERVAL);
+}
+
+
+/* park the request until next event loop tick, ctx->state is the phase to redo */
+static ngx_int_t ngx_http_adfront_yield(ngx_http_request_t *r) {
+    uint64_t one = 1;
+    ngx_http_adfront_ctx_t *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_adfront_module);
+
+    if(ngx_queue_empty(&ngx_http_adfront_yielded)) {
+        if(write(ngx_http_adfront_yield_fd, &one, sizeof(one)) == -1) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, ngx_errno, 
+                    "[adfront] yield write fail");
+
+            ngx_http_adfront_set_state(ctx, ADFRONT_STATE_ERROR);
+            plugin_destroy_request(r);
+            return NGX_ERROR;
+        }
+    }
+
+    ngx_queue_insert_tail(&ngx_http_adfront_yielded, &ctx->yield_queue);
+    ctx->yielded = 1;
+
+    r->main->count++;
+    return NGX_DONE;
+}
+
+
+static void ngx_http_adfront_yield_handler(ngx_event_t *ev) {
+    uint64_t n;
+    ngx_queue_t queue, *q;
+    ngx_connection_t *c;
+    ngx_http_request_t *r;
+    ngx_http_adfront_ctx_t *ctx;
+
+    if(read(ngx_http_adfront_yield_fd, &n, sizeof(n)) == -1 
+            && ngx_errno != NGX_EAGAIN) {
+        ngx_log_error(NGX_LOG_ERR, ev->log, ngx_errno, "[adfront] yield read fail");
+    }
+
+    if(ngx_queue_empty(&ngx_http_adfront_yielded)) {
+        return;
+    }
+
+    /* requests yielding again wait for the next tick */
+    ngx_queue_init(&queue);
+    ngx_queue_add(&queue, &ngx_http_adfront_yielded);
+    ngx_queue_init(&ngx_http_adfront_yielded);
+
+    while(!ngx_queue_empty(&queue)) {
+        q = ngx_queue_head(&queue);
+        ngx_queue_remove(q);
+
+        ctx = ngx_queue_data(q, ngx_http_adfront_ctx_t, yield_queue);
+        ctx->yielded = 0;
+
+        r = ctx->request;
+        c = r->connection;
+
+        ngx_http_finalize_request(r, r->content_handler(r));
+        ngx_http_run_posted_requests(c);
+    }
+}
+
+
+static ngx_int_t ngx_http_adfront_offload_wait_variable(ngx_http_request_t *r,
+        ngx_http_variable_value_t *v, uintptr_t data) {
+    u_char *p;
+    ngx_http_adfront_ctx_t *ctx;
+
+    ctx = ngx_http_get_module_ctx(r->main, ngx_http_adfront_module);
+    if(ctx == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(r->pool, NGX_TIME_T_LEN + 4);
+    if(p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "%T.%03M", 
+            (time_t) ctx->offload_wait / 1000, ctx->offload_wait % 1000) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t ngx_http_adfront_offload_queue_variable(ngx_http_request_t *r,
+        ngx_http_variable_value_t *v, uintptr_t data) {
+    u_char *p;
+
+    if(adfront_handle == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(r->pool, NGX_INT_T_LEN);
+    if(p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "%ui", plugin_offload_queue(adfront_handle)) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+
+/* "done/failed" detached subrequests of this worker */
+static ngx_int_t ngx_http_adfront_detached_variable(ngx_http_request_t *r,
+        ngx_http_variable_value_t *v, uintptr_t data) {
+    u_char *p;
+    ngx_uint_t done, failed;
+
+    p = ngx_pnalloc(r->pool, NGX_INT_T_LEN * 2 + 1);
+    if(p == NULL) {
+        return NGX_ERROR;
+    }
+
+    plugin_detached_stats(&done, &failed);
+
+    v->len = ngx_sprintf(p, "%ui/%ui", done, failed) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+
+/*
+ * Sum of the time spent in the states of data, a mask of them, in seconds
+ * like $request_time. Taken from the state transitions, no clock read here.
+ */
+static ngx_int_t ngx_http_adfront_state_time_variable(ngx_http_request_t *r,
+        ngx_http_variable_value_t *v, uintptr_t data) {
+    u_char *p;
+    int64_t usec;
+    ngx_uint_t i;
+    ngx_msec_t ms;
+    ngx_http_adfront_ctx_t *ctx;
+
+    ctx = ngx_http_get_module_ctx(r->main, ngx_http_adfront_module);
+    if(ctx == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    usec = 0;
+    for(i = 0; i < ADFRONT_STATE_COUNT; i++) {
+        if(data & ADFRONT_STATE_MASK(i)) {
+            usec += ctx->state_usec[i];
+        }
+    }
+
+    p = ngx_pnalloc(r->pool, NGX_TIME_T_LEN + 4);
+    if(p == NULL) {
+        return NGX_ERROR;
+    }
+
+    ms = (ngx_msec_t) (usec / 1000);
+
+    v->len = ngx_sprintf(p, "%T.%03M", (time_t) ms / 1000, ms % 1000) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t ngx_http_adfront_rounds_variable(ngx_http_request_t *r,
+        ngx_http_variable_value_t *v, uintptr_t data) {
+    u_char *p;
+    ngx_http_adfront_ctx_t *ctx;
+
+    ctx = ngx_http_get_module_ctx(r->main, ngx_http_adfront_module);
+    if(ctx == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(r->pool, NGX_INT_T_LEN);
+    if(p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "%ui", ctx->subrequest_rounds) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t ngx_http_adfront_plugin_variable(ngx_http_request_t *r,
+        ngx_http_variable_value_t *v, uintptr_t data) {
+    ngx_http_adfront_ctx_t *ctx;
+
+    ctx = ngx_http_get_module_ctx(r->main, ngx_http_adfront_module);
+    if(ctx == NULL || ctx->plugin.len == 0) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    v->len = ctx->plugin.len;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = ctx->plugin.data;
+
+    return NGX_OK;
+}
+
+
+/* for proxy_set_header traceparent in the locations of subrequests */
+static ngx_int_t ngx_http_adfront_traceparent_variable(ngx_http_request_t *r,
+        ngx_http_variable_value_t *v, uintptr_t data) {
+    ngx_str_t traceparent;
+
+    if(plugin_traceparent(r, &traceparent) != NGX_OK) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    v->len = traceparent.len;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = traceparent.data;
+
+    return NGX_OK;
+}
+
+
+/* not found unless the subrequest has a timeout of its own */
+static ngx_int_t ngx_http_adfront_timeout_variable(ngx_http_request_t *r,
+        ngx_http_variable_value_t *v, uintptr_t data) {
+    u_char *p;
+    ngx_msec_t timeout[2];
+
+    if(plugin_subrequest_timeouts(r, &timeout[0], &timeout[1]) != NGX_OK
+            || timeout[data] == 0) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(r->pool, NGX_INT_T_LEN);
+    if(p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "%M", timeout[data]) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+
+/*--------------------------------- metrics ----------------------------------*/
+
+static char *ngx_http_adfront_metrics_zone(ngx_conf_t *cf, ngx_command_t *cmd, 
+        void *conf) {
+    ssize_t size;
+    ngx_str_t *value;
+    ngx_http_adfront_main_conf_t *amcf = conf;
+    static ngx_str_t name = ngx_string("adfront_metrics");
+
+    if(amcf->metrics_zone) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    size = ngx_parse_size(&value[1]);
+    if(size == NGX_ERROR || size < (ssize_t) (64 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
+                "[adfront] invalid metrics zone size \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    amcf->metrics_zone = ngx_shared_memory_add(cf, &name, size, 
+            &ngx_http_adfront_module);
+    if(amcf->metrics_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    amcf->metrics_zone->init = ngx_http_adfront_metrics_init_zone;
+
+    return NGX_CONF_OK;
+}
+
+
+/*
+ * Called in the master, workers inherit the mapping. The metrics region
+ * takes all pages of the slab pool, on reload it's kept with its values.
+ */
+static ngx_int_t ngx_http_adfront_metrics_init_zone(ngx_shm_zone_t *shm_zone, 
+        void *data) {
+    size_t len;
+    ngx_slab_pool_t *shpool;
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    len = (shpool->end - shpool->start) - ngx_pagesize;
+
+    if(data) {
+        shm_zone->data = data;
+        return plugin_init_metrics(data, len);
+    }
+
+    shm_zone->data = ngx_slab_alloc(shpool, len);
+    if(shm_zone->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    shpool->data = shm_zone->data;
+
+    return plugin_init_metrics(shm_zone->data, len);
+}
+
+
+static char *ngx_http_adfront_status(ngx_conf_t *cf, ngx_command_t *cmd, 
+        void *conf) {
+    ngx_http_core_loc_conf_t *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module); 
+    clcf->handler = ngx_http_adfront_status_handler; 
+
+    return NGX_CONF_OK;
+}
+
+
+/* 
+ * metrics in Prometheus text, or JSON with ?format=json, ?format=alloc_sites
+ * for allocation call sites
+ */
+static ngx_int_t ngx_http_adfront_status_handler(ngx_http_request_t *r) {
+    ngx_int_t rc;
+    ngx_buf_t *b;
+    ngx_str_t format;
+    ngx_uint_t json;
+    ngx_chain_t out;
+
+    if(!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+    if(rc != NGX_OK) {
+        return rc;
+    }
+
+    ngx_str_null(&format);
+
+    json = ngx_http_arg(r, (u_char *) "format", 6, &format) == NGX_OK
+        && format.len == 4 && ngx_strncmp(format.data, "json", 4) == 0;
+
+    /* ?format=alloc_sites, allocation call sites of the worker serving it */
+    if(format.len == 11 && ngx_strncmp(format.data, "alloc_sites", 11) == 0) {
+        b = plugin_alloc_sites(r);
+    } else {
+        b = plugin_metrics_status(r, json);
+    }
+    if(b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    if(json) {
+        ngx_str_set(&r->headers_out.content_type, "application/json");
+    } else {
+        ngx_str_set(&r->headers_out.content_type, "text/plain; version=0.0.4");
+    }
+
+    rc = ngx_http_send_header(r);
+    if(rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+/*--------------------------------- profiler ---------------------------------*/
+
+static char *ngx_http_adfront_profile(ngx_conf_t *cf, ngx_command_t *cmd, 
+        void *conf) {
+    ngx_str_t *value;
+    ngx_http_core_loc_conf_t *clcf;
+    ngx_http_adfront_main_conf_t *amcf;
+
+    amcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_adfront_module);
+    if(amcf->profile_dir.len) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+    amcf->profile_dir = value[1];
+
+    if(ngx_conf_full_name(cf->cycle, &amcf->profile_dir, 0) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module); 
+    clcf->handler = ngx_http_adfront_profile_handler; 
+
+    return NGX_CONF_OK;
+}
+
+
+/*
+ * ?seconds=30&hz=100 profiles every worker that long, ?seconds=0 stops it.
+ * Workers pick it up within ADFRONT_LOOP_LAG_INTERVAL.
+ */
+static ngx_int_t ngx_http_adfront_profile_handler(ngx_http_request_t *r) {
+    ngx_int_t rc, seconds, hz;
+    ngx_buf_t *b;
+    ngx_str_t arg;
+    ngx_chain_t out;
+    ngx_http_adfront_main_conf_t *amcf;
+
+    if(!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+    if(rc != NGX_OK) {
+        return rc;
+    }
+
+    seconds = 30;
+    if(ngx_http_arg(r, (u_char *) "seconds", 7, &arg) == NGX_OK) {
+        seconds = ngx_atoi(arg.data, arg.len);
+    }
+
+    hz = 100;
+    if(ngx_http_arg(r, (u_char *) "hz", 2, &arg) == NGX_OK) {
+        hz = ngx_atoi(arg.data, arg.len);
+    }
+
+    if(seconds < 0 || seconds > 3600 || hz < 1 || hz > 1000) {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    plugin_profile_request(seconds, hz);
+
+    amcf = ngx_http_get_module_main_conf(r, ngx_http_adfront_module);
+
+    b = ngx_create_temp_buf(r->pool, amcf->profile_dir.len + 128);
+    if(b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if(seconds) {
+        b->last = ngx_sprintf(b->pos, "profiling for %is at %iHz, "
+                "profiles go to %V/adfront.<pid>.<time>.*\n", 
+                seconds, hz, &amcf->profile_dir);
+    } else {
+        b->last = ngx_sprintf(b->pos, "profiling stopped\n");
+    }
+    b->last_buf = 1;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+
+    rc = ngx_http_send_header(r);
+    if(rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+/*--------------------------------- capture ----------------------------------*/
+
+static char *ngx_http_adfront_capture(ngx_conf_t *cf, ngx_command_t *cmd, 
+        void *conf) {
+    ngx_str_t *value;
+    ngx_http_core_loc_conf_t *clcf;
+    ngx_http_adfront_main_conf_t *amcf;
+
+    amcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_adfront_module);
+    if(amcf->capture_dir.len) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+    amcf->capture_dir = value[1];
+
+    if(ngx_conf_full_name(cf->cycle, &amcf->capture_dir, 0) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module); 
+    clcf->handler = ngx_http_adfront_capture_handler; 
+
+    return NGX_CONF_OK;
+}
+
+
+/*
+ * Every worker writes its capture ring into the directory, within
+ * ADFRONT_LOOP_LAG_INTERVAL; test/plugin_replay replays the files.
+ */
+static ngx_int_t ngx_http_adfront_capture_handler(ngx_http_request_t *r) {
+    ngx_int_t rc;
+    ngx_buf_t *b;
+    ngx_chain_t out;
+    ngx_http_adfront_main_conf_t *amcf;
+
+    if(!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+    if(rc != NGX_OK) {
+        return rc;
+    }
+
+    amcf = ngx_http_get_module_main_conf(r, ngx_http_adfront_module);
+
+    b = ngx_create_temp_buf(r->pool, amcf->capture_dir.len + 128);
+    if(b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if(amcf->capture) {
+        plugin_capture_request();
+
+        b->last = ngx_sprintf(b->pos, "capture rings go to "
+                "%V/adfront.<pid>.<time>.capture\n", &amcf->capture_dir);
+    } else {
+        b->last = ngx_sprintf(b->pos, "plugin_manager_capture is off\n");
+    }
+    b->last_buf = 1;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+
+    rc = ngx_http_send_header(r);
+    if(rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+/*-------------------------------- in flight ---------------------------------*/
+
+/* args of requests and subrequests are cut at this in the dump */
+#define ADFRONT_INFLIGHT_ARGS_LEN   256
+
+static char *ngx_http_adfront_inflight(ngx_conf_t *cf, ngx_command_t *cmd, 
+        void *conf) {
+    ngx_http_core_loc_conf_t *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module); 
+    clcf->handler = ngx_http_adfront_inflight_handler; 
+
+    return NGX_CONF_OK;
+}
+
+
+/*
+ * Live requests of the worker serving it, oldest first: age and time in the
+ * current state in msec, subrequest rounds and fan-out so far, the plugin,
+ * then one line per subrequest still pending, with the peer it's on once
+ * connected. ?min_age=<msec> leaves younger requests out.
+ */
+static ngx_int_t ngx_http_adfront_inflight_handler(ngx_http_request_t *r) {
+    size_t len;
+    int64_t now, age;
+    ngx_int_t rc, min_age;
+    ngx_buf_t *b;
+    ngx_str_t arg;
+    ngx_uint_t n;
+    ngx_queue_t *q;
+    ngx_chain_t out;
+    struct timeval tv;
+    ngx_http_request_t *req;
+    ngx_http_adfront_ctx_t *ctx;
+
+    if(!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+    if(rc != NGX_OK) {
+        return rc;
+    }
+
+    min_age = 0;
+    if(ngx_http_arg(r, (u_char *) "min_age", 7, &arg) == NGX_OK) {
+        min_age = ngx_atoi(arg.data, arg.len);
+        if(min_age == NGX_ERROR) {
+            return NGX_HTTP_BAD_REQUEST;
+        }
+    }
+
+    gettimeofday(&tv, NULL);
+    now = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+
+    len = 128;
+    n = 0;
+
+    for(q = ngx_queue_head(&ngx_http_adfront_inflight_requests);
+        q != ngx_queue_sentinel(&ngx_http_adfront_inflight_requests);
+        q = ngx_queue_next(q))
+    {
+        ctx = ngx_queue_data(q, ngx_http_adfront_ctx_t, inflight_queue);
+        req = ctx->request;
+
+        age = now - ((int64_t)ctx->time_start.tv_sec * 1000000 
+                + ctx->time_start.tv_usec);
+        if(age / 1000 < min_age) {
+            continue;
+        }
+
+        n++;
+        len += 128 + NGX_PTR_SIZE * 2 + ctx->plugin.len + req->uri.len 
+            + ngx_min(req->args.len, ADFRONT_INFLIGHT_ARGS_LEN);
+
+        if(ctx->subrequests) {
+            len += ngx_http_adfront_inflight_len(ctx->subrequests);
+        }
+    }
+
+    b = ngx_create_temp_buf(r->pool, len);
+    if(b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->last = ngx_sprintf(b->last, "# worker %P, %ui requests, age and time "
+            "in state in msec\n", ngx_pid, n);
+
+    for(q = ngx_queue_head(&ngx_http_adfront_inflight_requests);
+        q != ngx_queue_sentinel(&ngx_http_adfront_inflight_requests);
+        q = ngx_queue_next(q))
+    {
+        ctx = ngx_queue_data(q, ngx_http_adfront_ctx_t, inflight_queue);
+        req = ctx->request;
+
+        age = now - ((int64_t)ctx->time_start.tv_sec * 1000000 
+                + ctx->time_start.tv_usec);
+        if(age / 1000 < min_age) {
+            continue;
+        }
+
+        b->last = ngx_sprintf(b->last, "%p %L %L %s rounds=%ui fanout=%ui "
+                "plugin=%V %V", req, age / 1000, (now - ctx->state_start) / 1000, 
+                ngx_http_adfront_state_names[ctx->state], 
+                ctx->subrequest_rounds, ctx->subrequest_fanout, 
+                &ctx->plugin, &req->uri);
+
+        if(req->args.len) {
+            b->last = ngx_sprintf(b->last, "?%*s", 
+                    ngx_min(req->args.len, ADFRONT_INFLIGHT_ARGS_LEN), 
+                    req->args.data);
+        }
+
+        *b->last++ = LF;
+
+        if(ctx->subrequests) {
+            b->last = ngx_http_adfront_inflight_pending(b->last, ctx->subrequests);
+        }
+    }
+
+    b->last_buf = 1;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+
+    rc = ngx_http_send_header(r);
+    if(rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+/* room for the pending subrequests, local calls' ones included */
+static size_t ngx_http_adfront_inflight_len(ngx_array_t *subrequests) {
+    size_t len;
+    ngx_uint_t i;
+    subrequest_t *st;
+    ngx_http_upstream_t *u;
+
+    len = 0;
+    st = subrequests->elts;
+
+    for(i = 0; i < subrequests->nelts; i++) {
+        if(st[i].children) {
+            len += ngx_http_adfront_inflight_len(st[i].children);
+        }
+
+        if(st[i].subr == NULL || st[i].finished) {
+            continue;
+        }
+
+        len += 64 + st[i].uri.len 
+            + ngx_min(st[i].args.len, ADFRONT_INFLIGHT_ARGS_LEN);
+
+        u = st[i].subr->upstream;
+        if(u && u->peer.name) {
+            len += u->peer.name->len;
+        }
+    }
+
+    return len;
+}
+
+
+static u_char *ngx_http_adfront_inflight_pending(u_char *p, 
+        ngx_array_t *subrequests) {
+    ngx_uint_t i;
+    subrequest_t *st;
+    ngx_http_upstream_t *u;
+
+    st = subrequests->elts;
+
+    for(i = 0; i < subrequests->nelts; i++) {
+        if(st[i].children) {
+            p = ngx_http_adfront_inflight_pending(p, st[i].children);
+        }
+
+        if(st[i].subr == NULL || st[i].finished) {
+            continue;
+        }
+
+        p = ngx_sprintf(p, "    pending %V", &st[i].uri);
+
+        if(st[i].args.len) {
+            p = ngx_sprintf(p, "?%*s", 
+                    ngx_min(st[i].args.len, ADFRONT_INFLIGHT_ARGS_LEN), 
+                    st[i].args.data);
+        }
+
+        u = st[i].subr->upstream;
+        if(u && u->peer.name) {
+            p = ngx_sprintf(p, " peer=%V", u->peer.name);
+        }
+
+        *p++ = LF;
+    }
+
+    return p;
+}
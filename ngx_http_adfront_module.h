@@ -6,9 +6,13 @@
 #include <ngx_http.h>
 #include <sys/time.h>
 
+#include "ngx_http_adfront_probes.h"
+
 typedef enum {
     ADFRONT_STATE_INIT,
     ADFRONT_STATE_PROCESS,
+    ADFRONT_STATE_WAIT_BATCH,
+    ADFRONT_STATE_WAIT_OFFLOAD,
     ADFRONT_STATE_WAIT_SUBREQUEST,
     ADFRONT_STATE_POST_SUBREQUEST,
     ADFRONT_STATE_FINAL,
@@ -16,15 +20,61 @@ typedef enum {
     ADFRONT_STATE_ERROR
 } adfront_state_t;
 
+#define ADFRONT_STATE_COUNT     (ADFRONT_STATE_ERROR + 1)
+#define ADFRONT_STATE_MASK(s)   (1 << (s))
+
 
 typedef struct {
-    //ngx_int_t           done
+    ngx_uint_t          finished;   /* response collected or skipped */
     ngx_str_t           uri;
     ngx_str_t           args;
     ngx_http_request_t  *subr;   
+
+    void                *local;     /* child PluginContext of local call */
+    ngx_array_t         *children;  /* subrequests of the local call */
 } subrequest_t;
 
 
+typedef struct {
+    ngx_int_t   batch_size;
+    ngx_int_t   offload_threads;
+    ngx_int_t   task_threads;
+    ngx_int_t   subrequest_limit;   /* in flight per worker, 0 is unlimited */
+
+    /* endpoint read timeouts follow their observed latency, in msec */
+    ngx_flag_t  adaptive_timeout;
+    ngx_msec_t  adaptive_timeout_min;
+    ngx_msec_t  adaptive_timeout_max;
+
+    ngx_shm_zone_t  *metrics_zone;  /* NULL keeps metrics per worker */
+
+    /* plugin calls blocking the event loop this long are logged, 0 is off */
+    ngx_msec_t  slow_call;
+    ngx_int_t   slow_call_backtrace;    /* one call in n, 0 is never */
+
+    ngx_int_t   perf_counters;          /* read around one call in n, 0 is off */
+    ngx_int_t   alloc_sites;            /* record one allocation in n, 0 is off */
+
+    /* requests taking this long go to the capture ring, 0 is off */
+    ngx_msec_t  capture;
+    ngx_int_t   capture_size;           /* requests kept per worker */
+    ngx_str_t   capture_dir;            /* set by adfront_capture */
+
+    /* sampled traces go to trace_file, is_trace=1 asks for one if debug */
+    ngx_str_t   trace_file;
+    ngx_int_t   trace_sample;           /* one request in n, 0 is parent's call */
+    ngx_flag_t  trace_debug;
+
+    /* plugin log lines go to log_file from a thread, stderr without it */
+    ngx_str_t   log_file;
+    ngx_uint_t  log_level;              /* sharelib LOG_LEVEL_* */
+    size_t      log_rotate_size;        /* 0 is never */
+    time_t      log_rotate_interval;    /* 0 is never */
+
+    ngx_str_t   profile_dir;            /* set by adfront_profile */
+} ngx_http_adfront_main_conf_t;
+
+
 typedef struct {
     ngx_str_t   plugin_manager_config_file; 
 } ngx_http_adfront_loc_conf_t;
@@ -35,11 +85,55 @@ typedef struct {
     struct timeval      time_end;
     adfront_state_t     state;
     ngx_array_t         *subrequests;
+
+    /* usec spent in each state, subrequest rounds and fan-out, for metrics */
+    int64_t             state_start;
+    int64_t             state_usec[ADFRONT_STATE_COUNT];
+    ngx_uint_t          subrequest_rounds;
+    ngx_uint_t          subrequest_fanout;
+
+    ngx_str_t           plugin;         /* __plugin_name__, kept for the log */
+    ngx_str_t           traceparent;    /* of the request's span */
     
     void                *plugin_ctx;
+    ngx_int_t           plugin_rc;      /* batch result, NGX_DONE if queued */
+
+    void                *capture;       /* CapturedRequest being recorded */
+
+    void                *offload;       /* in-flight offload task */
+    ngx_msec_t          offload_wait;   /* time queued for offload threads */
+
+    ngx_http_request_t  *request;
+    ngx_queue_t         inflight_queue; /* link in live requests of the worker */
+    ngx_queue_t         yield_queue;    /* link in yielded requests */
+    unsigned            yielded:1;
+    unsigned            traced:1;       /* spans exported */
     //ngx_buf_t           *plugin_res;
 } ngx_http_adfront_ctx_t;
 
 extern ngx_module_t  ngx_http_adfront_module;
 
+/* plugin manager handle (Handler *) */
+extern void *adfront_handle;
+
+/* by adfront_state_t, for metrics labels and the in-flight dump */
+extern const char *ngx_http_adfront_state_names[ADFRONT_STATE_COUNT];
+
+
+/* leave the current state, the time spent in it adds up for the metrics */
+static ngx_inline void ngx_http_adfront_set_state(ngx_http_adfront_ctx_t *ctx, 
+        adfront_state_t state) {
+    struct timeval tv;
+    int64_t now;
+
+    gettimeofday(&tv, NULL);
+    now = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+
+    ADFRONT_PROBE4(state, ctx->request, ctx->state, state, now - ctx->state_start);
+
+    ctx->state_usec[ctx->state] += now - ctx->state_start;
+    ctx->state_start = now;
+    ctx->state = state;
+}
+
 #endif
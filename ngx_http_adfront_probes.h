@@ -0,0 +1,44 @@
+#ifndef __NGX_HTTP_ADFRONT_PROBES_H__
+#define __NGX_HTTP_ADFRONT_PROBES_H__
+
+/*
+ * USDT probes of the adfront provider, for bpftrace, perf or systemtap on a
+ * running nginx, see the scripts in tools. They're nops until traced. config
+ * sets NGX_HAVE_SDT if sys/sdt.h (systemtap-sdt-devel) is there, without it
+ * they compile to nothing.
+ *
+ *  request__start(r, plugin_ctx, plugin, plugin_len)   plugin context built
+ *  state(r, from, to, usec)                            usec spent in from
+ *  plugin__entry(plugin_ctx, plugin, phase)            0 Handle, 1 PostSubHandle
+ *  plugin__return(plugin_ctx, plugin, phase, rc, usec)
+ *  plugin__batch__entry(plugin_ctx, plugin, n)         context of the first
+ *  plugin__batch__return(plugin_ctx, plugin, n, usec)
+ *  subrequest__start(r, sr, uri, uri_len, args_len)
+ *  subrequest__done(r, sr, status, bytes, usec)        detached ones too
+ *
+ * Plugin calls may run on offload threads and know their PluginContext
+ * only, request__start maps it to the request.
+ */
+
+#include <ngx_config.h>
+
+#if (NGX_HAVE_SDT)
+
+#include <sys/sdt.h>
+
+#define ADFRONT_PROBE3(name, a1, a2, a3)                                      \
+    DTRACE_PROBE3(adfront, name, a1, a2, a3)
+#define ADFRONT_PROBE4(name, a1, a2, a3, a4)                                  \
+    DTRACE_PROBE4(adfront, name, a1, a2, a3, a4)
+#define ADFRONT_PROBE5(name, a1, a2, a3, a4, a5)                              \
+    DTRACE_PROBE5(adfront, name, a1, a2, a3, a4, a5)
+
+#else
+
+#define ADFRONT_PROBE3(name, a1, a2, a3)
+#define ADFRONT_PROBE4(name, a1, a2, a3, a4)
+#define ADFRONT_PROBE5(name, a1, a2, a3, a4, a5)
+
+#endif
+
+#endif
@@ -0,0 +1,73 @@
+
+/*
+ * malloc interposer, only linked with "make ALLOC_HOOK=1". nginx links
+ * libplugin_manager.so ahead of libc, so these take over the allocations of
+ * the whole process, plugins included, and pass them on to glibc. free is
+ * left alone, nothing is counted there.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+
+#include "alloc_tracker.h"
+
+extern "C" {
+
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+
+/* tells AllocTracker the hook is in */
+int sharelib_alloc_hook_linked = 1;
+
+
+void* malloc(size_t size) {
+    void* p = __libc_malloc(size);
+    sharelib::AllocTracker::Count(size);
+    return p;
+}
+
+
+void* calloc(size_t n, size_t size) {
+    void* p = __libc_calloc(n, size);
+    sharelib::AllocTracker::Count(n * size);
+    return p;
+}
+
+
+void* realloc(void* ptr, size_t size) {
+    void* p = __libc_realloc(ptr, size);
+    sharelib::AllocTracker::Count(size);
+    return p;
+}
+
+
+void* memalign(size_t alignment, size_t size) {
+    void* p = __libc_memalign(alignment, size);
+    sharelib::AllocTracker::Count(size);
+    return p;
+}
+
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+
+int posix_memalign(void** ptr, size_t alignment, size_t size) {
+    if(alignment == 0 || alignment % sizeof(void*) != 0
+            || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+
+    void* p = memalign(alignment, size);
+    if(p == NULL) {
+        return ENOMEM;
+    }
+
+    *ptr = p;
+    return 0;
+}
+
+}
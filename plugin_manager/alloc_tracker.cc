@@ -0,0 +1,163 @@
+
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "alloc_tracker.h"
+
+using namespace std;
+
+/* defined by alloc_hook.cc, if linked */
+extern "C" int sharelib_alloc_hook_linked __attribute__((weak));
+
+namespace sharelib {
+
+const static int kSiteDepth = 4;
+const static int kSkipFrames = 2;       /* RecordSite and the hook */
+const static size_t kSites = 4096;
+const static size_t kSiteProbes = 16;
+const static size_t kTopSites = 50;
+
+struct AllocSite {
+    volatile uint64_t hash;             /* 0 if the slot is free */
+    void* pcs[kSiteDepth];
+    volatile uint64_t count;
+    volatile uint64_t bytes;
+};
+
+__thread AllocCounts* AllocTracker::current_ = NULL;
+__thread unsigned AllocTracker::site_calls_ = 0;
+unsigned AllocTracker::site_every_ = 0;
+
+static AllocSite* sites = NULL;
+
+
+bool AllocTracker::Enabled() {
+    return &sharelib_alloc_hook_linked != NULL;
+}
+
+
+void AllocTracker::EnableSites(unsigned site_every) {
+    if(site_every == 0 || sites != NULL) {
+        return;
+    }
+
+    /* the first backtrace loads libgcc, which allocates */
+    void* frame;
+    backtrace(&frame, 1);
+
+    sites = (AllocSite*)calloc(kSites, sizeof(AllocSite));
+    if(sites == NULL) {
+        return;
+    }
+
+    __sync_synchronize();
+    site_every_ = site_every;
+}
+
+
+void AllocTracker::RecordSite(size_t size) {
+    void* frames[kSkipFrames + kSiteDepth];
+
+    /* backtrace may allocate, don't count that */
+    AllocCounts* saved = Swap(NULL);
+
+    memset(frames, 0, sizeof(frames));
+    backtrace(frames, kSkipFrames + kSiteDepth);
+
+    void** pcs = frames + kSkipFrames;
+    uint64_t hash = 14695981039346656037ULL;
+    for(int i = 0; i < kSiteDepth; i++) {
+        hash = (hash ^ (uint64_t)pcs[i]) * 1099511628211ULL;
+    }
+    hash |= 1;
+
+    for(size_t i = 0; i < kSiteProbes; i++) {
+        AllocSite& site = sites[(hash + i) % kSites];
+
+        if(site.hash == 0 && __sync_bool_compare_and_swap(&site.hash, 0, hash)) {
+            memcpy(site.pcs, pcs, sizeof(site.pcs));
+        } else if(site.hash != hash) {
+            continue;
+        }
+
+        __sync_fetch_and_add(&site.count, 1);
+        __sync_fetch_and_add(&site.bytes, size);
+        break;
+    }
+
+    Swap(saved);
+}
+
+
+static bool SiteGreater(const AllocSite* a, const AllocSite* b) {
+    return a->count > b->count;
+}
+
+
+static string SiteName(void* pc) {
+    Dl_info info;
+    char buf[256];
+
+    if(pc == NULL) {
+        return "";
+    }
+
+    if(dladdr(pc, &info) == 0 || info.dli_fname == NULL) {
+        snprintf(buf, sizeof(buf), "%p", pc);
+    } else if(info.dli_sname != NULL) {
+        snprintf(buf, sizeof(buf), "%s+%#lx", info.dli_sname,
+                (unsigned long)((char*)pc - (char*)info.dli_saddr));
+    } else {
+        snprintf(buf, sizeof(buf), "%s+%#lx", info.dli_fname,
+                (unsigned long)((char*)pc - (char*)info.dli_fbase));
+    }
+
+    return buf;
+}
+
+
+void AllocTracker::WriteSites(string& out) {
+    vector<const AllocSite*> sorted;
+    char line[64];
+
+    if(sites == NULL) {
+        out += "allocation sites not recorded\n";
+        return;
+    }
+
+    for(size_t i = 0; i < kSites; i++) {
+        if(sites[i].hash != 0 && sites[i].count > 0) {
+            sorted.push_back(&sites[i]);
+        }
+    }
+
+    sort(sorted.begin(), sorted.end(), SiteGreater);
+
+    snprintf(line, sizeof(line), "# one allocation in %u sampled\n", site_every_);
+    out += line;
+
+    for(size_t i = 0; i < sorted.size() && i < kTopSites; i++) {
+        const AllocSite& site = *sorted[i];
+
+        snprintf(line, sizeof(line), "%10llu %12llu ",
+                (unsigned long long)site.count, (unsigned long long)site.bytes);
+        out += line;
+
+        for(int j = 0; j < kSiteDepth && site.pcs[j]; j++) {
+            if(j) {
+                out += " <- ";
+            }
+            out += SiteName(site.pcs[j]);
+        }
+
+        out += '\n';
+    }
+}
+
+}
@@ -0,0 +1,74 @@
+#ifndef SHARELIB_PLUGINMANAGER_ALLOC_TRACKER_H_
+#define SHARELIB_PLUGINMANAGER_ALLOC_TRACKER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+namespace sharelib {
+
+struct AllocCounts {
+    uint64_t count;
+    uint64_t bytes;
+};
+
+/*
+ * Counts the malloc calls of a thread into the AllocCounts it has swapped
+ * in, so they can be charged to whoever runs at the time:
+ *
+ *      AllocCounts counts = {0, 0};
+ *      AllocCounts* prev = AllocTracker::Swap(&counts);
+ *      plugin->Handle(ctx);
+ *      AllocTracker::Swap(prev);
+ *
+ * It needs the malloc interposer, libplugin_manager.so built with
+ * "make ALLOC_HOOK=1"; without it Enabled() is false and nothing is counted.
+ *
+ * In debug mode one counted allocation in site_every also records its call
+ * site, the first few return addresses, in a table of the process.
+ */
+class AllocTracker {
+public:
+    static bool Enabled();
+
+    static AllocCounts* Swap(AllocCounts* counts) {
+        AllocCounts* prev = current_;
+        current_ = counts;
+        return prev;
+    }
+
+    static void EnableSites(unsigned site_every);
+
+    /* hottest call sites so far, resolved with dladdr, one per line */
+    static void WriteSites(std::string& out);
+
+    /* called by the interposer after each allocation */
+    static void Count(size_t size) {
+        AllocCounts* counts = current_;
+
+        if(counts == NULL) {
+            return;
+        }
+
+        counts->count++;
+        counts->bytes += size;
+
+        if(site_every_ && ++site_calls_ % site_every_ == 0) {
+            RecordSite(size);
+        }
+    }
+
+private:
+    static void RecordSite(size_t size);
+
+    /* initial-exec: reading them from malloc mustn't allocate */
+    static __thread AllocCounts* current_ __attribute__((tls_model("initial-exec")));
+    static __thread unsigned site_calls_ __attribute__((tls_model("initial-exec")));
+
+    static unsigned site_every_;
+};
+
+}
+
+#endif // end SHARELIB_PLUGINMANAGER_ALLOC_TRACKER_H_
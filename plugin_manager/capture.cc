@@ -0,0 +1,249 @@
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+
+#include "capture.h"
+#include "logger.h"
+
+using namespace std;
+
+namespace sharelib {
+
+static const char kCaptureMagic[8] = {'A', 'D', 'C', 'A', 'P', 'T', '0', '1'};
+
+/* a corrupt length mustn't make Read allocate the world */
+const static uint32_t kMaxCaptureString = 64 << 20;
+
+
+CaptureRing::CaptureRing(size_t capacity): capacity_(capacity), next_(0) {
+    requests_.reserve(capacity);
+}
+
+
+CaptureRing::~CaptureRing() {
+    for(size_t i = 0; i < requests_.size(); i++) {
+        delete requests_[i];
+    }
+}
+
+
+void CaptureRing::Add(CapturedRequest* request) {
+    if(requests_.size() < capacity_) {
+        requests_.push_back(request);
+        return;
+    }
+
+    delete requests_[next_];
+    requests_[next_] = request;
+    next_ = (next_ + 1) % capacity_;
+}
+
+
+static void PutU32(FILE* fp, uint32_t v) {
+    fwrite(&v, sizeof(v), 1, fp);
+}
+
+
+static void PutI64(FILE* fp, int64_t v) {
+    fwrite(&v, sizeof(v), 1, fp);
+}
+
+
+static void PutString(FILE* fp, const string& s) {
+    PutU32(fp, s.size());
+    fwrite(s.data(), 1, s.size(), fp);
+}
+
+
+static void PutUpstream(FILE* fp, const UpstreamRequest& ups) {
+    PutString(fp, ups.uri_);
+    PutString(fp, ups.args_);
+    PutString(fp, ups.plugin_);
+    PutU32(fp, (uint32_t)ups.endpoint_);
+    PutU32(fp, (uint32_t)ups.status_);
+    PutU32(fp, ups.done_ ? 1 : 0);
+    PutI64(fp, ups.up_sec_);
+    PutI64(fp, ups.up_msec_);
+    PutI64(fp, ups.queue_usec_);
+    PutI64(fp, ups.connect_usec_);
+    PutI64(fp, ups.header_usec_);
+    PutI64(fp, ups.total_usec_);
+    PutI64(fp, ups.bytes_);
+    PutString(fp, ups.peer_);
+    PutString(fp, ups.response_);
+}
+
+
+int CaptureRing::Write(const string& path) const {
+    FILE* fp = fopen(path.c_str(), "wb");
+    if(fp == NULL) {
+        Log(LOG_LEVEL_ERROR, "capture can't write").Field("path", path)
+            .Field("error", strerror(errno));
+        return -1;
+    }
+
+    fwrite(kCaptureMagic, 1, sizeof(kCaptureMagic), fp);
+    PutU32(fp, requests_.size());
+
+    for(size_t k = 0; k < requests_.size(); k++) {
+        const CapturedRequest& req = *requests_[(next_ + k) % requests_.size()];
+
+        PutI64(fp, req.start_usec);
+        PutI64(fp, req.total_usec);
+        PutString(fp, req.time_stamp);
+
+        PutU32(fp, req.headers_in.size());
+        for(STR_MAP::const_iterator it = req.headers_in.begin();
+                it != req.headers_in.end(); it++) {
+            PutString(fp, it->first);
+            PutString(fp, it->second);
+        }
+
+        PutU32(fp, req.rounds.size());
+        for(size_t i = 0; i < req.rounds.size(); i++) {
+            PutU32(fp, req.rounds[i].size());
+            for(size_t j = 0; j < req.rounds[i].size(); j++) {
+                PutUpstream(fp, req.rounds[i][j]);
+            }
+        }
+
+        PutString(fp, req.handle_result);
+    }
+
+    int rc = ferror(fp) ? -1 : 0;
+    if(fclose(fp) != 0) {
+        rc = -1;
+    }
+
+    if(rc != 0) {
+        Log(LOG_LEVEL_ERROR, "capture write error").Field("path", path);
+    }
+
+    return rc;
+}
+
+
+static bool GetU32(FILE* fp, uint32_t* v) {
+    return fread(v, sizeof(*v), 1, fp) == 1;
+}
+
+
+static bool GetI64(FILE* fp, int64_t* v) {
+    return fread(v, sizeof(*v), 1, fp) == 1;
+}
+
+
+static bool GetString(FILE* fp, string* s) {
+    uint32_t len;
+
+    if(!GetU32(fp, &len) || len > kMaxCaptureString) {
+        return false;
+    }
+
+    s->resize(len);
+    return len == 0 || fread(&(*s)[0], 1, len, fp) == len;
+}
+
+
+static bool GetUpstream(FILE* fp, UpstreamRequest* ups) {
+    uint32_t endpoint, status, done;
+    int64_t up_sec, up_msec, bytes;
+
+    if(!GetString(fp, &ups->uri_) || !GetString(fp, &ups->args_)
+            || !GetString(fp, &ups->plugin_) || !GetU32(fp, &endpoint)
+            || !GetU32(fp, &status) || !GetU32(fp, &done)
+            || !GetI64(fp, &up_sec) || !GetI64(fp, &up_msec)
+            || !GetI64(fp, &ups->queue_usec_) || !GetI64(fp, &ups->connect_usec_)
+            || !GetI64(fp, &ups->header_usec_) || !GetI64(fp, &ups->total_usec_)
+            || !GetI64(fp, &bytes) || !GetString(fp, &ups->peer_)
+            || !GetString(fp, &ups->response_)) {
+        return false;
+    }
+
+    ups->endpoint_ = (int)endpoint;
+    ups->status_ = (int)status;
+    ups->done_ = done != 0;
+    ups->up_sec_ = up_sec;
+    ups->up_msec_ = up_msec;
+    ups->bytes_ = bytes;
+
+    return true;
+}
+
+
+static bool GetRequest(FILE* fp, CapturedRequest* req) {
+    uint32_t n, m;
+    string key, value;
+
+    if(!GetI64(fp, &req->start_usec) || !GetI64(fp, &req->total_usec)
+            || !GetString(fp, &req->time_stamp) || !GetU32(fp, &n)) {
+        return false;
+    }
+
+    for(uint32_t i = 0; i < n; i++) {
+        if(!GetString(fp, &key) || !GetString(fp, &value)) {
+            return false;
+        }
+        req->headers_in[key] = value;
+    }
+
+    if(!GetU32(fp, &n)) {
+        return false;
+    }
+
+    req->rounds.resize(n);
+    for(uint32_t i = 0; i < n; i++) {
+        if(!GetU32(fp, &m)) {
+            return false;
+        }
+
+        for(uint32_t j = 0; j < m; j++) {
+            req->rounds[i].push_back(UpstreamRequest("", ""));
+            if(!GetUpstream(fp, &req->rounds[i].back())) {
+                return false;
+            }
+        }
+    }
+
+    return GetString(fp, &req->handle_result);
+}
+
+
+int CaptureRing::Read(const string& path, vector<CapturedRequest>& requests) {
+    char magic[sizeof(kCaptureMagic)];
+    uint32_t n;
+
+    FILE* fp = fopen(path.c_str(), "rb");
+    if(fp == NULL) {
+        Log(LOG_LEVEL_ERROR, "capture can't read").Field("path", path)
+            .Field("error", strerror(errno));
+        return -1;
+    }
+
+    if(fread(magic, 1, sizeof(magic), fp) != sizeof(magic)
+            || memcmp(magic, kCaptureMagic, sizeof(magic)) != 0
+            || !GetU32(fp, &n)) {
+        Log(LOG_LEVEL_ERROR, "capture file invalid").Field("path", path);
+        fclose(fp);
+        return -1;
+    }
+
+    for(uint32_t i = 0; i < n; i++) {
+        requests.push_back(CapturedRequest());
+
+        if(!GetRequest(fp, &requests.back())) {
+            Log(LOG_LEVEL_ERROR, "capture file truncated").Field("path", path)
+                .Field("request", i);
+            requests.pop_back();
+            fclose(fp);
+            return -1;
+        }
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+}
@@ -0,0 +1,71 @@
+#ifndef SHARELIB_PLUGINMANAGER_CAPTURE_H_
+#define SHARELIB_PLUGINMANAGER_CAPTURE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "plugin.h"
+
+namespace sharelib {
+
+/*
+ * A request as its plugin saw it, enough to replay it offline without the
+ * upstreams: headers_in_ once the context was built, upstream_request_ with
+ * responses and timings each time a subrequest round settled, that is
+ * before each PostSubHandle, and the final handle_result_.
+ */
+struct CapturedRequest {
+    CapturedRequest(): start_usec(0), total_usec(0) {}
+
+    int64_t start_usec;                 /* unix time the request came in */
+    int64_t total_usec;                 /* until handle_result_ was final */
+    std::string time_stamp;             /* PluginContext::time_stamp_ */
+    STR_MAP headers_in;
+    std::vector<std::vector<UpstreamRequest> > rounds;
+    std::string handle_result;
+};
+
+/*
+ * The last requests captured by the process, a new one pushes out the
+ * oldest. Not thread safe, the event loop owns it.
+ *
+ * Write dumps them oldest first, Read loads such a file for a replay, see
+ * test/plugin_replay.cc. Integers are in host byte order, strings and lists
+ * are preceded by their u32 length:
+ *
+ *      file        "ADCAPT01" u32 count, request*
+ *      request     i64 start_usec, i64 total_usec, time_stamp, headers_in,
+ *                  rounds, handle_result
+ *      headers_in  u32 count, (key, value)*
+ *      rounds      u32 count, (u32 count, upstream*)*
+ *      upstream    uri, args, plugin, i32 endpoint, i32 status, i32 done,
+ *                  i64 up_sec, i64 up_msec, i64 queue_usec, i64 connect_usec,
+ *                  i64 header_usec, i64 total_usec, u64 bytes, peer, response
+ */
+class CaptureRing {
+public:
+    explicit CaptureRing(size_t capacity);
+
+    ~CaptureRing();
+
+    /* takes it over */
+    void Add(CapturedRequest* request);
+
+    size_t Size() const { return requests_.size(); }
+
+    int Write(const std::string& path) const;
+
+    static int Read(const std::string& path, std::vector<CapturedRequest>& requests);
+
+private:
+    size_t capacity_;
+    size_t next_;                       /* slot of the oldest once full */
+    std::vector<CapturedRequest*> requests_;
+};
+
+}
+
+#endif // end SHARELIB_PLUGINMANAGER_CAPTURE_H_
@@ -0,0 +1,241 @@
+
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "coroutine_plugin.h"
+#include "logger.h"
+
+using namespace std;
+
+namespace sharelib {
+
+const static size_t kMaxFreeStacks = 64;
+
+/* thrown in a suspended coroutine to unwind it when the request goes away */
+struct CoroutineCancelled {
+};
+
+class CoroutineCtx : public HandleBaseCtx {
+    public:
+        CoroutineCtx(CoroutinePlugin* plugin, PluginContext* ctx)
+            : plugin_(plugin), ctx_(ctx), stack_(NULL), rc_(PLUGIN_ERROR),
+              finished_(false), cancelled_(false) {}
+
+        virtual ~CoroutineCtx() {
+            /* run destructors of locals on the coroutine stack */
+            if(stack_ != NULL && !finished_) {
+                cancelled_ = true;
+                swapcontext(&caller_, &self_);
+            }
+
+            if(stack_ == NULL) {
+                return;
+            }
+
+            /* Process swallowed the cancel and suspended again, frames are live */
+            if(!finished_) {
+                Log(LOG_LEVEL_ERROR, "coroutine_plugin Process caught the cancel, "
+                        "stack dropped");
+                plugin_->DropStack(stack_);
+                return;
+            }
+
+            plugin_->FreeStack(stack_);
+        }
+
+        static void Entry(uint32_t lo, uint32_t hi);
+
+        CoroutinePlugin* plugin_;
+        PluginContext* ctx_;
+        char* stack_;
+        int rc_;
+        bool finished_;
+        bool cancelled_;
+
+        ucontext_t caller_;
+        ucontext_t self_;
+};
+
+
+/* makecontext only passes int arguments, the pointer comes in two halves */
+void CoroutineCtx::Entry(uint32_t lo, uint32_t hi) {
+    CoroutineCtx* co = (CoroutineCtx*)(((uintptr_t)hi << 16 << 16) | lo);
+
+    try {
+        co->rc_ = co->plugin_->Process(*co->ctx_);
+    } catch(CoroutineCancelled&) {
+        co->rc_ = PLUGIN_ERROR;
+    } catch(...) {
+        Log(LOG_LEVEL_ERROR, "coroutine_plugin uncaught exception in Process");
+        co->rc_ = PLUGIN_ERROR;
+    }
+
+    if(co->rc_ == PLUGIN_AGAIN || co->rc_ == PLUGIN_YIELD) {
+        Log(LOG_LEVEL_ERROR, "coroutine_plugin Process must await instead of return")
+            .Field("rc", co->rc_);
+        co->rc_ = PLUGIN_ERROR;
+    }
+
+    co->finished_ = true;
+    swapcontext(&co->self_, &co->caller_);
+}
+
+
+CoroutinePlugin::CoroutinePlugin(size_t stack_size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    stack_size_ = (stack_size + page - 1) / page * page;
+}
+
+
+CoroutinePlugin::~CoroutinePlugin() {
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    for(size_t i = 0; i < free_stacks_.size(); i++) {
+        munmap(free_stacks_[i] - page, stack_size_ + page);
+    }
+}
+
+
+int CoroutinePlugin::Handle(PluginContext &ctx) {
+    if(dynamic_cast<CoroutineCtx*>(ctx.handle_ctx_.get()) != NULL) {
+        /* resumed after PLUGIN_YIELD */
+        return Resume(ctx);
+    }
+
+    CoroutineCtx* co = new CoroutineCtx(this, &ctx);
+
+    co->stack_ = AllocStack();
+    if(co->stack_ == NULL) {
+        delete co;
+        return PLUGIN_ERROR;
+    }
+
+    getcontext(&co->self_);
+    co->self_.uc_stack.ss_sp = co->stack_;
+    co->self_.uc_stack.ss_size = stack_size_;
+    co->self_.uc_link = NULL;
+
+    uintptr_t p = (uintptr_t)co;
+    makecontext(&co->self_, (void (*)())CoroutineCtx::Entry, 2,
+            (uint32_t)p, (uint32_t)(p >> 16 >> 16));
+
+    ctx.handle_ctx_.reset(co);
+
+    return Resume(ctx);
+}
+
+
+int CoroutinePlugin::PostSubHandle(PluginContext &ctx) {
+    if(dynamic_cast<CoroutineCtx*>(ctx.handle_ctx_.get()) == NULL) {
+        Log(LOG_LEVEL_ERROR, "coroutine_plugin PostSubHandle without coroutine");
+        return PLUGIN_ERROR;
+    }
+
+    return Resume(ctx);
+}
+
+
+void CoroutinePlugin::AwaitAll(PluginContext &ctx) {
+    if(ctx.upstream_request_.empty()) {
+        return;
+    }
+
+    ctx.wait_any_ = false;
+    Suspend(ctx, PLUGIN_AGAIN);
+}
+
+
+size_t CoroutinePlugin::AwaitAny(PluginContext &ctx) {
+    if(ctx.upstream_request_.empty()) {
+        return 0;
+    }
+
+    ctx.wait_any_ = true;
+    Suspend(ctx, PLUGIN_AGAIN);
+    ctx.wait_any_ = false;
+
+    for(size_t i = 0; i < ctx.upstream_request_.size(); i++) {
+        if(ctx.upstream_request_[i].done_) {
+            return i;
+        }
+    }
+
+    return 0;
+}
+
+
+void CoroutinePlugin::Yield(PluginContext &ctx) {
+    if(ctx.SliceExpired()) {
+        Suspend(ctx, PLUGIN_YIELD);
+    }
+}
+
+
+int CoroutinePlugin::Resume(PluginContext &ctx) {
+    CoroutineCtx* co = static_cast<CoroutineCtx*>(ctx.handle_ctx_.get());
+
+    swapcontext(&co->caller_, &co->self_);
+
+    int rc = co->rc_;
+    if(co->finished_) {
+        ctx.handle_ctx_.reset();
+    }
+
+    return rc;
+}
+
+
+void CoroutinePlugin::Suspend(PluginContext &ctx, int rc) {
+    CoroutineCtx* co = static_cast<CoroutineCtx*>(ctx.handle_ctx_.get());
+
+    co->rc_ = rc;
+    swapcontext(&co->self_, &co->caller_);
+
+    if(co->cancelled_) {
+        throw CoroutineCancelled();
+    }
+}
+
+
+/* stack with a guard page below, overflow faults instead of corrupting heap */
+char* CoroutinePlugin::AllocStack() {
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    if(!free_stacks_.empty()) {
+        char* stack = free_stacks_.back();
+        free_stacks_.pop_back();
+        return stack;
+    }
+
+    void* p = mmap(NULL, stack_size_ + page, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(p == MAP_FAILED) {
+        Log(LOG_LEVEL_ERROR, "coroutine_plugin mmap stack error").Field("errno", errno);
+        return NULL;
+    }
+
+    mprotect(p, page, PROT_NONE);
+
+    return (char*)p + page;
+}
+
+
+void CoroutinePlugin::FreeStack(char* stack) {
+    if(free_stacks_.size() < kMaxFreeStacks) {
+        free_stacks_.push_back(stack);
+        return;
+    }
+
+    DropStack(stack);
+}
+
+
+void CoroutinePlugin::DropStack(char* stack) {
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    munmap(stack - page, stack_size_ + page);
+}
+
+}
@@ -0,0 +1,88 @@
+#ifndef SHARELIB_PLUGINMANAGER_COROUTINE_PLUGIN_H_
+#define SHARELIB_PLUGINMANAGER_COROUTINE_PLUGIN_H_
+
+#include <ucontext.h>
+
+#include <vector>
+
+#include "plugin.h"
+
+namespace sharelib {
+
+/*
+ * Plugin flavour written as straight-line code instead of a state machine
+ * over Handle/PostSubHandle. Process() runs on its own stack and suspends
+ * in AwaitAll/AwaitAny until the subrequests have responded:
+ *
+ *      int MyPlugin::Process(PluginContext &ctx) {
+ *          ctx.upstream_request_.push_back(UpstreamRequest("/a", args));
+ *          ctx.upstream_request_.push_back(UpstreamRequest("/b", args));
+ *          AwaitAll(ctx);
+ *
+ *          string a = ctx.upstream_request_[0].response_;
+ *          ctx.upstream_request_.clear();
+ *          ctx.upstream_request_.push_back(UpstreamRequest("/c", a));
+ *          AwaitAll(ctx);
+ *          ...
+ *          return PLUGIN_OK;
+ *      }
+ *
+ * Keep state in locals, handle_ctx_ is used by the coroutine itself. Don't
+ * configure it with offload, a coroutine must stay on one thread.
+ *
+ * A request going away while Process is suspended is cancelled by an
+ * exception thrown out of the Await call, which unwinds the locals. Process
+ * must not swallow it: a catch(...) has to rethrow. A coroutine that awaits
+ * again after a cancel has its stack unmapped with the frames still on it.
+ */
+class CoroutinePlugin : public Plugin {
+    public:
+        explicit CoroutinePlugin(size_t stack_size = 256 * 1024);
+
+        virtual ~CoroutinePlugin();
+
+        /* PLUGIN_OK or PLUGIN_ERROR once the whole request is handled */
+        virtual int Process(PluginContext &ctx) = 0;
+
+        virtual int Handle(PluginContext &ctx);
+
+        virtual int PostSubHandle(PluginContext &ctx);
+
+    protected:
+        /*
+         * Issue ctx.upstream_request_ and suspend until all of them
+         * responded. Clear them before filling in the next round.
+         */
+        void AwaitAll(PluginContext &ctx);
+
+        /*
+         * Suspend until the first of ctx.upstream_request_ responded, return
+         * its index. The others are given up and have done_ == false.
+         */
+        size_t AwaitAny(PluginContext &ctx);
+
+        /* give up the event loop if the time slice is used up */
+        void Yield(PluginContext &ctx);
+
+    private:
+        friend class CoroutineCtx;
+
+        int Resume(PluginContext &ctx);
+
+        void Suspend(PluginContext &ctx, int rc);
+
+        char* AllocStack();
+
+        void FreeStack(char* stack);
+
+        /* unmapped, never reused */
+        void DropStack(char* stack);
+
+    private:
+        size_t stack_size_;
+        std::vector<char*> free_stacks_;    /* reused across requests */
+};
+
+}
+
+#endif // end SHARELIB_PLUGINMANAGER_COROUTINE_PLUGIN_H_
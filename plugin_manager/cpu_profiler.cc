@@ -0,0 +1,360 @@
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include "cpu_profiler.h"
+#include "logger.h"
+
+using namespace std;
+
+namespace sharelib {
+
+/* the handler and the sigreturn trampoline are on top of every stack */
+const static int kSkipFrames = 2;
+const static size_t kTopFunctions = 20;
+
+struct ProfileSample {
+    volatile int ready;
+    int depth;
+    const char* tag;
+    void* pcs[CpuProfiler::kMaxDepth];
+};
+
+typedef map<vector<uintptr_t>, uint64_t> StackCounts;
+
+/* samples of a stopped profile, handed to the writer thread */
+struct ProfileJob {
+    ProfileSample* samples;
+    size_t n;
+    size_t dropped;
+    string prefix;
+};
+
+__thread const char* volatile CpuProfiler::tag_ = NULL;
+
+static ProfileSample* samples = NULL;
+static size_t capacity = 0;
+static volatile size_t next_sample = 0;
+static volatile size_t dropped = 0;
+static volatile int running = 0;
+static volatile int active = 0;         /* handlers touching samples */
+static long period_usec = 0;
+
+static pthread_t writer;
+static bool writer_started = false;     /* not joined yet */
+static volatile int writer_done = 0;
+
+
+/* async signal safe only, backtrace has been loaded by Start */
+void CpuProfiler::Signal(int signo) {
+    int saved_errno = errno;
+
+    __sync_fetch_and_add(&active, 1);
+
+    if(running) {
+        size_t i = __sync_fetch_and_add(&next_sample, 1);
+
+        if(i < capacity) {
+            ProfileSample& s = samples[i];
+
+            s.tag = tag_;
+            s.depth = backtrace(s.pcs, kMaxDepth);
+            __sync_synchronize();
+            s.ready = 1;
+        } else {
+            __sync_fetch_and_add(&dropped, 1);
+        }
+    }
+
+    __sync_fetch_and_sub(&active, 1);
+
+    errno = saved_errno;
+}
+
+
+int CpuProfiler::Start(int hz, size_t max_samples) {
+    if(running || hz <= 0 || max_samples == 0) {
+        return -1;
+    }
+
+    /* the writer uses period_usec */
+    if(Writing()) {
+        return -1;
+    }
+
+    Wait();
+
+    /* the first backtrace loads libgcc, which isn't safe in a signal handler */
+    void* frame;
+    backtrace(&frame, 1);
+
+    samples = (ProfileSample*)calloc(max_samples, sizeof(ProfileSample));
+    if(samples == NULL) {
+        Log(LOG_LEVEL_ERROR, "cpu profiler can't allocate").Field("samples", max_samples);
+        return -1;
+    }
+
+    capacity = max_samples;
+    next_sample = 0;
+    dropped = 0;
+    period_usec = 1000000 / hz;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = Signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+
+    if(sigaction(SIGPROF, &sa, NULL) != 0) {
+        Log(LOG_LEVEL_ERROR, "cpu profiler sigaction error").Field("error", strerror(errno));
+        free(samples);
+        samples = NULL;
+        return -1;
+    }
+
+    running = 1;
+
+    struct itimerval it;
+    it.it_interval.tv_sec = period_usec / 1000000;
+    it.it_interval.tv_usec = period_usec % 1000000;
+    it.it_value = it.it_interval;
+
+    if(setitimer(ITIMER_PROF, &it, NULL) != 0) {
+        Log(LOG_LEVEL_ERROR, "cpu profiler setitimer error").Field("error", strerror(errno));
+        running = 0;
+        free(samples);
+        samples = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+bool CpuProfiler::Running() {
+    return running;
+}
+
+
+static void WriteWords(FILE* fp, const uintptr_t* words, size_t n) {
+    fwrite(words, sizeof(uintptr_t), n, fp);
+}
+
+
+/* gperftools legacy CPU profile: header, records, trailer, then the maps */
+static int WriteProfile(const string& path, const StackCounts& stacks) {
+    FILE* fp = fopen(path.c_str(), "wb");
+    if(fp == NULL) {
+        Log(LOG_LEVEL_ERROR, "cpu profiler can't write").Field("path", path)
+            .Field("error", strerror(errno));
+        return -1;
+    }
+
+    uintptr_t header[] = {0, 3, 0, (uintptr_t)period_usec, 0};
+    WriteWords(fp, header, 5);
+
+    for(StackCounts::const_iterator it = stacks.begin(); it != stacks.end(); it++) {
+        uintptr_t record[2] = {(uintptr_t)it->second, (uintptr_t)it->first.size()};
+
+        WriteWords(fp, record, 2);
+        WriteWords(fp, &it->first[0], it->first.size());
+    }
+
+    uintptr_t trailer[] = {0, 1, 0};
+    WriteWords(fp, trailer, 3);
+
+    FILE* maps = fopen("/proc/self/maps", "r");
+    if(maps != NULL) {
+        char buf[4096];
+        size_t n;
+
+        while((n = fread(buf, 1, sizeof(buf), maps)) > 0) {
+            fwrite(buf, 1, n, fp);
+        }
+        fclose(maps);
+    }
+
+    int rc = ferror(fp) ? -1 : 0;
+    fclose(fp);
+
+    return rc;
+}
+
+
+static bool CountGreater(const pair<string, uint64_t>& a, const pair<string, uint64_t>& b) {
+    return a.second > b.second;
+}
+
+
+/* leaf functions by samples, resolved here as the binaries may not be at hand */
+static void WriteTop(FILE* fp, const char* tag, const StackCounts& stacks) {
+    map<string, uint64_t> functions;
+    uint64_t total = 0;
+
+    for(StackCounts::const_iterator it = stacks.begin(); it != stacks.end(); it++) {
+        Dl_info info;
+        char addr[32];
+        void* pc = (void*)it->first[0];
+
+        snprintf(addr, sizeof(addr), "%p", pc);
+        string name = addr;
+
+        if(dladdr(pc, &info) != 0 && info.dli_fname != NULL) {
+            name = string(info.dli_sname ? info.dli_sname : addr) 
+                + " (" + info.dli_fname + ")";
+        }
+
+        functions[name] += it->second;
+        total += it->second;
+    }
+
+    vector<pair<string, uint64_t> > sorted(functions.begin(), functions.end());
+    sort(sorted.begin(), sorted.end(), CountGreater);
+
+    fprintf(fp, "%s: %llu samples\n", tag, (unsigned long long)total);
+
+    for(size_t i = 0; i < sorted.size() && i < kTopFunctions; i++) {
+        fprintf(fp, "%10llu %5.1f%%  %s\n", (unsigned long long)sorted[i].second,
+                100.0 * sorted[i].second / total, sorted[i].first.c_str());
+    }
+
+    fprintf(fp, "\n");
+}
+
+
+/* the files of one profile, off the thread that stopped it */
+static int WriteProfiles(const ProfileJob& job) {
+    const string& prefix = job.prefix;
+
+    /* samples of the whole process, and of each tag */
+    StackCounts all;
+    map<const char*, StackCounts> tagged;
+
+    for(size_t i = 0; i < job.n; i++) {
+        const ProfileSample& s = job.samples[i];
+
+        if(!s.ready || s.depth <= kSkipFrames) {
+            continue;
+        }
+
+        const uintptr_t* pcs = (const uintptr_t*)s.pcs;
+        vector<uintptr_t> stack(pcs + kSkipFrames, pcs + s.depth);
+
+        all[stack]++;
+        tagged[s.tag][stack]++;
+    }
+
+    int rc = WriteProfile(prefix + ".prof", all);
+
+    string top_path = prefix + ".top";
+    FILE* top = fopen(top_path.c_str(), "w");
+
+    for(map<const char*, StackCounts>::iterator t = tagged.begin(); t != tagged.end(); t++) {
+        const char* tag = t->first ? t->first : "none";
+
+        if(t->first && WriteProfile(prefix + "." + tag + ".prof", t->second) != 0) {
+            rc = -1;
+        }
+
+        if(top != NULL) {
+            WriteTop(top, tag, t->second);
+        }
+    }
+
+    if(top != NULL) {
+        fclose(top);
+    }
+
+    Log(LOG_LEVEL_INFO, "cpu profile written").Field("path", prefix + ".prof")
+        .Field("samples", job.n).Field("dropped", job.dropped);
+
+    return rc;
+}
+
+
+static void* WriterMain(void* arg) {
+    ProfileJob* job = (ProfileJob*)arg;
+
+    WriteProfiles(*job);
+
+    free(job->samples);
+    delete job;
+
+    __atomic_store_n(&writer_done, 1, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+
+int CpuProfiler::Stop(const string& prefix) {
+    if(!running) {
+        return -1;
+    }
+
+    struct itimerval it;
+    memset(&it, 0, sizeof(it));
+    setitimer(ITIMER_PROF, &it, NULL);
+
+    running = 0;
+    __sync_synchronize();
+
+    /* a signal may still be writing a sample on another thread */
+    while(active) {
+        sched_yield();
+    }
+
+    ProfileJob* job = new ProfileJob();
+    job->samples = samples;
+    job->n = min((size_t)next_sample, capacity);
+    job->dropped = dropped;
+    job->prefix = prefix;
+
+    samples = NULL;
+    capacity = 0;
+
+    writer_done = 0;
+
+    if(pthread_create(&writer, NULL, WriterMain, job) != 0) {
+        Log(LOG_LEVEL_WARN, "cpu profiler create thread error, writing in place")
+            .Field("errno", errno);
+
+        int rc = WriteProfiles(*job);
+
+        free(job->samples);
+        delete job;
+
+        return rc;
+    }
+
+    writer_started = true;
+
+    return 0;
+}
+
+
+bool CpuProfiler::Writing() {
+    return writer_started && !__atomic_load_n(&writer_done, __ATOMIC_ACQUIRE);
+}
+
+
+void CpuProfiler::Wait() {
+    if(writer_started) {
+        pthread_join(writer, NULL);
+        writer_started = false;
+    }
+}
+
+}
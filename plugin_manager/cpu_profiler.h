@@ -0,0 +1,62 @@
+#ifndef SHARELIB_PLUGINMANAGER_CPU_PROFILER_H_
+#define SHARELIB_PLUGINMANAGER_CPU_PROFILER_H_
+
+#include <stddef.h>
+
+#include <string>
+
+namespace sharelib {
+
+/*
+ * Sampling CPU profiler of the process, SIGPROF driven. Each sample is the
+ * stack of the thread the signal landed on plus the tag that thread had set,
+ * the plugin it was running:
+ *
+ *      const char* prev = CpuProfiler::SetTag("recall");
+ *      plugin->Handle(ctx);
+ *      CpuProfiler::SetTag(prev);
+ *
+ * Stop writes gperftools CPU profiles, <prefix>.prof with all samples and
+ * <prefix>.<tag>.prof for each tag, which pprof reads along with the
+ * binaries, and <prefix>.top, the hottest functions of each tag resolved
+ * with dladdr for a look without pprof.
+ *
+ * Stop only ends sampling, a thread of its own builds the stacks and writes
+ * the files so the caller, an event loop, isn't held up meanwhile. Start
+ * fails until that's done, Wait joins it.
+ *
+ * Tags must outlive the profile, plugin names from the plugin manager do.
+ * Start/Stop/Wait on one thread; samples are kept in a buffer allocated by
+ * Start, once it's full further samples are dropped.
+ */
+class CpuProfiler {
+public:
+    static const int kMaxDepth = 48;
+
+    static int Start(int hz, size_t max_samples);
+
+    /* 0 once the samples are handed to the writer */
+    static int Stop(const std::string& prefix);
+
+    static void Wait();
+
+    /* the last profile is still being written */
+    static bool Writing();
+
+    static bool Running();
+
+    static const char* SetTag(const char* tag) {
+        const char* prev = tag_;
+        tag_ = tag;
+        return prev;
+    }
+
+private:
+    static void Signal(int signo);
+
+    static __thread const char* volatile tag_;
+};
+
+}
+
+#endif // end SHARELIB_PLUGINMANAGER_CPU_PROFILER_H_
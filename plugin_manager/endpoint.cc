@@ -0,0 +1,94 @@
+
+
+#include "endpoint.h"
+#include "logger.h"
+
+using namespace std;
+
+namespace sharelib {
+
+EndpointStats::EndpointStats(const string& name)
+    : connect_usec(*Metrics::GetHistogram("adfront_endpoint_connect_usec", 
+                "endpoint=\"" + name + "\"")),
+      header_usec(*Metrics::GetHistogram("adfront_endpoint_header_usec", 
+                  "endpoint=\"" + name + "\"")),
+      total_usec(*Metrics::GetHistogram("adfront_endpoint_total_usec", 
+                 "endpoint=\"" + name + "\"")),
+      failed(*Metrics::GetCounter("adfront_endpoint_failed_total", 
+             "endpoint=\"" + name + "\"")) {
+}
+
+
+/* function local, plugins may register before our statics are constructed */
+vector<Endpoints::Endpoint>& Endpoints::List() {
+    static vector<Endpoint> endpoints;
+
+    return endpoints;
+}
+
+
+int Endpoints::Register(const string& name, const string& uri) {
+    vector<Endpoint>& endpoints = List();
+
+    int id = Find(name);
+    if(id >= 0) {
+        if(endpoints[id].uri != uri) {
+            Log(LOG_LEVEL_ERROR, "endpoint already registered with another uri")
+                .Field("name", name).Field("uri", endpoints[id].uri);
+            return -1;
+        }
+
+        return id;
+    }
+
+    if(uri.empty() || uri[0] != '/') {
+        Log(LOG_LEVEL_ERROR, "endpoint invalid uri").Field("name", name).Field("uri", uri);
+        return -1;
+    }
+
+    Endpoint endpoint;
+    endpoint.name = name;
+    endpoint.uri = uri;
+    endpoint.stats.reset(new EndpointStats(name));
+    endpoints.push_back(endpoint);
+
+    Log(LOG_LEVEL_INFO, "endpoint registered").Field("name", name).Field("uri", uri)
+        .Field("id", endpoints.size() - 1);
+
+    return endpoints.size() - 1;
+}
+
+
+int Endpoints::Find(const string& name) {
+    vector<Endpoint>& endpoints = List();
+
+    for(size_t i = 0; i < endpoints.size(); i++) {
+        if(endpoints[i].name == name) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+
+size_t Endpoints::Size() {
+    return List().size();
+}
+
+
+const string& Endpoints::Name(int id) {
+    return List()[id].name;
+}
+
+
+const string& Endpoints::Uri(int id) {
+    return List()[id].uri;
+}
+
+
+EndpointStats& Endpoints::Stats(int id) {
+    return *List()[id].stats;
+}
+
+}
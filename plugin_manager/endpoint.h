@@ -0,0 +1,77 @@
+#ifndef SHARELIB_PLUGINMANAGER_ENDPOINT_H_
+#define SHARELIB_PLUGINMANAGER_ENDPOINT_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+#include <tr1/memory>
+
+#include "histogram.h"
+#include "metrics.h"
+
+namespace sharelib {
+
+/* 
+ * timings the framework measured for an endpoint's subrequests, in usec,
+ * all but response_usec live in Metrics and add up across workers
+ */
+struct EndpointStats {
+    explicit EndpointStats(const std::string& name);
+
+    Histogram& connect_usec;    /* content handler to connection established */
+    Histogram& header_usec;     /* content handler to response header parsed */
+    Histogram& total_usec;      /* subrequest created to done */
+    uint64_t& failed;           /* no upstream response or status >= 300 */
+
+    /* 
+     * connected to response header parsed over the last seconds, a timed
+     * out subrequest counts with the time it waited. Event loop only, it
+     * drives the adaptive read timeouts.
+     */
+    RollingHistogram response_usec;
+};
+
+/*
+ * Named upstream locations plugins send subrequests to. Register them in
+ * Plugin::Init and keep the id:
+ *
+ *      adserver_ = Endpoints::Register("adserver", "/adserver");
+ *      ...
+ *      ctx.upstream_request_.push_back(UpstreamRequest(adserver_, args));
+ *
+ * The framework resolves an endpoint to its location once and skips the
+ * location lookup afterwards, so keep these locations plain prefix or exact
+ * ones without server level rewrites. Ids are per process, registration is
+ * not thread safe.
+ */
+class Endpoints {
+public:
+    /* same name gives the same id, -1 if it's taken with another uri */
+    static int Register(const std::string& name, const std::string& uri);
+
+    /* -1 if not registered */
+    static int Find(const std::string& name);
+
+    static size_t Size();
+
+    static const std::string& Name(int id);
+
+    static const std::string& Uri(int id);
+
+    /* filled by the event loop, read anywhere, e.g. to derive timeouts */
+    static EndpointStats& Stats(int id);
+
+private:
+    struct Endpoint {
+        std::string name;
+        std::string uri;
+        std::tr1::shared_ptr<EndpointStats> stats;
+    };
+
+    static std::vector<Endpoint>& List();
+};
+
+}
+
+#endif // end SHARELIB_PLUGINMANAGER_ENDPOINT_H_
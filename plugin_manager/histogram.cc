@@ -0,0 +1,190 @@
+
+#include <string.h>
+
+#include "histogram.h"
+
+namespace sharelib {
+
+const int Histogram::kSubBits;
+const size_t Histogram::kBuckets;
+
+
+Histogram::Histogram() {
+    Reset();
+}
+
+
+/* nothing is ordered against these, relaxed is enough */
+void Histogram::Add(uint64_t value) {
+    __atomic_fetch_add(&counts_[Index(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&count_, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&sum_, value, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&max_, __ATOMIC_RELAXED);
+    while(value > max) {
+        if(__atomic_compare_exchange_n(&max_, &max, value, true,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+}
+
+
+uint64_t Histogram::Quantile(double q) const {
+    uint64_t count = count_;
+
+    if(count == 0) {
+        return 0;
+    }
+
+    if(q < 0) {
+        q = 0;
+    } else if(q > 1) {
+        q = 1;
+    }
+
+    uint64_t rank = (uint64_t)(q * count);
+    if(rank == 0) {
+        rank = 1;
+    }
+
+    uint64_t seen = 0;
+    for(size_t i = 0; i < kBuckets; i++) {
+        seen += counts_[i];
+        if(seen >= rank) {
+            uint64_t upper = BucketUpper(i);
+            return upper < max_ ? upper : max_;
+        }
+    }
+
+    return max_;
+}
+
+
+void Histogram::Merge(const Histogram& other) {
+    for(size_t i = 0; i < kBuckets; i++) {
+        if(other.counts_[i] != 0) {
+            __sync_fetch_and_add(&counts_[i], other.counts_[i]);
+        }
+    }
+
+    __sync_fetch_and_add(&count_, other.count_);
+    __sync_fetch_and_add(&sum_, other.sum_);
+
+    uint64_t max = max_;
+    while(other.max_ > max) {
+        uint64_t old = __sync_val_compare_and_swap(&max_, max, other.max_);
+        if(old == max) {
+            break;
+        }
+        max = old;
+    }
+}
+
+
+void Histogram::Reset() {
+    memset(counts_, 0, sizeof(counts_));
+    count_ = 0;
+    sum_ = 0;
+    max_ = 0;
+}
+
+
+uint64_t Histogram::BucketUpper(size_t i) {
+    const size_t sub = (size_t)1 << kSubBits;
+
+    if(i < sub) {
+        return i;
+    }
+
+    int shift = (int)(i >> kSubBits) - 1;
+    uint64_t lower = (uint64_t)(sub + (i & (sub - 1))) << shift;
+
+    return lower + (((uint64_t)1 << shift) - 1);
+}
+
+
+size_t Histogram::Index(uint64_t value) {
+    const uint64_t sub = (uint64_t)1 << kSubBits;
+
+    if(value < sub) {
+        return (size_t)value;
+    }
+
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - kSubBits;
+
+    return ((size_t)(shift + 1) << kSubBits) + (size_t)((value >> shift) - sub);
+}
+
+
+RollingHistogram::RollingHistogram(int window_sec)
+    : window_sec_(window_sec > 0 ? window_sec : 1), start_(0), current_(0) {
+}
+
+
+void RollingHistogram::Add(uint64_t value, time_t now) {
+    Rotate(now);
+    windows_[current_].Add(value);
+}
+
+
+uint64_t RollingHistogram::Count(time_t now) {
+    Rotate(now);
+    return windows_[0].Count() + windows_[1].Count();
+}
+
+
+uint64_t RollingHistogram::Quantile(double q, time_t now) {
+    Rotate(now);
+
+    const Histogram& a = windows_[0];
+    const Histogram& b = windows_[1];
+    uint64_t count = a.Count() + b.Count();
+    uint64_t max = a.Max() > b.Max() ? a.Max() : b.Max();
+
+    if(count == 0) {
+        return 0;
+    }
+
+    if(q < 0) {
+        q = 0;
+    } else if(q > 1) {
+        q = 1;
+    }
+
+    uint64_t rank = (uint64_t)(q * count);
+    if(rank == 0) {
+        rank = 1;
+    }
+
+    uint64_t seen = 0;
+    for(size_t i = 0; i < Histogram::kBuckets; i++) {
+        seen += a.BucketCount(i) + b.BucketCount(i);
+        if(seen >= rank) {
+            uint64_t upper = Histogram::BucketUpper(i);
+            return upper < max ? upper : max;
+        }
+    }
+
+    return max;
+}
+
+
+/* an idle gap longer than two windows leaves nothing worth keeping */
+void RollingHistogram::Rotate(time_t now) {
+    if(now - start_ < window_sec_) {
+        return;
+    }
+
+    current_ ^= 1;
+    windows_[current_].Reset();
+
+    if(now - start_ >= 2 * window_sec_) {
+        windows_[current_ ^ 1].Reset();
+    }
+
+    start_ = now;
+}
+
+}
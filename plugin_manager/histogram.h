@@ -0,0 +1,81 @@
+#ifndef SHARELIB_PLUGINMANAGER_HISTOGRAM_H_
+#define SHARELIB_PLUGINMANAGER_HISTOGRAM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+namespace sharelib {
+
+/*
+ * Log-linear histogram of non negative values like latency in usec. Values
+ * below 2^kSubBits are kept exactly, above that every power of two range is
+ * split into 2^kSubBits linear buckets, so a bucket is within 1/2^kSubBits of
+ * its values. Add() is lock free and may be called from any thread, readers
+ * get a slightly stale but consistent enough view.
+ */
+class Histogram {
+public:
+    static const int kSubBits = 3;
+    static const size_t kBuckets = (64 - kSubBits + 1) << kSubBits;
+
+    Histogram();
+
+    void Add(uint64_t value);
+
+    uint64_t Count() const { return count_; }
+
+    uint64_t Sum() const { return sum_; }
+
+    uint64_t Max() const { return max_; }
+
+    /* upper bound of the bucket holding quantile q (0..1), 0 if empty */
+    uint64_t Quantile(double q) const;
+
+    void Merge(const Histogram& other);
+
+    void Reset();
+
+    /* samples in bucket i and the largest value going there */
+    uint64_t BucketCount(size_t i) const { return counts_[i]; }
+
+    static uint64_t BucketUpper(size_t i);
+
+    static size_t Index(uint64_t value);
+
+private:
+    uint64_t counts_[kBuckets];
+    uint64_t count_;
+    uint64_t sum_;
+    uint64_t max_;
+};
+
+/*
+ * Histogram of the recent past. Values go to the current window, which 
+ * becomes the previous one after window_sec, quantiles are over both. So
+ * they follow drift within two windows but always have a full window of
+ * samples behind them. Not thread safe, fill and read it on one thread.
+ */
+class RollingHistogram {
+public:
+    explicit RollingHistogram(int window_sec = 10);
+
+    void Add(uint64_t value, time_t now);
+
+    /* samples in the current and previous window */
+    uint64_t Count(time_t now);
+
+    uint64_t Quantile(double q, time_t now);
+
+private:
+    void Rotate(time_t now);
+
+    int window_sec_;
+    time_t start_;
+    int current_;
+    Histogram windows_[2];
+};
+
+}
+
+#endif // end SHARELIB_PLUGINMANAGER_HISTOGRAM_H_
@@ -0,0 +1,596 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#include <iostream>
+
+#include "logger.h"
+
+using namespace std;
+
+namespace sharelib {
+
+/* lines per writev */
+const static int kFlushIov = 256;
+
+/* a thread's lines, it moves head, the writer moves tail */
+struct LogRing {
+    uint64_t head;
+    uint64_t tail;
+    uint64_t dropped;
+    bool closed;                        /* its thread exited */
+    LogRing* next;
+    uint32_t lens[Logger::kRingLines];
+    char lines[Logger::kRingLines][Logger::kMaxLine];
+};
+
+volatile bool Logger::running_ = false;
+volatile bool Logger::stopping_ = false;
+int Logger::level_ = LOG_LEVEL_INFO;
+
+string Logger::path_;
+int Logger::fd_ = -1;
+ino_t Logger::ino_ = 0;
+size_t Logger::rotate_bytes_ = 0;
+int Logger::rotate_sec_ = 0;
+time_t Logger::next_rotate_ = 0;
+
+LogRing* Logger::rings_ = NULL;
+uint64_t Logger::dropped_ = 0;
+uint64_t Logger::reported_ = 0;
+pthread_t Logger::writer_;
+pthread_key_t Logger::ring_key_;
+pthread_mutex_t Logger::mutex_ = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t Logger::cond_ = PTHREAD_COND_INITIALIZER;
+
+static bool ring_keyed = false;
+static bool write_failed = false;       /* reported once until a write succeeds */
+
+static __thread LogRing* this_ring = NULL;
+
+/* line prefix cache of the thread, the pid is reset in a forked child */
+static __thread pid_t line_pid = 0;
+static __thread pid_t line_tid = 0;
+static __thread time_t line_sec = 0;
+static __thread char line_time[24];
+
+static void ForkChild() {
+    line_pid = 0;
+}
+
+static struct ForkReset {
+    ForkReset() { pthread_atfork(NULL, NULL, ForkChild); }
+} fork_reset;
+
+
+/* first rotate_sec boundary after now, in local time */
+static time_t NextBoundary(time_t now, int sec) {
+    struct tm tm;
+
+    localtime_r(&now, &tm);
+    time_t local = now + tm.tm_gmtoff;
+
+    return (local / sec + 1) * sec - tm.tm_gmtoff;
+}
+
+
+const char* Logger::LevelName(int level) {
+    switch(level) {
+    case LOG_LEVEL_DEBUG:
+        return "debug";
+    case LOG_LEVEL_INFO:
+        return "info";
+    case LOG_LEVEL_WARN:
+        return "warn";
+    case LOG_LEVEL_ERROR:
+        return "error";
+    }
+
+    return "unknown";
+}
+
+
+int Logger::Start(const string& path, size_t rotate_bytes, int rotate_sec) {
+    if(running_) {
+        return 0;
+    }
+
+    path_ = path;
+    rotate_bytes_ = rotate_bytes;
+    rotate_sec_ = rotate_sec;
+
+    if(Open() != 0) {
+        return -1;
+    }
+
+    if(rotate_sec_ > 0) {
+        next_rotate_ = NextBoundary(time(NULL), rotate_sec_);
+    }
+
+    if(!ring_keyed) {
+        if(pthread_key_create(&ring_key_, ThreadExit) != 0) {
+            cerr << "logger create key error, errno=" << errno << endl;
+            return -1;
+        }
+        ring_keyed = true;
+    }
+
+    stopping_ = false;
+
+    if(pthread_create(&writer_, NULL, WriterMain, NULL) != 0) {
+        cerr << "logger create thread error, errno=" << errno << endl;
+        close(fd_);
+        fd_ = -1;
+        return -1;
+    }
+
+    running_ = true;
+
+    return 0;
+}
+
+
+void Logger::Stop() {
+    if(!running_) {
+        return;
+    }
+
+    /* lines from now on go to stderr, the writer drains the rings */
+    running_ = false;
+
+    pthread_mutex_lock(&mutex_);
+    stopping_ = true;
+    pthread_cond_signal(&cond_);
+    pthread_mutex_unlock(&mutex_);
+
+    pthread_join(writer_, NULL);
+
+    close(fd_);
+    fd_ = -1;
+}
+
+
+uint64_t Logger::Dropped() {
+    pthread_mutex_lock(&mutex_);
+
+    uint64_t dropped = dropped_;
+    for(LogRing* ring = rings_; ring != NULL; ring = ring->next) {
+        dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(&mutex_);
+
+    return dropped;
+}
+
+
+LogRing* Logger::ThisRing() {
+    if(this_ring != NULL) {
+        return this_ring;
+    }
+
+    LogRing* ring = new LogRing();
+
+    pthread_mutex_lock(&mutex_);
+    ring->next = rings_;
+    __atomic_store_n(&rings_, ring, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&mutex_);
+
+    pthread_setspecific(ring_key_, ring);
+    this_ring = ring;
+
+    return ring;
+}
+
+
+/* the writer frees the ring once drained */
+void Logger::ThreadExit(void* ring) {
+    __atomic_store_n(&((LogRing*)ring)->closed, true, __ATOMIC_RELEASE);
+}
+
+
+void Logger::Write(int level, const char* line, size_t len) {
+    if(!running_) {
+        if(write(STDERR_FILENO, line, len) < 0) {
+            return;
+        }
+        return;
+    }
+
+    LogRing* ring = ThisRing();
+    uint64_t head = ring->head;
+    uint64_t used = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if(used >= kRingLines) {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    size_t slot = head % kRingLines;
+    memcpy(ring->lines[slot], line, len);
+    ring->lens[slot] = len;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    /* the writer would wake up anyway, a missed signal only delays it */
+    if(level >= LOG_LEVEL_ERROR || used + 1 == kRingLines / 2) {
+        pthread_cond_signal(&cond_);
+    }
+}
+
+
+void* Logger::WriterMain(void* arg) {
+    struct timespec ts;
+
+    for(;;) {
+        bool stopping = stopping_;
+
+        if(Flush() == 0 && stopping) {
+            break;
+        }
+
+        uint64_t dropped = Dropped();
+        if(dropped != reported_) {
+            Log(LOG_LEVEL_WARN, "logger dropped lines, ring full")
+                .Field("lines", (unsigned long)(dropped - reported_));
+            reported_ = dropped;
+        }
+
+        pthread_mutex_lock(&mutex_);
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += kFlushMsec * 1000000L;
+        if(ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+
+        if(!stopping_) {
+            pthread_cond_timedwait(&cond_, &mutex_, &ts);
+        }
+
+        pthread_mutex_unlock(&mutex_);
+    }
+
+    return NULL;
+}
+
+
+static void WriteAll(int fd, struct iovec* iov, int n) {
+    while(n > 0) {
+        ssize_t w = writev(fd, iov, n);
+        if(w == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if(w <= 0) {
+            if(!write_failed) {
+                cerr << "logger write error: " << strerror(errno) << endl;
+                write_failed = true;
+            }
+            return;
+        }
+
+        while(n > 0 && (size_t)w >= iov->iov_len) {
+            w -= iov->iov_len;
+            iov++;
+            n--;
+        }
+
+        if(n > 0) {
+            iov->iov_base = (char*)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+
+    write_failed = false;
+}
+
+
+/* @return lines written */
+size_t Logger::Flush() {
+    struct iovec iov[kFlushIov];
+    size_t lines = 0;
+
+    CheckFile(time(NULL));
+
+    LogRing* ring = __atomic_load_n(&rings_, __ATOMIC_ACQUIRE);
+    while(ring != NULL) {
+        /* closed before head is read, so nothing comes after */
+        bool closed = __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE);
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = ring->tail;
+
+        while(tail != head) {
+            int n = 0;
+
+            for(; tail + n != head && n < kFlushIov; n++) {
+                size_t slot = (tail + n) % kRingLines;
+
+                iov[n].iov_base = ring->lines[slot];
+                iov[n].iov_len = ring->lens[slot];
+            }
+
+            WriteAll(fd_, iov, n);
+
+            tail += n;
+            lines += n;
+            __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+        }
+
+        LogRing* next = ring->next;
+
+        if(closed) {
+            pthread_mutex_lock(&mutex_);
+
+            LogRing** p = &rings_;
+            while(*p != ring) {
+                p = &(*p)->next;
+            }
+            *p = next;
+            dropped_ += ring->dropped;
+
+            pthread_mutex_unlock(&mutex_);
+
+            delete ring;
+        }
+
+        ring = next;
+    }
+
+    return lines;
+}
+
+
+int Logger::Open() {
+    struct stat st;
+
+    int fd = open(path_.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(fd == -1) {
+        cerr << "logger can't open " << path_ << ": " << strerror(errno) << endl;
+        return -1;
+    }
+
+    if(fstat(fd, &st) != 0) {
+        cerr << "logger can't stat " << path_ << ": " << strerror(errno) << endl;
+        close(fd);
+        return -1;
+    }
+
+    if(fd_ != -1) {
+        close(fd_);
+    }
+
+    fd_ = fd;
+    ino_ = st.st_ino;
+
+    return 0;
+}
+
+
+/* rotate if due, reopen if the path was moved, by another worker or logrotate */
+void Logger::CheckFile(time_t now) {
+    struct stat st;
+
+    if(rotate_sec_ > 0 && now >= next_rotate_) {
+        next_rotate_ = NextBoundary(now, rotate_sec_);
+        Rotate(now);
+        return;
+    }
+
+    /* the size of the file, other workers' lines included */
+    if(rotate_bytes_ > 0 && fstat(fd_, &st) == 0 && (size_t)st.st_size >= rotate_bytes_) {
+        Rotate(now);
+        return;
+    }
+
+    if(stat(path_.c_str(), &st) != 0 || st.st_ino != ino_) {
+        Open();
+    }
+}
+
+
+void Logger::Rotate(time_t now) {
+    struct stat st;
+    struct tm tm;
+    char suffix[32];
+    char seq[16];
+
+    localtime_r(&now, &tm);
+    strftime(suffix, sizeof(suffix), ".%Y%m%d-%H%M%S", &tm);
+
+    /* the first worker locking renames, the others find the path moved */
+    flock(fd_, LOCK_EX);
+
+    if(stat(path_.c_str(), &st) == 0 && st.st_ino == ino_) {
+        string rotated = path_ + suffix;
+
+        /* rotated by size more than once a second */
+        for(int i = 1; access(rotated.c_str(), F_OK) == 0; i++) {
+            snprintf(seq, sizeof(seq), ".%d", i);
+            rotated = path_ + suffix + seq;
+        }
+
+        if(rename(path_.c_str(), rotated.c_str()) != 0) {
+            cerr << "logger can't rotate " << path_ << ": " << strerror(errno) << endl;
+        }
+    }
+
+    flock(fd_, LOCK_UN);
+
+    Open();
+}
+
+
+Log::Log(int level, const char* message): level_(level), on_(false), len_(0) {
+    if(Logger::Enabled(level)) {
+        Begin(message, strlen(message));
+    }
+}
+
+
+Log::Log(int level, const string& message): level_(level), on_(false), len_(0) {
+    if(Logger::Enabled(level)) {
+        Begin(message.data(), message.size());
+    }
+}
+
+
+Log::~Log() {
+    if(!on_) {
+        return;
+    }
+
+    line_[len_++] = '\n';
+    Logger::Write(level_, line_, len_);
+}
+
+
+void Log::Begin(const char* message, size_t len) {
+    struct timeval tv;
+    struct tm tm;
+
+    gettimeofday(&tv, NULL);
+
+    if(line_sec != tv.tv_sec) {
+        localtime_r(&tv.tv_sec, &tm);
+        strftime(line_time, sizeof(line_time), "%Y/%m/%d %H:%M:%S", &tm);
+        line_sec = tv.tv_sec;
+    }
+
+    if(line_pid == 0) {
+        line_pid = getpid();
+        line_tid = syscall(SYS_gettid);
+    }
+
+    int n = snprintf(line_, sizeof(line_), "%s.%03d [%s] %d#%d: ", line_time,
+            (int)(tv.tv_usec / 1000), Logger::LevelName(level_), (int)line_pid,
+            (int)line_tid);
+
+    on_ = true;
+    len_ = (size_t)n < sizeof(line_) - 1 ? n : sizeof(line_) - 1;
+    Append(message, len);
+}
+
+
+/* keeps room for the '\n' */
+void Log::Append(const char* s, size_t len) {
+    size_t room = sizeof(line_) - 1 - len_;
+
+    if(len > room) {
+        len = room;
+    }
+
+    memcpy(line_ + len_, s, len);
+    len_ += len;
+}
+
+
+void Log::AppendValue(const char* s, size_t len) {
+    bool quote = len == 0;
+
+    for(size_t i = 0; i < len && !quote; i++) {
+        quote = s[i] == ' ' || s[i] == '"' || s[i] == '=' || s[i] == '\\'
+            || s[i] == '\n' || s[i] == '\t';
+    }
+
+    if(!quote) {
+        Append(s, len);
+        return;
+    }
+
+    Append("\"", 1);
+    for(size_t i = 0; i < len; i++) {
+        if(s[i] == '"' || s[i] == '\\') {
+            Append("\\", 1);
+            Append(s + i, 1);
+        } else if(s[i] == '\n') {
+            Append("\\n", 2);
+        } else if(s[i] == '\t') {
+            Append("\\t", 2);
+        } else {
+            Append(s + i, 1);
+        }
+    }
+    Append("\"", 1);
+}
+
+
+Log& Log::Field(const char* key, const char* value) {
+    if(on_) {
+        Append(" ", 1);
+        Append(key, strlen(key));
+        Append("=", 1);
+        AppendValue(value, value != NULL ? strlen(value) : 0);
+    }
+
+    return *this;
+}
+
+
+Log& Log::Field(const char* key, const string& value) {
+    if(on_) {
+        Append(" ", 1);
+        Append(key, strlen(key));
+        Append("=", 1);
+        AppendValue(value.data(), value.size());
+    }
+
+    return *this;
+}
+
+
+Log& Log::Field(const char* key, int value) {
+    return Field(key, (long)value);
+}
+
+
+Log& Log::Field(const char* key, unsigned int value) {
+    return Field(key, (unsigned long)value);
+}
+
+
+Log& Log::Field(const char* key, long value) {
+    char buf[32];
+
+    if(on_) {
+        snprintf(buf, sizeof(buf), "%ld", value);
+        Field(key, (const char*)buf);
+    }
+
+    return *this;
+}
+
+
+Log& Log::Field(const char* key, unsigned long value) {
+    char buf[32];
+
+    if(on_) {
+        snprintf(buf, sizeof(buf), "%lu", value);
+        Field(key, (const char*)buf);
+    }
+
+    return *this;
+}
+
+
+Log& Log::Field(const char* key, double value) {
+    char buf[32];
+
+    if(on_) {
+        snprintf(buf, sizeof(buf), "%.3f", value);
+        Field(key, (const char*)buf);
+    }
+
+    return *this;
+}
+
+}
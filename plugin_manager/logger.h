@@ -0,0 +1,151 @@
+#ifndef SHARELIB_PLUGINMANAGER_LOGGER_H_
+#define SHARELIB_PLUGINMANAGER_LOGGER_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <string>
+
+namespace sharelib {
+
+enum {
+    LOG_LEVEL_DEBUG = 0,
+    LOG_LEVEL_INFO = 1,
+    LOG_LEVEL_WARN = 2,
+    LOG_LEVEL_ERROR = 3
+};
+
+struct LogRing;
+
+/*
+ * Log file written by a thread of its own, so a slow disk or a blocked
+ * stderr doesn't stall the event loop. Each thread logging gets a ring of
+ * lines it fills without locks, the writer drains all rings with one
+ * writev every kFlushMsec, or as soon as a ring is half full or an error
+ * is logged. While a ring is full its lines are dropped and counted.
+ *
+ * Lines of one thread keep their order, lines of different threads are
+ * only roughly ordered by time.
+ *
+ * The file is rotated to "<path>.<YYYYmmdd-HHMMSS>" once it reaches
+ * rotate_bytes or at each rotate_sec boundary of local time, 0 for never.
+ * Workers sharing the file rotate it once between them: the first one
+ * renames it under flock, the others see the path moved to another file and
+ * reopen, as they do after an external logrotate.
+ *
+ * Until Start, and after Stop, lines are written to stderr synchronously.
+ * Start in the process logging, threads don't survive fork.
+ */
+class Logger {
+public:
+    static const size_t kMaxLine = 512;         /* longer lines are cut */
+    static const size_t kRingLines = 2048;      /* per thread */
+    static const int kFlushMsec = 100;
+
+    static int Start(const std::string& path, size_t rotate_bytes, int rotate_sec);
+
+    /* writes out what's queued and joins the writer */
+    static void Stop();
+
+    static bool Running() { return running_; }
+
+    static void SetLevel(int level) { level_ = level; }
+
+    static bool Enabled(int level) { return level >= level_; }
+
+    /* lines dropped on a full ring so far */
+    static uint64_t Dropped();
+
+    static const char* LevelName(int level);
+
+    /* one formatted line, '\n' included */
+    static void Write(int level, const char* line, size_t len);
+
+private:
+    static LogRing* ThisRing();
+
+    static void* WriterMain(void* arg);
+
+    static size_t Flush();
+
+    static int Open();
+
+    static void CheckFile(time_t now);
+
+    static void Rotate(time_t now);
+
+    static void ThreadExit(void* ring);
+
+    static volatile bool running_;
+    static volatile bool stopping_;
+    static int level_;
+
+    static std::string path_;
+    static int fd_;
+    static ino_t ino_;
+    static size_t rotate_bytes_;
+    static int rotate_sec_;
+    static time_t next_rotate_;
+
+    static LogRing* rings_;
+    static uint64_t dropped_;                   /* by threads gone */
+    static uint64_t reported_;                  /* Dropped() last logged */
+    static pthread_t writer_;
+    static pthread_key_t ring_key_;
+    static pthread_mutex_t mutex_;
+    static pthread_cond_t cond_;
+};
+
+
+/*
+ * One line, "<time> [<level>] <pid>#<tid>: <message> key=value...", built
+ * on the stack and queued at the end of the statement:
+ *
+ *      Log(LOG_LEVEL_WARN, "recall timeout").Field("msec", 35).Field("uri", uri);
+ *
+ * Values with spaces, quotes or '=' are quoted. Below the level set nothing
+ * is formatted.
+ */
+class Log {
+public:
+    Log(int level, const char* message);
+
+    Log(int level, const std::string& message);
+
+    ~Log();
+
+    Log& Field(const char* key, const char* value);
+
+    Log& Field(const char* key, const std::string& value);
+
+    Log& Field(const char* key, int value);
+
+    Log& Field(const char* key, unsigned int value);
+
+    Log& Field(const char* key, long value);
+
+    Log& Field(const char* key, unsigned long value);
+
+    Log& Field(const char* key, double value);
+
+private:
+    Log(const Log&);
+    Log& operator=(const Log&);
+
+    void Begin(const char* message, size_t len);
+
+    void Append(const char* s, size_t len);
+
+    void AppendValue(const char* s, size_t len);
+
+    int level_;
+    bool on_;
+    size_t len_;
+    char line_[Logger::kMaxLine];
+};
+
+}
+
+#endif // end SHARELIB_PLUGINMANAGER_LOGGER_H_
@@ -0,0 +1,437 @@
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <new>
+#include <vector>
+
+#include "metrics.h"
+#include "logger.h"
+#include "plugin_config.h"
+
+using namespace std;
+
+namespace sharelib {
+
+const static uint32_t kMetricsMagic = 0x4d455452;
+const static size_t kNameLen = 64;
+const static size_t kLabelsLen = 128;
+const static size_t kValueAlign = 64;               /* no false sharing */
+const static size_t kLocalSize = 1024 * 1024;
+
+const static double kQuantiles[] = {0.5, 0.9, 0.99, 0.999};
+const static char* kQuantileNames[] = {"0.5", "0.9", "0.99", "0.999"};
+const static size_t kQuantileCount = 4;
+
+/*
+ * Region layout: header, entry table, then the values. The entry count is
+ * published with a release store once an entry is complete, readers load it
+ * with acquire and never take the lock.
+ */
+struct MetricsHeader {
+    uint32_t magic;
+    volatile int lock;
+    uint32_t count;
+    uint32_t capacity;
+    uint64_t size;
+    uint64_t used;
+};
+
+struct MetricsEntry {
+    char name[kNameLen];
+    char labels[kLabelsLen];
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t offset;
+};
+
+static MetricsHeader* header = NULL;
+
+/* what failed registrations and unassigned handles update */
+static uint64_t scratch_counter;
+static int64_t scratch_gauge;
+static Histogram scratch_histogram;
+
+
+static MetricsEntry* Entries() {
+    return (MetricsEntry*)(header + 1);
+}
+
+
+static void Lock() {
+    while(__sync_lock_test_and_set(&header->lock, 1)) {
+        sched_yield();
+    }
+}
+
+
+static void Unlock() {
+    __sync_lock_release(&header->lock);
+}
+
+
+int Metrics::Attach(void* base, size_t size) {
+    MetricsHeader* h = (MetricsHeader*)base;
+
+    if(h->magic == kMetricsMagic) {
+        header = h;
+        Log(LOG_LEVEL_INFO, "metrics attached").Field("metrics", h->count);
+        return 0;
+    }
+
+    if(size < sizeof(MetricsHeader) + 16 * (sizeof(MetricsEntry) + kValueAlign)) {
+        Log(LOG_LEVEL_ERROR, "metrics region too small").Field("size", size);
+        return -1;
+    }
+
+    memset(h, 0, sizeof(MetricsHeader));
+    h->capacity = size / 32 / sizeof(MetricsEntry);
+    if(h->capacity < 16) {
+        h->capacity = 16;
+    }
+    h->size = size;
+    h->used = sizeof(MetricsHeader) + h->capacity * sizeof(MetricsEntry);
+    h->magic = kMetricsMagic;
+
+    header = h;
+
+    return 0;
+}
+
+
+uint64_t* Metrics::GetCounter(const string& name, const string& labels) {
+    void* p = Register(COUNTER, name, labels);
+
+    return p ? (uint64_t*)p : &scratch_counter;
+}
+
+
+int64_t* Metrics::GetGauge(const string& name, const string& labels) {
+    void* p = Register(GAUGE, name, labels);
+
+    return p ? (int64_t*)p : &scratch_gauge;
+}
+
+
+Histogram* Metrics::GetHistogram(const string& name, const string& labels) {
+    void* p = Register(HISTOGRAM, name, labels);
+
+    return p ? (Histogram*)p : &scratch_histogram;
+}
+
+
+void* Metrics::Register(Type type, const string& name, const string& labels) {
+    if(header == NULL) {
+        Log(LOG_LEVEL_INFO, "metrics zone not configured, metrics are per process");
+
+        if(Attach(calloc(1, kLocalSize), kLocalSize) != 0) {
+            return NULL;
+        }
+    }
+
+    if(name.empty() || name.length() >= kNameLen || labels.length() >= kLabelsLen) {
+        Log(LOG_LEVEL_ERROR, "metrics invalid name").Field("name", name)
+            .Field("labels", labels);
+        return NULL;
+    }
+
+    char* base = (char*)header;
+    MetricsEntry* entries = Entries();
+    void* p = NULL;
+
+    Lock();
+
+    for(uint32_t i = 0; i < header->count; i++) {
+        MetricsEntry& e = entries[i];
+
+        if(name == e.name && labels == e.labels) {
+            if(e.type == (uint32_t)type) {
+                p = base + e.offset;
+            } else {
+                Log(LOG_LEVEL_ERROR, "metrics registered with another type")
+                    .Field("name", name).Field("labels", labels);
+            }
+
+            Unlock();
+            return p;
+        }
+    }
+
+    size_t len = (type == HISTOGRAM) ? sizeof(Histogram) : sizeof(uint64_t);
+    uint64_t offset = (header->used + kValueAlign - 1) / kValueAlign * kValueAlign;
+
+    if(header->count == header->capacity || offset + len > header->size) {
+        Unlock();
+
+        Log(LOG_LEVEL_ERROR, "metrics region full, not reported").Field("name", name)
+            .Field("labels", labels);
+        return NULL;
+    }
+
+    p = base + offset;
+    if(type == HISTOGRAM) {
+        new (p) Histogram();
+    } else {
+        memset(p, 0, len);
+    }
+
+    MetricsEntry& e = entries[header->count];
+    memset(&e, 0, sizeof(MetricsEntry));
+    memcpy(e.name, name.c_str(), name.length());
+    memcpy(e.labels, labels.c_str(), labels.length());
+    e.type = type;
+    e.offset = offset;
+
+    header->used = offset + len;
+
+    __atomic_store_n(&header->count, header->count + 1, __ATOMIC_RELEASE);
+
+    Unlock();
+
+    return p;
+}
+
+
+static bool EntryLess(const MetricsEntry* a, const MetricsEntry* b) {
+    return strcmp(a->name, b->name) < 0;
+}
+
+
+/* entries grouped by name, in registration order within a name */
+static void SortedEntries(vector<const MetricsEntry*>& sorted) {
+    if(header == NULL) {
+        return;
+    }
+
+    uint32_t count = __atomic_load_n(&header->count, __ATOMIC_ACQUIRE);
+
+    for(uint32_t i = 0; i < count; i++) {
+        sorted.push_back(&Entries()[i]);
+    }
+
+    stable_sort(sorted.begin(), sorted.end(), EntryLess);
+}
+
+
+static void AppendSample(string& out, const char* name, const char* suffix,
+        const char* labels, const char* extra, const char* value) {
+    out += name;
+    out += suffix;
+
+    if(*labels || *extra) {
+        out += '{';
+        out += labels;
+        if(*labels && *extra) {
+            out += ',';
+        }
+        out += extra;
+        out += '}';
+    }
+
+    out += ' ';
+    out += value;
+    out += '\n';
+}
+
+
+void Metrics::WritePrometheus(string& out) {
+    vector<const MetricsEntry*> sorted;
+    char value[32], extra[32];
+
+    SortedEntries(sorted);
+
+    for(size_t i = 0; i < sorted.size(); i++) {
+        const MetricsEntry& e = *sorted[i];
+        const char* p = (const char*)header + e.offset;
+
+        if(i == 0 || strcmp(sorted[i - 1]->name, e.name) != 0) {
+            out += "# TYPE ";
+            out += e.name;
+            out += e.type == COUNTER ? " counter\n"
+                : e.type == GAUGE ? " gauge\n" : " summary\n";
+        }
+
+        if(e.type == COUNTER) {
+            snprintf(value, sizeof(value), "%llu",
+                    (unsigned long long)*(const uint64_t*)p);
+            AppendSample(out, e.name, "", e.labels, "", value);
+            continue;
+        }
+
+        if(e.type == GAUGE) {
+            snprintf(value, sizeof(value), "%lld", (long long)*(const int64_t*)p);
+            AppendSample(out, e.name, "", e.labels, "", value);
+            continue;
+        }
+
+        const Histogram& h = *(const Histogram*)p;
+
+        for(size_t q = 0; q < kQuantileCount; q++) {
+            snprintf(extra, sizeof(extra), "quantile=\"%s\"", kQuantileNames[q]);
+            snprintf(value, sizeof(value), "%llu",
+                    (unsigned long long)h.Quantile(kQuantiles[q]));
+            AppendSample(out, e.name, "", e.labels, extra, value);
+        }
+
+        snprintf(value, sizeof(value), "%llu", (unsigned long long)h.Sum());
+        AppendSample(out, e.name, "_sum", e.labels, "", value);
+
+        snprintf(value, sizeof(value), "%llu", (unsigned long long)h.Count());
+        AppendSample(out, e.name, "_count", e.labels, "", value);
+    }
+}
+
+
+/* a="x",b="y" to {"a":"x","b":"y"}, the value escaping is the same */
+static void AppendJsonLabels(string& out, const char* labels) {
+    const char* p = labels;
+
+    out += '{';
+
+    while(*p) {
+        const char* eq = strchr(p, '=');
+        if(eq == NULL || eq[1] != '"') {
+            break;
+        }
+
+        const char* end = eq + 2;
+        while(*end && !(*end == '"' && end[-1] != '\\')) {
+            end++;
+        }
+
+        if(p != labels) {
+            out += ',';
+        }
+
+        out += '"';
+        out.append(p, eq - p);
+        out += "\":\"";
+        out.append(eq + 2, end - eq - 2);
+        out += '"';
+
+        p = *end ? end + 1 : end;
+        if(*p == ',') {
+            p++;
+        }
+    }
+
+    out += '}';
+}
+
+
+void Metrics::WriteJson(string& out) {
+    vector<const MetricsEntry*> sorted;
+    char value[256];
+
+    SortedEntries(sorted);
+
+    out += "{\"metrics\":[";
+
+    for(size_t i = 0; i < sorted.size(); i++) {
+        const MetricsEntry& e = *sorted[i];
+        const char* p = (const char*)header + e.offset;
+
+        out += i ? ",\n{\"name\":\"" : "\n{\"name\":\"";
+        out += e.name;
+        out += "\",\"labels\":";
+        AppendJsonLabels(out, e.labels);
+
+        if(e.type == COUNTER) {
+            snprintf(value, sizeof(value), ",\"type\":\"counter\",\"value\":%llu}",
+                    (unsigned long long)*(const uint64_t*)p);
+        } else if(e.type == GAUGE) {
+            snprintf(value, sizeof(value), ",\"type\":\"gauge\",\"value\":%lld}",
+                    (long long)*(const int64_t*)p);
+        } else {
+            const Histogram& h = *(const Histogram*)p;
+
+            snprintf(value, sizeof(value), ",\"type\":\"histogram\",\"count\":%llu,"
+                    "\"sum\":%llu,\"max\":%llu,\"p50\":%llu,\"p90\":%llu,"
+                    "\"p99\":%llu,\"p999\":%llu}",
+                    (unsigned long long)h.Count(), (unsigned long long)h.Sum(),
+                    (unsigned long long)h.Max(),
+                    (unsigned long long)h.Quantile(0.5),
+                    (unsigned long long)h.Quantile(0.9),
+                    (unsigned long long)h.Quantile(0.99),
+                    (unsigned long long)h.Quantile(0.999));
+        }
+
+        out += value;
+    }
+
+    out += "\n]}\n";
+}
+
+
+Counter::Counter(): value_(&scratch_counter) {
+}
+
+
+Counter::Counter(const string& name, const string& labels)
+    : value_(Metrics::GetCounter(name, labels)) {
+}
+
+
+Gauge::Gauge(): value_(&scratch_gauge) {
+}
+
+
+Gauge::Gauge(const string& name, const string& labels)
+    : value_(Metrics::GetGauge(name, labels)) {
+}
+
+
+HistogramMetric::HistogramMetric(): histogram_(&scratch_histogram) {
+}
+
+
+HistogramMetric::HistogramMetric(const string& name, const string& labels)
+    : histogram_(Metrics::GetHistogram(name, labels)) {
+}
+
+
+MetricsScope::MetricsScope(const map<string, string>& config_map) {
+    map<string, string>::const_iterator it = config_map.find(HTTP_REQUEST_PLUGINNAME);
+
+    if(it != config_map.end()) {
+        plugin_ = it->second;
+    }
+}
+
+
+MetricsScope::MetricsScope(const string& plugin): plugin_(plugin) {
+}
+
+
+Counter MetricsScope::NewCounter(const string& name, const string& labels) {
+    return Counter(name, Labels(labels));
+}
+
+
+Gauge MetricsScope::NewGauge(const string& name, const string& labels) {
+    return Gauge(name, Labels(labels));
+}
+
+
+HistogramMetric MetricsScope::NewHistogram(const string& name, const string& labels) {
+    return HistogramMetric(name, Labels(labels));
+}
+
+
+string MetricsScope::Labels(const string& labels) const {
+    if(plugin_.empty()) {
+        return labels;
+    }
+
+    string scoped = "plugin=\"" + plugin_ + "\"";
+    if(!labels.empty()) {
+        scoped += "," + labels;
+    }
+
+    return scoped;
+}
+
+}
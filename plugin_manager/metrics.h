@@ -0,0 +1,155 @@
+#ifndef SHARELIB_PLUGINMANAGER_METRICS_H_
+#define SHARELIB_PLUGINMANAGER_METRICS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <string>
+
+#include "histogram.h"
+
+namespace sharelib {
+
+/*
+ * Counters, gauges and histograms kept in one memory region. In nginx the
+ * region is the plugin_manager_metrics_zone shared by all workers, attached
+ * by the master before it forks, so every worker adds to the same values.
+ * Without a zone a process local region is used.
+ *
+ * A metric is identified by name and labels, the labels in Prometheus
+ * syntax without braces:
+ *
+ *      uint64_t* hits = Metrics::GetCounter("adfront_cache_hits_total",
+ *              "plugin=\"recall\"");
+ *      ...
+ *      __sync_fetch_and_add(hits, 1);
+ *
+ * Registering the same metric again returns the same storage. Registration
+ * takes a spin lock in the region, so do it once at init, updates are plain
+ * atomics. The returned pointers stay valid for the life of the process; if
+ * the region is full they point to a scratch value nobody reports.
+ */
+class Metrics {
+public:
+    enum Type {
+        COUNTER = 1,
+        GAUGE,
+        HISTOGRAM
+    };
+
+    /* lay out the region, or take over the metrics already in it */
+    static int Attach(void* base, size_t size);
+
+    static uint64_t* GetCounter(const std::string& name,
+            const std::string& labels = "");
+
+    static int64_t* GetGauge(const std::string& name,
+            const std::string& labels = "");
+
+    static Histogram* GetHistogram(const std::string& name,
+            const std::string& labels = "");
+
+    /* Prometheus text format, histograms as summaries */
+    static void WritePrometheus(std::string& out);
+
+    static void WriteJson(std::string& out);
+
+private:
+    static void* Register(Type type, const std::string& name,
+            const std::string& labels);
+};
+
+/*
+ * Handles plugins keep to publish their own metrics. Create them once, in
+ * Plugin::Init, updates are relaxed atomics on the zone and add up across
+ * workers. A default constructed handle works but isn't reported.
+ */
+class Counter {
+public:
+    Counter();
+
+    Counter(const std::string& name, const std::string& labels = "");
+
+    void Add(uint64_t n = 1) { __atomic_fetch_add(value_, n, __ATOMIC_RELAXED); }
+
+    uint64_t Value() const { return __atomic_load_n(value_, __ATOMIC_RELAXED); }
+
+private:
+    uint64_t* value_;
+};
+
+/*
+ * Workers share one value: Add/Sub for things that add up like items in
+ * use, Set only if any worker's view will do, e.g. a config version.
+ */
+class Gauge {
+public:
+    Gauge();
+
+    Gauge(const std::string& name, const std::string& labels = "");
+
+    void Set(int64_t v) { __atomic_store_n(value_, v, __ATOMIC_RELAXED); }
+
+    void Add(int64_t n = 1) { __atomic_fetch_add(value_, n, __ATOMIC_RELAXED); }
+
+    void Sub(int64_t n = 1) { __atomic_fetch_sub(value_, n, __ATOMIC_RELAXED); }
+
+    int64_t Value() const { return __atomic_load_n(value_, __ATOMIC_RELAXED); }
+
+private:
+    int64_t* value_;
+};
+
+/* distribution of latencies, sizes or counts, see Histogram for precision */
+class HistogramMetric {
+public:
+    HistogramMetric();
+
+    HistogramMetric(const std::string& name, const std::string& labels = "");
+
+    void Record(uint64_t value) { histogram_->Add(value); }
+
+    const Histogram& Get() const { return *histogram_; }
+
+private:
+    Histogram* histogram_;
+};
+
+/*
+ * A plugin's metrics, labelled plugin="<its first name>" ahead of their own
+ * labels so plugins sharing a metric name stay apart:
+ *
+ *      int Recall::Init(const STR_MAP& config_map) {
+ *          MetricsScope metrics(config_map);
+ *
+ *          cache_hits_ = metrics.NewCounter("recall_cache_hits_total");
+ *          candidates_ = metrics.NewHistogram("recall_candidates");
+ *          ...
+ *      }
+ *
+ *      cache_hits_.Add();
+ *      candidates_.Record(ads.size());
+ */
+class MetricsScope {
+public:
+    explicit MetricsScope(const std::map<std::string, std::string>& config_map);
+
+    explicit MetricsScope(const std::string& plugin);
+
+    Counter NewCounter(const std::string& name, const std::string& labels = "");
+
+    Gauge NewGauge(const std::string& name, const std::string& labels = "");
+
+    HistogramMetric NewHistogram(const std::string& name, 
+            const std::string& labels = "");
+
+private:
+    std::string Labels(const std::string& labels) const;
+
+    std::string plugin_;
+};
+
+}
+
+#endif // end SHARELIB_PLUGINMANAGER_METRICS_H_
@@ -0,0 +1,126 @@
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+
+#include "perf_counters.h"
+#include "logger.h"
+
+using namespace std;
+
+namespace sharelib {
+
+static const char* kEventNames[PerfCounters::kCount] = {
+    "cycles", "instructions", "llc_misses", "branch_misses"
+};
+
+static const uint64_t kEventConfigs[PerfCounters::kCount] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES
+};
+
+
+static int PerfEventOpen(uint64_t config, int group_fd) {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.disabled = group_fd == -1;     /* the leader enables the group */
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+
+const char* PerfCounters::Name(int event) {
+    return event >= 0 && event < kCount ? kEventNames[event] : "";
+}
+
+
+PerfCounters::PerfCounters(): opened_(0) {
+    for(int i = 0; i < kCount; i++) {
+        fds_[i] = -1;
+        index_[i] = -1;
+    }
+}
+
+
+PerfCounters::~PerfCounters() {
+    Close();
+}
+
+
+int PerfCounters::Open() {
+    Close();
+
+    fds_[CYCLES] = PerfEventOpen(kEventConfigs[CYCLES], -1);
+    if(fds_[CYCLES] == -1) {
+        Log(LOG_LEVEL_WARN, "perf_event_open cycles error").Field("error", strerror(errno));
+        return -1;
+    }
+    index_[CYCLES] = opened_++;
+
+    for(int i = CYCLES + 1; i < kCount; i++) {
+        fds_[i] = PerfEventOpen(kEventConfigs[i], fds_[CYCLES]);
+        if(fds_[i] == -1) {
+            Log(LOG_LEVEL_WARN, "perf_event_open error, reads as 0")
+                .Field("event", kEventNames[i]).Field("error", strerror(errno));
+            continue;
+        }
+        index_[i] = opened_++;
+    }
+
+    if(ioctl(fds_[CYCLES], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP) == -1) {
+        Log(LOG_LEVEL_WARN, "perf_event enable error").Field("error", strerror(errno));
+        Close();
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void PerfCounters::Close() {
+    for(int i = kCount - 1; i >= 0; i--) {
+        if(fds_[i] != -1) {
+            close(fds_[i]);
+        }
+        fds_[i] = -1;
+        index_[i] = -1;
+    }
+
+    opened_ = 0;
+}
+
+
+int PerfCounters::Read(uint64_t values[kCount]) const {
+    uint64_t buf[1 + kCount];
+
+    if(opened_ == 0) {
+        return -1;
+    }
+
+    /* { nr, value[nr] } for PERF_FORMAT_GROUP */
+    ssize_t n = read(fds_[CYCLES], buf, sizeof(buf));
+    if(n < (ssize_t)((1 + opened_) * sizeof(uint64_t))) {
+        return -1;
+    }
+
+    for(int i = 0; i < kCount; i++) {
+        values[i] = index_[i] == -1 ? 0 : buf[1 + index_[i]];
+    }
+
+    return 0;
+}
+
+}
@@ -0,0 +1,60 @@
+#ifndef SHARELIB_PLUGINMANAGER_PERF_COUNTERS_H_
+#define SHARELIB_PLUGINMANAGER_PERF_COUNTERS_H_
+
+#include <stdint.h>
+
+namespace sharelib {
+
+/*
+ * Hardware counters of the calling thread through perf_event_open, read all
+ * at once as one group. Take a reading before and after a piece of code, the
+ * difference is what it cost on this thread:
+ *
+ *      uint64_t before[PerfCounters::kCount], after[PerfCounters::kCount];
+ *
+ *      counters.Read(before);
+ *      ...
+ *      counters.Read(after);
+ *
+ * Open and Read on the same thread. Events the CPU or VM doesn't have read
+ * as 0. Needs kernel.perf_event_paranoid <= 2 or CAP_SYS_ADMIN.
+ */
+class PerfCounters {
+public:
+    enum Event {
+        CYCLES = 0,
+        INSTRUCTIONS,
+        LLC_MISSES,
+        BRANCH_MISSES
+    };
+
+    static const int kCount = 4;
+
+    /* metric name of the event, e.g. "cycles" */
+    static const char* Name(int event);
+
+    PerfCounters();
+
+    ~PerfCounters();
+
+    /* 0 if at least cycles could be opened */
+    int Open();
+
+    void Close();
+
+    int Read(uint64_t values[kCount]) const;
+
+private:
+    PerfCounters(const PerfCounters&);
+
+    PerfCounters& operator=(const PerfCounters&);
+
+private:
+    int fds_[kCount];
+    int index_[kCount];     /* position in the group read, -1 if not opened */
+    int opened_;
+};
+
+}
+
+#endif // end SHARELIB_PLUGINMANAGER_PERF_COUNTERS_H_
@@ -5,12 +5,37 @@
 #include <vector>
 #include <map>
 #include <memory>
+#include <stdint.h>
+#include <sys/time.h>
+
+#include "plugin_config.h"
+#include "logger.h"
+#include "trace.h"
 
 
 namespace sharelib{
 
 typedef std::map<std::string, std::string> STR_MAP;
 
+class TaskScheduler;
+struct PluginContext;
+struct UpstreamRequest;
+
+/* 
+ * Builds a dependent upstream request from the responses of its deps_,
+ * called right before the request is sent. It mustn't add requests.
+ */
+class UpstreamBuilder {
+    public:
+        virtual ~UpstreamBuilder() {}
+
+        /* 
+         * fill in req.args_ and req.uri_ or req.endpoint_, non PLUGIN_OK skips
+         * req and its dependents
+         */
+        virtual int Build(PluginContext &ctx, UpstreamRequest &req) = 0;
+};
+
 
 /* Derive this class to define your own handle context */
 class HandleBaseCtx {
@@ -21,21 +46,90 @@ class HandleBaseCtx {
 /* Upstream request */
 struct UpstreamRequest {
     UpstreamRequest(const std::string& uri, const std::string& args)
-        : uri_(uri), args_(args) {}
+        : status_(0), up_sec_(0), up_msec_(0), queue_usec_(0), connect_usec_(0),
+          header_usec_(0), total_usec_(0), bytes_(0), done_(false), uri_(uri), args_(args),
+          endpoint_(-1), connect_timeout_msec_(0), read_timeout_msec_(0),
+          priority_(UPSTREAM_PRIORITY_NORMAL), builder_(NULL) {}
+
+    /* endpoint id from Endpoints::Register, see endpoint.h */
+    UpstreamRequest(int endpoint, const std::string& args)
+        : status_(0), up_sec_(0), up_msec_(0), queue_usec_(0), connect_usec_(0),
+          header_usec_(0), total_usec_(0), bytes_(0), done_(false), args_(args),
+          endpoint_(endpoint), connect_timeout_msec_(0), read_timeout_msec_(0),
+          priority_(UPSTREAM_PRIORITY_NORMAL), builder_(NULL) {}
 
     int status_;                /* http status code */
     time_t up_sec_;
     time_t up_msec_;            
 
+    /* 
+     * Timing breakdown in usec, 0 if not measured. queue is from creating 
+     * the subrequest to its location's content handler, connect and header
+     * count from there, total spans the whole subrequest.
+     */
+    int64_t queue_usec_;
+    int64_t connect_usec_;
+    int64_t header_usec_;
+    int64_t total_usec_;
+    size_t bytes_;              /* received from upstream, header included */
+    std::string peer_;          /* upstream address */
+    bool done_;                 /* false if given up by wait any */
+
     std::string uri_;
     std::string args_;
     std::string response_;
+
+    int endpoint_;              /* -1 if sent to uri_ */
+
+    /* 
+     * Override the location's proxy_*_timeout for this request, 0 keeps it.
+     * Under overload UPSTREAM_PRIORITY_LOW requests are dropped first, then
+     * NORMAL ones; a dropped request has status_ 503 and done_ false.
+     */
+    int connect_timeout_msec_;
+    int read_timeout_msec_;
+    int priority_;
+
+    /* 
+     * Indexes of earlier upstream_request_ entries this one waits for. It's
+     * sent as soon as they're done instead of waiting for the whole round.
+     */
+    std::vector<size_t> deps_;
+    UpstreamBuilder* builder_;  /* not owned, NULL if uri_/args_ are fixed */
+
+    /* 
+     * Name of a local plugin to call in process with args_ instead of an
+     * http subrequest to uri_, its handle_result_ comes back as response_.
+     */
+    std::string plugin_;
 };
 
 /* If a http request has subrequests, it will be dispatched for multiple times, 
  * so we need a context to keep its infomation at run-time.
  */
 struct PluginContext {
+    PluginContext(): slice_start_usec_(0), task_scheduler_(NULL), wait_any_(false),
+        alloc_count_(0), alloc_bytes_(0) {}
+
+    /* 
+     * Long-running plugin checks it in its loop, once the time slice is used
+     * up it saves its position in handle_ctx_ and returns PLUGIN_YIELD. 
+     */
+    bool SliceExpired() const {
+        struct timeval tv;
+
+        gettimeofday(&tv, NULL);
+        return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec 
+            - slice_start_usec_ >= PLUGIN_SLICE_USEC;
+    }
+
+    void StartSlice() {
+        struct timeval tv;
+
+        gettimeofday(&tv, NULL);
+        slice_start_usec_ = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    }
+
     /* Since there is no good way to predefine common interface for all 
      * dynamic library, you may need a 
      *      HandleCtx* ctx = dynmaic_cast<HandleCtx*>(handle_ctx.get()); 
@@ -48,9 +142,39 @@ struct PluginContext {
 
     std::vector<UpstreamRequest> upstream_request_;                   
 
+    /* 
+     * Fire-and-forget requests like impression or win notice, may be added
+     * in any phase. They're sent once the response has been written, and
+     * their responses are dropped. Only uri_/args_ are used. The request
+     * waits for them though: it's logged and its connection kept alive only
+     * after the last one is done, so a client reusing the connection waits.
+     */
+    std::vector<UpstreamRequest> detached_request_;
+
     std::string handle_result_;     /* hanle's final result as http response */
 
     std::string time_stamp_;        /* time stamp for log */
+
+    int64_t slice_start_usec_;      /* start of current Handle call */
+
+    /* 
+     * Set while the plugin runs on an offload thread, fan out with a
+     * TaskGroup (see task_scheduler.h). NULL in the event loop.
+     */
+    TaskScheduler* task_scheduler_;
+
+    /* PLUGIN_AGAIN resumes on first subrequest done, not on all of them */
+    bool wait_any_;
+
+    /* malloc calls of the plugin for this request, see alloc_tracker.h */
+    uint64_t alloc_count_;
+    uint64_t alloc_bytes_;
+
+    /* 
+     * Trace context, sent on with subrequests. Plugin spans go into it with
+     * ScopedSpan, see trace.h, and are dropped unless it's sampled.
+     */
+    Trace trace_;
 };
 
 
@@ -66,10 +190,24 @@ class Plugin {
          * PLUGIN_OK        Plugin process request success.
          * PLUGIN_ERROR     Plugin process request fail.
          * PLUGIN_AGAIN     Requesst isn't finished, there are subrequests to be processed.
+         *                  PostSubHandle is called once all of them, including 
+         *                  the dependent ones, are done.
+         * PLUGIN_YIELD     Time slice used up, call me again on next event loop tick.
          */
         virtual int Handle(PluginContext &ctx) = 0;
 
         virtual int PostSubHandle(PluginContext &ctx) = 0;
+
+        /*
+         * Handle n requests at once, rcs[i] gets the Handle return code of
+         * ctxs[i]. Override it to score requests together, by default each
+         * request goes through Handle alone.
+         */
+        virtual void HandleBatch(PluginContext **ctxs, int *rcs, size_t n) {
+            for(size_t i = 0; i < n; i++) {
+                rcs[i] = Handle(*ctxs[i]);
+            }
+        }
 };
 
 
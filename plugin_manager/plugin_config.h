@@ -6,6 +6,15 @@
 #define PLUGIN_AGAIN        -2
 
 #define PLUGIN_NOT_FOUND    -3
+#define PLUGIN_YIELD        -4
+
+/* time slice of a yielding plugin, see PluginContext::SliceExpired */
+#define PLUGIN_SLICE_USEC   1000
+
+/* UpstreamRequest::priority_, lower ones are dropped first under overload */
+#define UPSTREAM_PRIORITY_HIGH      0   /* never dropped */
+#define UPSTREAM_PRIORITY_NORMAL    1
+#define UPSTREAM_PRIORITY_LOW       2
 
 #define PLUGIN_MANAGER_CONF             "__plugin_manager_conf__"
 #define PLUGIN_CONF                     "__plugin_conf__"
@@ -1,5 +1,4 @@
 #include <dlfcn.h>
-#include <iostream>
 #include <fstream>
 #include <sstream>
 #include <utility>
@@ -17,7 +16,7 @@ const static string kStringSeparator = "=";
 typedef Plugin *(*CreatePluginFunc)();
 
 
-PluginManager::PluginManager() {
+PluginManager::PluginManager(): has_offload_(false) {
 }
 
 
@@ -29,22 +28,22 @@ int PluginManager::Init(const string& config_file) {
     string config_str;
 
     if(config_file.empty()) {
-        cerr << "plugin_manager config_file empty" << endl;
+        Log(LOG_LEVEL_ERROR, "plugin_manager config_file empty");
         return -1;
     }
 
     if(ReadFileContent(config_file, config_str) != 0) {
-        cerr << "plugin_manager open " << config_file << " error" << endl;
+        Log(LOG_LEVEL_ERROR, "plugin_manager open error").Field("path", config_file);
         return -1;
     }
 
     bool rc = google::protobuf::TextFormat::ParseFromString(config_str, &config_obj_);
     if (!rc) {
-        cerr << "plugin_manager parse " << config_file << " error" << endl;
+        Log(LOG_LEVEL_ERROR, "plugin_manager parse error").Field("path", config_file);
         return -1;
     }
 
-    cout << "plugin_manager read " << config_file << " success" << endl;
+    Log(LOG_LEVEL_INFO, "plugin_manager read config").Field("path", config_file);
 
     plugin_mananger_conf_ = config_file;
 
@@ -58,8 +57,8 @@ int PluginManager::LoadPlugin(PluginInfoPtr &plugin_info) {
 
     void *so_handler = dlopen(so_path.c_str(), RTLD_LAZY);
     if (so_handler == NULL) {
-        cerr << "plugin_manager dlopen path=" << so_path 
-            << ", error=" << dlerror() << endl; 
+        Log(LOG_LEVEL_ERROR, "plugin_manager dlopen error")
+            .Field("path", so_path).Field("error", dlerror());
 
         return -1;
     }
@@ -68,8 +67,8 @@ int PluginManager::LoadPlugin(PluginInfoPtr &plugin_info) {
     handler = (CreatePluginFunc)dlsym(so_handler, kCreatePluginFunc.c_str());
     if (handler == NULL) {
         dlclose(so_handler);
-        cerr << "plugin_manager dlsym path=" << so_path
-            << ", error=" << dlerror() << endl;
+        Log(LOG_LEVEL_ERROR, "plugin_manager dlsym error")
+            .Field("path", so_path).Field("error", dlerror());
 
         return -1;
     }
@@ -78,14 +77,14 @@ int PluginManager::LoadPlugin(PluginInfoPtr &plugin_info) {
 
     if (plugin == NULL) {
         dlclose(so_handler);
-        cerr << "plugin_manager create_instance path=" << so_path << endl;
+        Log(LOG_LEVEL_ERROR, "plugin_manager create_instance error").Field("path", so_path);
 
         return -1;
     }
 
     int rc = plugin->Init(plugin_info->conf_map);
     if(rc != 0) {
-        cerr << "plugin_manager plugin init error" << so_path << endl;
+        Log(LOG_LEVEL_ERROR, "plugin_manager plugin init error").Field("path", so_path);
         
         return -1;
     }
@@ -97,8 +96,8 @@ int PluginManager::LoadPlugin(PluginInfoPtr &plugin_info) {
 
 
 int PluginManager::LoadPlugins() {
-    cout << "plugin_manager load plugins " << PLUGIN_MANAGER_CONF 
-            << " : " << plugin_mananger_conf_ << endl;
+    Log(LOG_LEVEL_INFO, "plugin_manager load plugins")
+        .Field("path", plugin_mananger_conf_);
 
     for (int i = 0; i < config_obj_.plugin_conf_list_size(); ++i) {
         PluginInfoPtr plugin_info_ptr(new PluginInfo());
@@ -106,9 +105,13 @@ int PluginManager::LoadPlugins() {
         plugin_info_ptr->plugin_conf = config_obj_.plugin_conf_list(i);
         plugin_info_ptr->conf_map[PLUGIN_CONF] = plugin_info_ptr->plugin_conf.conf_path();
         plugin_info_ptr->conf_map[PLUGIN_MANAGER_CONF] = plugin_mananger_conf_;
+        if (plugin_info_ptr->plugin_conf.name_size() > 0) {
+            /* lets MetricsScope label the plugin's metrics */
+            plugin_info_ptr->conf_map[HTTP_REQUEST_PLUGINNAME] = plugin_info_ptr->plugin_conf.name(0);
+        }
 
-        cout << "plugin_manager plugin " << PLUGIN_CONF  
-            << " : " << plugin_info_ptr->conf_map[PLUGIN_CONF] << endl;
+        Log(LOG_LEVEL_INFO, "plugin_manager plugin")
+            .Field("conf", plugin_info_ptr->conf_map[PLUGIN_CONF]);
 
         for (int j = 0; j < plugin_info_ptr->plugin_conf.key_val_list_size(); ++j) {
             string key_val = plugin_info_ptr->plugin_conf.key_val_list(j);
@@ -117,11 +120,16 @@ int PluginManager::LoadPlugins() {
 
         int rc = LoadPlugin(plugin_info_ptr);
         if (rc != 0) {
-            cout << "plugin_manager load plugin error" << endl;
+            Log(LOG_LEVEL_ERROR, "plugin_manager load plugin error");
 
             return -1;
         }
 
+        if (plugin_info_ptr->plugin_conf.offload()) {
+            Log(LOG_LEVEL_INFO, "plugin_manager plugin offload to thread pool");
+            has_offload_ = true;
+        }
+
         for (int j = 0; j < plugin_info_ptr->plugin_conf.name_size(); ++j){
             plugins_info_map_.insert(make_pair<string, PluginInfoPtr>(
                         plugin_info_ptr->plugin_conf.name(j), 
@@ -141,6 +149,16 @@ Plugin *PluginManager::GetPlugin(const string &queryName) {
 }
 
 
+bool PluginManager::IsOffload(const string &queryName) {
+    PluginInfoPtrMap::iterator it = plugins_info_map_.find(queryName);
+    if (it == plugins_info_map_.end()) {
+        return false;
+    }
+
+    return it->second->plugin_conf.offload();
+}
+
+
 int PluginManager::ReadFileContent(const string& config_file, string &content) {
     ifstream fin(config_file.c_str());
     if (!fin.is_open()) { 
@@ -37,12 +37,13 @@ void protobuf_AssignDesc_plugin_5fmanager_2econf_2eproto() {
       "plugin_manager.conf.proto");
   GOOGLE_CHECK(file != NULL);
   PluginConf_descriptor_ = file->message_type(0);
-  static const int PluginConf_offsets_[5] = {
+  static const int PluginConf_offsets_[6] = {
     GOOGLE_PROTOBUF_GENERATED_MESSAGE_FIELD_OFFSET(PluginConf, name_),
     GOOGLE_PROTOBUF_GENERATED_MESSAGE_FIELD_OFFSET(PluginConf, so_home_path_),
     GOOGLE_PROTOBUF_GENERATED_MESSAGE_FIELD_OFFSET(PluginConf, so_name_),
     GOOGLE_PROTOBUF_GENERATED_MESSAGE_FIELD_OFFSET(PluginConf, conf_path_),
     GOOGLE_PROTOBUF_GENERATED_MESSAGE_FIELD_OFFSET(PluginConf, key_val_list_),
+    GOOGLE_PROTOBUF_GENERATED_MESSAGE_FIELD_OFFSET(PluginConf, offload_),
   };
   PluginConf_reflection_ =
     new ::google::protobuf::internal::GeneratedMessageReflection(
@@ -104,12 +105,12 @@ void protobuf_AddDesc_plugin_5fmanager_2econf_2eproto() {
   GOOGLE_PROTOBUF_VERIFY_VERSION;
 
   ::google::protobuf::DescriptorPool::InternalAddGeneratedFile(
-    "\n\031plugin_manager.conf.proto\022\010sharelib\"j\n"
+    "\n\031plugin_manager.conf.proto\022\010sharelib\"{\n"
     "\nPluginConf\022\014\n\004name\030\001 \003(\t\022\024\n\014so_home_pat"
     "h\030\002 \002(\t\022\017\n\007so_name\030\003 \002(\t\022\021\n\tconf_path\030\004 "
-    "\002(\t\022\024\n\014key_val_list\030\005 \003(\t\"C\n\021PluginManag"
-    "erConf\022.\n\020plugin_conf_list\030\001 \003(\0132\024.share"
-    "lib.PluginConf", 214);
+    "\002(\t\022\024\n\014key_val_list\030\005 \003(\t\022\017\n\007offload\030\006 \001"
+    "(\010\"C\n\021PluginManagerConf\022.\n\020plugin_conf_l"
+    "ist\030\001 \003(\0132\024.sharelib.PluginConf", 231);
   ::google::protobuf::MessageFactory::InternalRegisterGeneratedFile(
     "plugin_manager.conf.proto", &protobuf_RegisterTypes);
   PluginConf::default_instance_ = new PluginConf();
@@ -134,6 +135,7 @@ const int PluginConf::kSoHomePathFieldNumber;
 const int PluginConf::kSoNameFieldNumber;
 const int PluginConf::kConfPathFieldNumber;
 const int PluginConf::kKeyValListFieldNumber;
+const int PluginConf::kOffloadFieldNumber;
 #endif  // !_MSC_VER
 
 PluginConf::PluginConf()
@@ -155,6 +157,7 @@ void PluginConf::SharedCtor() {
   so_home_path_ = const_cast< ::std::string*>(&::google::protobuf::internal::kEmptyString);
   so_name_ = const_cast< ::std::string*>(&::google::protobuf::internal::kEmptyString);
   conf_path_ = const_cast< ::std::string*>(&::google::protobuf::internal::kEmptyString);
+  offload_ = false;
   ::memset(_has_bits_, 0, sizeof(_has_bits_));
 }
 
@@ -214,6 +217,7 @@ void PluginConf::Clear() {
         conf_path_->clear();
       }
     }
+    offload_ = false;
   }
   name_.Clear();
   key_val_list_.Clear();
@@ -312,6 +316,22 @@ bool PluginConf::MergePartialFromCodedStream(
           goto handle_uninterpreted;
         }
         if (input->ExpectTag(42)) goto parse_key_val_list;
+        if (input->ExpectTag(48)) goto parse_offload;
+        break;
+      }
+
+      // optional bool offload = 6;
+      case 6: {
+        if (::google::protobuf::internal::WireFormatLite::GetTagWireType(tag) ==
+            ::google::protobuf::internal::WireFormatLite::WIRETYPE_VARINT) {
+         parse_offload:
+          DO_((::google::protobuf::internal::WireFormatLite::ReadPrimitive<
+                   bool, ::google::protobuf::internal::WireFormatLite::TYPE_BOOL>(
+                 input, &offload_)));
+          set_has_offload();
+        } else {
+          goto handle_uninterpreted;
+        }
         if (input->ExpectAtEnd()) return true;
         break;
       }
@@ -379,6 +399,11 @@ void PluginConf::SerializeWithCachedSizes(
       5, this->key_val_list(i), output);
   }
 
+  // optional bool offload = 6;
+  if (has_offload()) {
+    ::google::protobuf::internal::WireFormatLite::WriteBool(6, this->offload(), output);
+  }
+
   if (!unknown_fields().empty()) {
     ::google::protobuf::internal::WireFormat::SerializeUnknownFields(
         unknown_fields(), output);
@@ -435,6 +460,11 @@ void PluginConf::SerializeWithCachedSizes(
       WriteStringToArray(5, this->key_val_list(i), target);
   }
 
+  // optional bool offload = 6;
+  if (has_offload()) {
+    target = ::google::protobuf::internal::WireFormatLite::WriteBoolToArray(6, this->offload(), target);
+  }
+
   if (!unknown_fields().empty()) {
     target = ::google::protobuf::internal::WireFormat::SerializeUnknownFieldsToArray(
         unknown_fields(), target);
@@ -467,6 +497,11 @@ int PluginConf::ByteSize() const {
           this->conf_path());
     }
 
+    // optional bool offload = 6;
+    if (has_offload()) {
+      total_size += 1 + 1;
+    }
+
   }
   // repeated string name = 1;
   total_size += 1 * this->name_size();
@@ -519,6 +554,9 @@ void PluginConf::MergeFrom(const PluginConf& from) {
     if (from.has_conf_path()) {
       set_conf_path(from.conf_path());
     }
+    if (from.has_offload()) {
+      set_offload(from.offload());
+    }
   }
   mutable_unknown_fields()->MergeFrom(from.unknown_fields());
 }
@@ -548,6 +586,7 @@ void PluginConf::Swap(PluginConf* other) {
     std::swap(so_name_, other->so_name_);
     std::swap(conf_path_, other->conf_path_);
     key_val_list_.Swap(&other->key_val_list_);
+    std::swap(offload_, other->offload_);
     std::swap(_has_bits_[0], other->_has_bits_[0]);
     _unknown_fields_.Swap(&other->_unknown_fields_);
     std::swap(_cached_size_, other->_cached_size_);
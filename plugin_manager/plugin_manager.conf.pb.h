@@ -160,6 +160,13 @@ class PluginConf : public ::google::protobuf::Message {
   inline const ::google::protobuf::RepeatedPtrField< ::std::string>& key_val_list() const;
   inline ::google::protobuf::RepeatedPtrField< ::std::string>* mutable_key_val_list();
 
+  // optional bool offload = 6;
+  inline bool has_offload() const;
+  inline void clear_offload();
+  static const int kOffloadFieldNumber = 6;
+  inline bool offload() const;
+  inline void set_offload(bool value);
+
   // @@protoc_insertion_point(class_scope:sharelib.PluginConf)
  private:
   inline void set_has_so_home_path();
@@ -168,6 +175,8 @@ class PluginConf : public ::google::protobuf::Message {
   inline void clear_has_so_name();
   inline void set_has_conf_path();
   inline void clear_has_conf_path();
+  inline void set_has_offload();
+  inline void clear_has_offload();
 
   ::google::protobuf::UnknownFieldSet _unknown_fields_;
 
@@ -176,9 +185,10 @@ class PluginConf : public ::google::protobuf::Message {
   ::std::string* so_name_;
   ::std::string* conf_path_;
   ::google::protobuf::RepeatedPtrField< ::std::string> key_val_list_;
+  bool offload_;
 
   mutable int _cached_size_;
-  ::google::protobuf::uint32 _has_bits_[(5 + 31) / 32];
+  ::google::protobuf::uint32 _has_bits_[(6 + 31) / 32];
 
   friend void  protobuf_AddDesc_plugin_5fmanager_2econf_2eproto();
   friend void protobuf_AssignDesc_plugin_5fmanager_2econf_2eproto();
@@ -577,6 +587,28 @@ PluginConf::mutable_key_val_list() {
   return &key_val_list_;
 }
 
+// optional bool offload = 6;
+inline bool PluginConf::has_offload() const {
+  return (_has_bits_[0] & 0x00000020u) != 0;
+}
+inline void PluginConf::set_has_offload() {
+  _has_bits_[0] |= 0x00000020u;
+}
+inline void PluginConf::clear_has_offload() {
+  _has_bits_[0] &= ~0x00000020u;
+}
+inline void PluginConf::clear_offload() {
+  offload_ = false;
+  clear_has_offload();
+}
+inline bool PluginConf::offload() const {
+  return offload_;
+}
+inline void PluginConf::set_offload(bool value) {
+  set_has_offload();
+  offload_ = value;
+}
+
 // -------------------------------------------------------------------
 
 // PluginManagerConf
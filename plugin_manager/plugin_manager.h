@@ -52,6 +52,13 @@ public:
 
     Plugin* GetPlugin(const std::string &plugin_name);
 
+    /* Plugin configured with offload: true runs on the thread pool */
+    bool IsOffload(const std::string &plugin_name);
+
+    bool HasOffload() const { return has_offload_; }
+
+    const PluginInfoPtrMap& GetPlugins() const { return plugins_info_map_; }
+
 private:
     int LoadPlugin(PluginInfoPtr& plugin_info);
 
@@ -61,13 +68,12 @@ private:
 
     int ReadFileContent(const std::string& config_file, std::string &content);
 
-    const PluginInfoPtrMap& GetPlugins() const { return plugins_info_map_; }
-
 private:
     PluginManagerConf config_obj_;
 
     PluginInfoPtrMap plugins_info_map_;
     std::string plugin_mananger_conf_;
+    bool has_offload_;
 };
 
 }
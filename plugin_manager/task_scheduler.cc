@@ -0,0 +1,266 @@
+
+#include <errno.h>
+
+#include "task_scheduler.h"
+#include "logger.h"
+
+using namespace std;
+
+namespace sharelib {
+
+/* worker running on this thread, NULL for threads outside any scheduler */
+static __thread void* current_worker = NULL;
+
+
+TaskGroup::TaskGroup(TaskScheduler* scheduler)
+    : scheduler_(scheduler), pending_(0) {
+    pthread_mutex_init(&mutex_, NULL);
+    pthread_cond_init(&cond_, NULL);
+}
+
+
+TaskGroup::~TaskGroup() {
+    Wait();
+
+    pthread_mutex_destroy(&mutex_);
+    pthread_cond_destroy(&cond_);
+}
+
+
+void TaskGroup::Spawn(Task* task) {
+    if(scheduler_ == NULL) {
+        task->Run();
+        return;
+    }
+
+    pthread_mutex_lock(&mutex_);
+    pending_++;
+    pthread_mutex_unlock(&mutex_);
+
+    task->group_ = this;
+    scheduler_->Push(task);
+}
+
+
+void TaskGroup::Wait() {
+    if(scheduler_ == NULL) {
+        return;
+    }
+
+    for( ;; ) {
+        pthread_mutex_lock(&mutex_);
+        long pending = pending_;
+        pthread_mutex_unlock(&mutex_);
+
+        if(pending == 0) {
+            return;
+        }
+
+        /* help out, our own tasks are most likely on top */
+        if(scheduler_->RunOne()) {
+            continue;
+        }
+
+        pthread_mutex_lock(&mutex_);
+        if(pending_ > 0) {
+            pthread_cond_wait(&cond_, &mutex_);
+        }
+        pthread_mutex_unlock(&mutex_);
+    }
+}
+
+
+void TaskGroup::Done() {
+    pthread_mutex_lock(&mutex_);
+    pending_--;
+    pthread_cond_broadcast(&cond_);
+    pthread_mutex_unlock(&mutex_);
+}
+
+
+TaskScheduler::TaskScheduler(): started_(0), queued_(0), stop_(false) {
+    inject_.scheduler = this;
+    pthread_mutex_init(&inject_.mutex, NULL);
+
+    pthread_mutex_init(&idle_mutex_, NULL);
+    pthread_cond_init(&idle_cond_, NULL);
+}
+
+
+TaskScheduler::~TaskScheduler() {
+    Stop();
+
+    pthread_mutex_destroy(&inject_.mutex);
+    pthread_mutex_destroy(&idle_mutex_);
+    pthread_cond_destroy(&idle_cond_);
+}
+
+
+int TaskScheduler::Start(size_t threads) {
+    for(size_t i = 0; i < threads; i++) {
+        Worker* worker = new Worker();
+        worker->scheduler = this;
+        pthread_mutex_init(&worker->mutex, NULL);
+
+        workers_.push_back(worker);
+    }
+
+    /* all deques exist before anyone tries to steal */
+    for(size_t i = 0; i < workers_.size(); i++) {
+        if(pthread_create(&workers_[i]->tid, NULL, ThreadMain, workers_[i]) != 0) {
+            Log(LOG_LEVEL_ERROR, "task_scheduler create thread error").Field("errno", errno);
+            Stop();
+            return -1;
+        }
+        started_++;
+    }
+
+    Log(LOG_LEVEL_INFO, "task_scheduler start").Field("threads", threads);
+
+    return 0;
+}
+
+
+void TaskScheduler::Stop() {
+    pthread_mutex_lock(&idle_mutex_);
+    stop_ = true;
+    pthread_cond_broadcast(&idle_cond_);
+    pthread_mutex_unlock(&idle_mutex_);
+
+    for(size_t i = 0; i < started_; i++) {
+        pthread_join(workers_[i]->tid, NULL);
+    }
+    started_ = 0;
+
+    /* pushed by running tasks after the last worker quit */
+    while(RunOne()) {
+    }
+
+    for(size_t i = 0; i < workers_.size(); i++) {
+        pthread_mutex_destroy(&workers_[i]->mutex);
+        delete workers_[i];
+    }
+    workers_.clear();
+
+    stop_ = false;
+}
+
+
+void TaskScheduler::Push(Task* task) {
+    Worker* worker = static_cast<Worker*>(current_worker);
+
+    if(worker == NULL || worker->scheduler != this) {
+        worker = &inject_;
+    }
+
+    /* counted before it's visible, a thief must never take queued_ below 0 */
+    pthread_mutex_lock(&idle_mutex_);
+    queued_++;
+    pthread_mutex_unlock(&idle_mutex_);
+
+    pthread_mutex_lock(&worker->mutex);
+    worker->tasks.push_back(task);
+    pthread_mutex_unlock(&worker->mutex);
+
+    pthread_mutex_lock(&idle_mutex_);
+    pthread_cond_signal(&idle_cond_);
+    pthread_mutex_unlock(&idle_mutex_);
+}
+
+
+bool TaskScheduler::RunOne() {
+    Worker* self = static_cast<Worker*>(current_worker);
+    Task* task = NULL;
+
+    if(self != NULL && self->scheduler == this) {
+        task = PopBack(self);
+    } else {
+        self = NULL;
+    }
+
+    if(task == NULL) {
+        task = PopFront(&inject_);
+    }
+
+    for(size_t i = 0; task == NULL && i < workers_.size(); i++) {
+        if(workers_[i] != self) {
+            task = PopFront(workers_[i]);
+        }
+    }
+
+    if(task == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock(&idle_mutex_);
+    queued_--;
+    pthread_mutex_unlock(&idle_mutex_);
+
+    TaskGroup* group = task->group_;
+
+    task->Run();
+    group->Done();
+
+    return true;
+}
+
+
+Task* TaskScheduler::PopBack(Worker* worker) {
+    Task* task = NULL;
+
+    pthread_mutex_lock(&worker->mutex);
+    if(!worker->tasks.empty()) {
+        task = worker->tasks.back();
+        worker->tasks.pop_back();
+    }
+    pthread_mutex_unlock(&worker->mutex);
+
+    return task;
+}
+
+
+Task* TaskScheduler::PopFront(Worker* worker) {
+    Task* task = NULL;
+
+    pthread_mutex_lock(&worker->mutex);
+    if(!worker->tasks.empty()) {
+        task = worker->tasks.front();
+        worker->tasks.pop_front();
+    }
+    pthread_mutex_unlock(&worker->mutex);
+
+    return task;
+}
+
+
+void* TaskScheduler::ThreadMain(void* arg) {
+    Worker* worker = static_cast<Worker*>(arg);
+
+    current_worker = worker;
+    worker->scheduler->Loop(worker);
+
+    return NULL;
+}
+
+
+void TaskScheduler::Loop(Worker* worker) {
+    for( ;; ) {
+        if(RunOne()) {
+            continue;
+        }
+
+        pthread_mutex_lock(&idle_mutex_);
+        while(queued_ <= 0 && !stop_) {
+            pthread_cond_wait(&idle_cond_, &idle_mutex_);
+        }
+
+        /* queued tasks still run, somebody may be waiting for them */
+        if(stop_ && queued_ <= 0) {
+            pthread_mutex_unlock(&idle_mutex_);
+            return;
+        }
+        pthread_mutex_unlock(&idle_mutex_);
+    }
+}
+
+}
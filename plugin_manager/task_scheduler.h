@@ -0,0 +1,119 @@
+#ifndef SHARELIB_PLUGINMANAGER_TASK_SCHEDULER_H_
+#define SHARELIB_PLUGINMANAGER_TASK_SCHEDULER_H_
+
+#include <pthread.h>
+
+#include <deque>
+#include <vector>
+
+namespace sharelib {
+
+class TaskGroup;
+class TaskScheduler;
+
+/* Derive this class to run a piece of one request in parallel */
+class Task {
+public:
+    Task(): group_(NULL) {}
+
+    virtual ~Task() {}
+
+    virtual void Run() = 0;
+
+private:
+    friend class TaskGroup;
+    friend class TaskScheduler;
+
+    TaskGroup* group_;
+};
+
+/*
+ * Tasks spawned together and joined by Wait(). Waiting thread runs queued
+ * tasks meanwhile instead of sleeping. Tasks are owned by the caller.
+ *
+ *      TaskGroup group(ctx.task_scheduler_);
+ *      for(size_t i = 0; i < positions.size(); i++) {
+ *          group.Spawn(&rank_tasks[i]);
+ *      }
+ *      group.Wait();
+ *
+ * With NULL scheduler, tasks run inline in Spawn().
+ */
+class TaskGroup {
+public:
+    explicit TaskGroup(TaskScheduler* scheduler);
+
+    ~TaskGroup();
+
+    void Spawn(Task* task);
+
+    void Wait();
+
+private:
+    friend class TaskScheduler;
+
+    void Done();
+
+private:
+    TaskScheduler* scheduler_;
+
+    pthread_mutex_t mutex_;
+    pthread_cond_t cond_;
+    long pending_;
+};
+
+/*
+ * Work-stealing scheduler, every worker owns a deque. A worker pops the
+ * task spawned last from its own deque and steals the oldest task from
+ * the others when it runs dry. Tasks spawned by threads outside the
+ * scheduler go to a shared inject deque.
+ */
+class TaskScheduler {
+public:
+    TaskScheduler();
+
+    virtual ~TaskScheduler();
+
+    /* -1 with nothing left running if a thread can't be created */
+    int Start(size_t threads);
+
+    /* runs what's still queued, then joins the workers */
+    void Stop();
+
+private:
+    friend class TaskGroup;
+
+    struct Worker {
+        TaskScheduler* scheduler;
+        pthread_t tid;
+        pthread_mutex_t mutex;
+        std::deque<Task*> tasks;
+    };
+
+    void Push(Task* task);
+
+    /* run one queued task on the calling thread, false if none */
+    bool RunOne();
+
+    Task* PopBack(Worker* worker);
+
+    Task* PopFront(Worker* worker);
+
+    static void* ThreadMain(void* arg);
+
+    void Loop(Worker* worker);
+
+private:
+    std::vector<Worker*> workers_;
+    size_t started_;                    /* workers_ with a thread */
+    Worker inject_;
+
+    pthread_mutex_t idle_mutex_;
+    pthread_cond_t idle_cond_;
+    long queued_;
+    bool stop_;
+};
+
+}
+
+#endif // end SHARELIB_PLUGINMANAGER_TASK_SCHEDULER_H_
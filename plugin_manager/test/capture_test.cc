@@ -0,0 +1,179 @@
+/*
+ * CaptureRing::Write and Read: the oldest first once the ring wrapped,
+ * a truncated file and a corrupt string length are refused.
+ *
+ *      make check
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <capture.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace sharelib;
+
+static const char* kPath = "capture_test.bin";
+
+
+static CapturedRequest* NewRequest(int64_t i) {
+    CapturedRequest* req = new CapturedRequest();
+
+    req->start_usec = i;
+    req->total_usec = i * 10;
+    req->time_stamp = "ts";
+    req->headers_in["uri"] = "/ad";
+    req->headers_in["ip"] = "10.0.0.1";
+    req->handle_result = "result";
+
+    UpstreamRequest ups("/recall", "id=1");
+    ups.plugin_ = "recall";
+    ups.status_ = 200;
+    ups.done_ = true;
+    ups.connect_usec_ = 300;
+    ups.bytes_ = 5;
+    ups.peer_ = "10.0.0.2:80";
+    ups.response_ = string("ok\0ok", 5);
+
+    req->rounds.resize(2);
+    req->rounds[0].push_back(ups);
+    req->rounds[1].push_back(ups);
+    req->rounds[1].push_back(ups);
+
+    return req;
+}
+
+
+static string ReadFile() {
+    string data;
+    char buf[4096];
+    size_t n;
+
+    FILE* fp = fopen(kPath, "rb");
+    assert(fp != NULL);
+    while((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        data.append(buf, n);
+    }
+    fclose(fp);
+
+    return data;
+}
+
+
+static void WriteFile(const string& data) {
+    FILE* fp = fopen(kPath, "wb");
+    assert(fp != NULL);
+    assert(fwrite(data.data(), 1, data.size(), fp) == data.size());
+    fclose(fp);
+}
+
+
+static void TestWraparound() {
+    CaptureRing ring(4);
+
+    /* 0..2 pushed out, 3..6 left with 3 in slot 3 */
+    for(int64_t i = 0; i < 7; i++) {
+        ring.Add(NewRequest(i));
+    }
+    assert(ring.Size() == 4);
+    assert(ring.Write(kPath) == 0);
+
+    vector<CapturedRequest> requests;
+    assert(CaptureRing::Read(kPath, requests) == 0);
+    assert(requests.size() == 4);
+
+    for(size_t k = 0; k < requests.size(); k++) {
+        const CapturedRequest& req = requests[k];
+
+        assert(req.start_usec == (int64_t)k + 3);
+        assert(req.total_usec == ((int64_t)k + 3) * 10);
+        assert(req.time_stamp == "ts");
+        assert(req.headers_in.size() == 2);
+        assert(req.headers_in.find("ip")->second == "10.0.0.1");
+        assert(req.handle_result == "result");
+
+        assert(req.rounds.size() == 2);
+        assert(req.rounds[0].size() == 1);
+        assert(req.rounds[1].size() == 2);
+
+        const UpstreamRequest& ups = req.rounds[1][1];
+        assert(ups.uri_ == "/recall" && ups.args_ == "id=1");
+        assert(ups.plugin_ == "recall");
+        assert(ups.status_ == 200 && ups.done_);
+        assert(ups.connect_usec_ == 300 && ups.bytes_ == 5);
+        assert(ups.peer_ == "10.0.0.2:80");
+        assert(ups.response_ == string("ok\0ok", 5));
+    }
+
+    cout << "wraparound ok" << endl;
+}
+
+
+static void TestTruncated() {
+    CaptureRing ring(2);
+    ring.Add(NewRequest(1));
+    ring.Add(NewRequest(2));
+    assert(ring.Write(kPath) == 0);
+
+    string data = ReadFile();
+
+    /* cut anywhere, the header included, it must fail without a partial tail */
+    for(size_t len = 0; len < data.size(); len++) {
+        WriteFile(data.substr(0, len));
+
+        vector<CapturedRequest> requests;
+        assert(CaptureRing::Read(kPath, requests) == -1);
+        assert(requests.size() <= 1);
+    }
+
+    cout << "truncated ok" << endl;
+}
+
+
+static void TestCorruptLength() {
+    CaptureRing ring(1);
+    ring.Add(NewRequest(1));
+    assert(ring.Write(kPath) == 0);
+
+    string data = ReadFile();
+
+    /* time_stamp length, after magic, count, start_usec and total_usec */
+    const size_t offset = 8 + 4 + 8 + 8;
+    uint32_t len;
+    memcpy(&len, &data[offset], sizeof(len));
+    assert(len == 2);
+
+    /* above the limit, refused before allocating */
+    len = 0xffffffff;
+    memcpy(&data[offset], &len, sizeof(len));
+    WriteFile(data);
+
+    vector<CapturedRequest> requests;
+    assert(CaptureRing::Read(kPath, requests) == -1);
+    assert(requests.empty());
+
+    /* under the limit but past the end of the file */
+    len = 1 << 20;
+    memcpy(&data[offset], &len, sizeof(len));
+    WriteFile(data);
+
+    assert(CaptureRing::Read(kPath, requests) == -1);
+    assert(requests.empty());
+
+    cout << "corrupt length ok" << endl;
+}
+
+
+int main() {
+    TestWraparound();
+    TestTruncated();
+    TestCorruptLength();
+
+    unlink(kPath);
+    return 0;
+}
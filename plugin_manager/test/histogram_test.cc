@@ -0,0 +1,128 @@
+/*
+ * Histogram buckets at the edges, quantiles within a bucket of the exact
+ * value, and RollingHistogram window rotation.
+ *
+ *      make check
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <histogram.h>
+
+#include <iostream>
+
+using namespace std;
+using namespace sharelib;
+
+
+static void TestBuckets() {
+    const uint64_t top = ~(uint64_t)0;
+
+    /* exact below 2^kSubBits */
+    assert(Histogram::Index(0) == 0 && Histogram::BucketUpper(0) == 0);
+    assert(Histogram::Index(7) == 7 && Histogram::BucketUpper(7) == 7);
+
+    /* first log-linear bucket, a single value wide */
+    assert(Histogram::Index(8) == 8 && Histogram::BucketUpper(8) == 8);
+    assert(Histogram::Index(15) == 15 && Histogram::Index(16) == 16);
+    assert(Histogram::BucketUpper(16) == 17);
+
+    /* the last power of two range */
+    assert(Histogram::Index((uint64_t)1 << 63) == Histogram::kBuckets - 8);
+    assert(Histogram::BucketUpper(Histogram::kBuckets - 8)
+            == ((uint64_t)1 << 63) + ((uint64_t)1 << 60) - 1);
+    assert(Histogram::Index(top) == Histogram::kBuckets - 1);
+    assert(Histogram::BucketUpper(Histogram::kBuckets - 1) == top);
+
+    /* every bucket ends right before the next one starts */
+    for(size_t i = 0; i + 1 < Histogram::kBuckets; i++) {
+        uint64_t upper = Histogram::BucketUpper(i);
+        assert(Histogram::Index(upper) == i);
+        assert(Histogram::Index(upper + 1) == i + 1);
+    }
+
+    Histogram h;
+    h.Add(0);
+    h.Add(top);
+    assert(h.Count() == 2);
+    assert(h.BucketCount(0) == 1);
+    assert(h.BucketCount(Histogram::kBuckets - 1) == 1);
+    assert(h.Max() == top);
+    assert(h.Quantile(1) == top);
+
+    cout << "buckets ok" << endl;
+}
+
+
+static void TestQuantile() {
+    const uint64_t n = 100000;
+    const double qs[] = {0.01, 0.5, 0.9, 0.99, 0.999};
+
+    Histogram h;
+    assert(h.Quantile(0.5) == 0);
+
+    for(uint64_t v = 1; v <= n; v++) {
+        h.Add(v);
+    }
+    assert(h.Count() == n);
+    assert(h.Sum() == n * (n + 1) / 2);
+
+    /* never below the exact value, above it by less than 1/2^kSubBits */
+    for(size_t i = 0; i < sizeof(qs) / sizeof(qs[0]); i++) {
+        uint64_t exact = (uint64_t)(qs[i] * n);
+        uint64_t q = h.Quantile(qs[i]);
+
+        assert(q >= exact);
+        assert(q - exact <= exact >> Histogram::kSubBits);
+    }
+
+    /* clamped to what was seen */
+    assert(h.Quantile(1) == n);
+    assert(h.Quantile(2) == n);
+    assert(h.Quantile(-1) == 1);
+
+    cout << "quantile ok" << endl;
+}
+
+
+static void TestRolling() {
+    RollingHistogram h(10);
+    const time_t t = 1000;
+
+    assert(h.Count(t) == 0);
+    assert(h.Quantile(0.5, t) == 0);
+
+    for(int i = 0; i < 90; i++) {
+        h.Add(10, t);
+    }
+    assert(h.Count(t + 9) == 90);
+
+    /* the first window is now the previous one, still counted */
+    for(int i = 0; i < 10; i++) {
+        h.Add(1000, t + 10);
+    }
+    assert(h.Count(t + 15) == 100);
+    assert(h.Quantile(0.5, t + 15) == 10);
+    assert(h.Quantile(1, t + 15) == 1000);
+
+    /* the first window dropped out */
+    assert(h.Count(t + 20) == 10);
+    assert(h.Quantile(0.5, t + 20) == 1000);
+
+    /* idle for two windows, nothing left */
+    h.Add(10, t + 25);
+    assert(h.Count(t + 29) == 11);
+    assert(h.Count(t + 45) == 0);
+    assert(h.Quantile(0.5, t + 45) == 0);
+
+    cout << "rolling ok" << endl;
+}
+
+
+int main() {
+    TestBuckets();
+    TestQuantile();
+    TestRolling();
+
+    return 0;
+}
@@ -0,0 +1,146 @@
+
+/*
+ * Replays requests dumped by adfront_capture against a plugin, without nginx
+ * nor upstreams: each round of subrequests gets the responses captured in
+ * production, then handle_result_ is compared with the captured one.
+ *
+ *      plugin_replay plugin_manager.conf deliver adfront.1234.1400000000.capture
+ */
+
+#include <plugin.h>
+#include <plugin_manager.h>
+#include <capture.h>
+
+#include <iostream>
+
+using namespace std;
+using namespace sharelib;
+
+/* the next captured round as the responses of the plugin's requests */
+static int ServeRound(PluginContext& ctx, const vector<UpstreamRequest>& round) {
+    vector<UpstreamRequest>& ups = ctx.upstream_request_;
+
+    if(ups.size() != round.size()) {
+        cerr << "  " << ups.size() << " subrequests, captured " << round.size() << endl;
+        return -1;
+    }
+
+    for(size_t i = 0; i < ups.size(); i++) {
+        if(ups[i].builder_ != NULL && ups[i].builder_->Build(ctx, ups[i]) != PLUGIN_OK) {
+            cerr << "  subrequest " << i << " not built" << endl;
+        }
+
+        if(ups[i].uri_ != round[i].uri_ || ups[i].args_ != round[i].args_
+                || ups[i].plugin_ != round[i].plugin_) {
+            cerr << "  subrequest " << i << " differs: " << ups[i].plugin_ << ups[i].uri_
+                << "?" << ups[i].args_ << ", captured " << round[i].plugin_
+                << round[i].uri_ << "?" << round[i].args_ << endl;
+        }
+
+        ups[i].status_ = round[i].status_;
+        ups[i].response_ = round[i].response_;
+        ups[i].done_ = round[i].done_;
+        ups[i].up_sec_ = round[i].up_sec_;
+        ups[i].up_msec_ = round[i].up_msec_;
+        ups[i].queue_usec_ = round[i].queue_usec_;
+        ups[i].connect_usec_ = round[i].connect_usec_;
+        ups[i].header_usec_ = round[i].header_usec_;
+        ups[i].total_usec_ = round[i].total_usec_;
+        ups[i].bytes_ = round[i].bytes_;
+        ups[i].peer_ = round[i].peer_;
+    }
+
+    return 0;
+}
+
+
+/* 0 if it came out as captured */
+static int Replay(Plugin* plugin, const CapturedRequest& req) {
+    PluginContext ctx;
+    size_t round = 0;
+    bool post = false;
+
+    ctx.headers_in_ = req.headers_in;
+    ctx.time_stamp_ = req.time_stamp;
+
+    for(;;) {
+        ctx.StartSlice();
+
+        int rc = post ? plugin->PostSubHandle(ctx) : plugin->Handle(ctx);
+
+        if(rc == PLUGIN_YIELD) {
+            continue;
+        }
+
+        if(rc != PLUGIN_AGAIN) {
+            if(rc != PLUGIN_OK) {
+                cerr << "  plugin returned " << rc << endl;
+                return -1;
+            }
+            break;
+        }
+
+        if(round >= req.rounds.size()) {
+            cerr << "  more rounds than the " << req.rounds.size() << " captured" << endl;
+            return -1;
+        }
+
+        if(ServeRound(ctx, req.rounds[round++]) != 0) {
+            return -1;
+        }
+
+        post = true;
+    }
+
+    if(round != req.rounds.size()) {
+        cerr << "  " << round << " rounds, captured " << req.rounds.size() << endl;
+    }
+
+    if(ctx.handle_result_ != req.handle_result) {
+        cerr << "  result differs" << endl;
+        cerr << "  < " << req.handle_result << endl;
+        cerr << "  > " << ctx.handle_result_ << endl;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int main(int argc, char* argv[]) {
+    PluginManager plugin_manager;
+    vector<CapturedRequest> requests;
+
+    if(argc != 4) {
+        cerr << "usage: " << argv[0] << " plugin_manager.conf plugin capture" << endl;
+        return 1;
+    }
+
+    if(plugin_manager.Init(argv[1]) != PLUGIN_OK) {
+        return 1;
+    }
+
+    Plugin* plugin = plugin_manager.GetPlugin(argv[2]);
+    if(plugin == NULL) {
+        cerr << "no plugin " << argv[2] << endl;
+        return 1;
+    }
+
+    if(CaptureRing::Read(argv[3], requests) != 0) {
+        return 1;
+    }
+
+    size_t matched = 0;
+    for(size_t i = 0; i < requests.size(); i++) {
+        cout << "request " << i << ", " << requests[i].total_usec << " usec, "
+            << requests[i].rounds.size() << " rounds" << endl;
+
+        if(Replay(plugin, requests[i]) == 0) {
+            matched++;
+        }
+    }
+
+    cout << matched << " of " << requests.size() << " requests replayed as captured" << endl;
+
+    return matched == requests.size() ? 0 : 2;
+}
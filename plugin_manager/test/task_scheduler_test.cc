@@ -0,0 +1,160 @@
+/*
+ * TaskScheduler and TaskGroup: nested groups waited on from workers, the
+ * inline mode without a scheduler, and Stop with tasks still queued.
+ *
+ *      make check
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <task_scheduler.h>
+
+#include <iostream>
+#include <vector>
+
+using namespace std;
+using namespace sharelib;
+
+static long ran = 0;
+
+
+class CountTask: public Task {
+    public:
+        explicit CountTask(useconds_t usec = 0): usec_(usec), thread_(0) {}
+
+        void Run() {
+            if(usec_) {
+                usleep(usec_);
+            }
+            thread_ = pthread_self();
+            __sync_fetch_and_add(&ran, 1);
+        }
+
+        useconds_t usec_;
+        pthread_t thread_;
+};
+
+
+/* spawns fanout children a level down and waits for them, on a worker */
+class TreeTask: public Task {
+    public:
+        TreeTask(): scheduler_(NULL), depth_(0), fanout_(0) {}
+
+        void Run() {
+            __sync_fetch_and_add(&ran, 1);
+
+            if(depth_ == 0) {
+                return;
+            }
+
+            vector<TreeTask> children(fanout_);
+            TaskGroup group(scheduler_);
+
+            for(size_t i = 0; i < children.size(); i++) {
+                children[i].scheduler_ = scheduler_;
+                children[i].depth_ = depth_ - 1;
+                children[i].fanout_ = fanout_;
+                group.Spawn(&children[i]);
+            }
+
+            group.Wait();
+        }
+
+        TaskScheduler* scheduler_;
+        int depth_;
+        size_t fanout_;
+};
+
+
+static void TestNested() {
+    TaskScheduler scheduler;
+    assert(scheduler.Start(4) == 0);
+
+    /* 1 + 4 + 16 + 64 + 256 tasks per root */
+    vector<TreeTask> roots(8);
+    TaskGroup group(&scheduler);
+
+    ran = 0;
+    for(size_t i = 0; i < roots.size(); i++) {
+        roots[i].scheduler_ = &scheduler;
+        roots[i].depth_ = 4;
+        roots[i].fanout_ = 4;
+        group.Spawn(&roots[i]);
+    }
+    group.Wait();
+
+    assert(ran == 8 * (1 + 4 + 16 + 64 + 256));
+
+    scheduler.Stop();
+    cout << "nested ok" << endl;
+}
+
+
+static void TestInline() {
+    CountTask task;
+    TaskGroup group(NULL);
+
+    ran = 0;
+    group.Spawn(&task);
+
+    /* already run, on this thread */
+    assert(ran == 1);
+    assert(pthread_equal(task.thread_, pthread_self()));
+
+    group.Wait();
+    cout << "inline ok" << endl;
+}
+
+
+static void TestStopQueued() {
+    /* slow tasks on few workers, most are still queued when Stop comes */
+    {
+        TaskScheduler scheduler;
+        assert(scheduler.Start(2) == 0);
+
+        vector<CountTask> tasks(200, CountTask(200));
+        TaskGroup group(&scheduler);
+
+        ran = 0;
+        for(size_t i = 0; i < tasks.size(); i++) {
+            group.Spawn(&tasks[i]);
+        }
+
+        scheduler.Stop();
+        assert(ran == (long)tasks.size());
+
+        /* must not hang, nothing is left for it */
+        group.Wait();
+    }
+
+    /* no workers at all, Stop runs them on the caller */
+    {
+        TaskScheduler scheduler;
+        assert(scheduler.Start(0) == 0);
+
+        vector<CountTask> tasks(10);
+        TaskGroup group(&scheduler);
+
+        ran = 0;
+        for(size_t i = 0; i < tasks.size(); i++) {
+            group.Spawn(&tasks[i]);
+        }
+        assert(ran == 0);
+
+        scheduler.Stop();
+        assert(ran == (long)tasks.size());
+        group.Wait();
+    }
+
+    cout << "stop queued ok" << endl;
+}
+
+
+int main() {
+    TestNested();
+    TestInline();
+    TestStopQueued();
+
+    return 0;
+}
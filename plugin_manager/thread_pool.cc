@@ -0,0 +1,176 @@
+
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "thread_pool.h"
+#include "logger.h"
+
+using namespace std;
+
+namespace sharelib {
+
+static int64_t NowUs() {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+ThreadPool::ThreadPool(): stop_(false), notify_fd_(-1) {
+    pthread_mutex_init(&mutex_, NULL);
+    pthread_cond_init(&cond_, NULL);
+    pthread_mutex_init(&done_mutex_, NULL);
+
+    stats_.queue_depth = 0;
+    stats_.completed = 0;
+    stats_.wait_us_total = 0;
+    stats_.wait_us_max = 0;
+}
+
+
+ThreadPool::~ThreadPool() {
+    Stop();
+
+    pthread_mutex_destroy(&mutex_);
+    pthread_cond_destroy(&cond_);
+    pthread_mutex_destroy(&done_mutex_);
+}
+
+
+int ThreadPool::Start(size_t threads) {
+    notify_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(notify_fd_ == -1) {
+        Log(LOG_LEVEL_ERROR, "thread_pool eventfd error").Field("errno", errno);
+        return -1;
+    }
+
+    for(size_t i = 0; i < threads; i++) {
+        pthread_t tid;
+
+        if(pthread_create(&tid, NULL, ThreadMain, this) != 0) {
+            Log(LOG_LEVEL_ERROR, "thread_pool create thread error").Field("errno", errno);
+            return -1;
+        }
+
+        threads_.push_back(tid);
+    }
+
+    Log(LOG_LEVEL_INFO, "thread_pool start").Field("threads", threads);
+
+    return 0;
+}
+
+
+void ThreadPool::Stop() {
+    pthread_mutex_lock(&mutex_);
+    stop_ = true;
+    pthread_cond_broadcast(&cond_);
+    pthread_mutex_unlock(&mutex_);
+
+    for(size_t i = 0; i < threads_.size(); i++) {
+        pthread_join(threads_[i], NULL);
+    }
+    threads_.clear();
+
+    if(notify_fd_ != -1) {
+        close(notify_fd_);
+        notify_fd_ = -1;
+    }
+}
+
+
+int ThreadPool::Post(ThreadTask* task) {
+    task->enqueue_us_ = NowUs();
+    task->wait_us_ = 0;
+
+    pthread_mutex_lock(&mutex_);
+    if(stop_ || threads_.empty()) {
+        pthread_mutex_unlock(&mutex_);
+        return -1;
+    }
+
+    pending_.push_back(task);
+    stats_.queue_depth = pending_.size();
+
+    pthread_cond_signal(&cond_);
+    pthread_mutex_unlock(&mutex_);
+
+    return 0;
+}
+
+
+size_t ThreadPool::TakeDone(vector<ThreadTask*>& done) {
+    uint64_t count;
+
+    /* reset before taking, a later completion wakes the owner again */
+    while(read(notify_fd_, &count, sizeof(count)) == -1 && errno == EINTR) {
+    }
+
+    pthread_mutex_lock(&done_mutex_);
+    done.insert(done.end(), done_.begin(), done_.end());
+    size_t n = done_.size();
+    done_.clear();
+    pthread_mutex_unlock(&done_mutex_);
+
+    return n;
+}
+
+
+void ThreadPool::GetStats(ThreadPoolStats& stats) {
+    pthread_mutex_lock(&mutex_);
+    stats = stats_;
+    pthread_mutex_unlock(&mutex_);
+}
+
+
+void* ThreadPool::ThreadMain(void* arg) {
+    static_cast<ThreadPool*>(arg)->Loop();
+
+    return NULL;
+}
+
+
+void ThreadPool::Loop() {
+    for( ;; ) {
+        pthread_mutex_lock(&mutex_);
+        while(pending_.empty() && !stop_) {
+            pthread_cond_wait(&cond_, &mutex_);
+        }
+
+        if(stop_) {
+            pthread_mutex_unlock(&mutex_);
+            return;
+        }
+
+        ThreadTask* task = pending_.front();
+        pending_.pop_front();
+
+        task->wait_us_ = NowUs() - task->enqueue_us_;
+
+        stats_.queue_depth = pending_.size();
+        stats_.wait_us_total += task->wait_us_;
+        if((uint64_t)task->wait_us_ > stats_.wait_us_max) {
+            stats_.wait_us_max = task->wait_us_;
+        }
+        pthread_mutex_unlock(&mutex_);
+
+        task->Run();
+
+        pthread_mutex_lock(&done_mutex_);
+        done_.push_back(task);
+        pthread_mutex_unlock(&done_mutex_);
+
+        pthread_mutex_lock(&mutex_);
+        stats_.completed++;
+        pthread_mutex_unlock(&mutex_);
+
+        uint64_t one = 1;
+        while(write(notify_fd_, &one, sizeof(one)) == -1 && errno == EINTR) {
+        }
+    }
+}
+
+}
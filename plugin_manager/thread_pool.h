@@ -0,0 +1,78 @@
+#ifndef SHARELIB_PLUGINMANAGER_THREAD_POOL_H_
+#define SHARELIB_PLUGINMANAGER_THREAD_POOL_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <deque>
+#include <vector>
+
+namespace sharelib {
+
+/* Derive this class to run your own work on a pool thread */
+class ThreadTask {
+public:
+    ThreadTask(): enqueue_us_(0), wait_us_(0) {}
+
+    virtual ~ThreadTask() {}
+
+    virtual void Run() = 0;
+
+    int64_t enqueue_us_;        /* time posted to the pool */
+    int64_t wait_us_;           /* time spent in queue before Run */
+};
+
+struct ThreadPoolStats {
+    uint64_t queue_depth;       /* tasks waiting for a thread */
+    uint64_t completed;         /* tasks finished since start */
+    uint64_t wait_us_total;     /* queue wait of finished tasks */
+    uint64_t wait_us_max;
+};
+
+/*
+ * Fixed size thread pool for work which mustn't block the event loop.
+ * Finished tasks are queued back to the owner and NotifyFd() becomes
+ * readable, so the owner can pick them up with TakeDone() from its loop.
+ */
+class ThreadPool {
+public:
+    ThreadPool();
+
+    virtual ~ThreadPool();
+
+    int Start(size_t threads);
+
+    void Stop();
+
+    int Post(ThreadTask* task);
+
+    /* Drain notify fd and move finished tasks to done, non-blocking */
+    size_t TakeDone(std::vector<ThreadTask*>& done);
+
+    int NotifyFd() const { return notify_fd_; }
+
+    void GetStats(ThreadPoolStats& stats);
+
+private:
+    static void* ThreadMain(void* arg);
+
+    void Loop();
+
+private:
+    pthread_mutex_t mutex_;
+    pthread_cond_t cond_;
+    std::deque<ThreadTask*> pending_;
+    bool stop_;
+
+    pthread_mutex_t done_mutex_;
+    std::vector<ThreadTask*> done_;
+
+    std::vector<pthread_t> threads_;
+    int notify_fd_;
+
+    ThreadPoolStats stats_;
+};
+
+}
+
+#endif // end SHARELIB_PLUGINMANAGER_THREAD_POOL_H_
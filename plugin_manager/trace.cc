@@ -0,0 +1,485 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include <map>
+
+#include "trace.h"
+#include "logger.h"
+
+using namespace std;
+
+namespace sharelib {
+
+/* "00-" 32 hex "-" 16 hex "-" 2 hex */
+const static size_t kTraceParentLen = 55;
+
+int SpanExporter::fd_ = -1;
+bool SpanExporter::stopping_ = false;
+string SpanExporter::service_;
+string SpanExporter::pending_;
+pthread_t SpanExporter::writer_;
+pthread_mutex_t SpanExporter::mutex_ = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t SpanExporter::cond_ = PTHREAD_COND_INITIALIZER;
+
+static __thread uint64_t id_state = 0;
+
+
+static int64_t NowUs() {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+/* splitmix64, seeded per thread */
+uint64_t Trace::NewId() {
+    if(id_state == 0) {
+        id_state = (uint64_t)NowUs() ^ ((uint64_t)getpid() << 32)
+            ^ (uint64_t)(uintptr_t)&id_state;
+    }
+
+    uint64_t z;
+    do {
+        z = (id_state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        z ^= z >> 31;
+    } while(z == 0);
+
+    return z;
+}
+
+
+static bool ParseHex(const char* p, size_t n, uint64_t* v) {
+    *v = 0;
+
+    for(size_t i = 0; i < n; i++) {
+        char c = p[i];
+        int d;
+
+        if(c >= '0' && c <= '9') {
+            d = c - '0';
+        } else if(c >= 'a' && c <= 'f') {
+            d = c - 'a' + 10;
+        } else {
+            return false;
+        }
+
+        *v = (*v << 4) | d;
+    }
+
+    return true;
+}
+
+
+static void PutHex(string& out, uint64_t v, int digits) {
+    static const char hex[] = "0123456789abcdef";
+
+    for(int i = digits - 1; i >= 0; i--) {
+        out += hex[(v >> (i * 4)) & 0xf];
+    }
+}
+
+
+Trace::Trace(): span_id_(0), parent_id_(0), current_(0), start_usec_(0),
+    sampled_(false), debug_(false) {
+    trace_id_[0] = trace_id_[1] = 0;
+}
+
+
+bool Trace::Start(const string& traceparent, bool sample, int64_t start_usec) {
+    uint64_t version, hi, lo, parent, flags;
+
+    span_id_ = current_ = NewId();
+    start_usec_ = start_usec;
+
+    /* later versions may append fields, the first ones stay */
+    const char* p = traceparent.data();
+    if(traceparent.size() >= kTraceParentLen
+            && (traceparent.size() == kTraceParentLen || p[kTraceParentLen] == '-')
+            && p[2] == '-' && p[35] == '-' && p[52] == '-'
+            && ParseHex(p, 2, &version) && version != 0xff
+            && (version != 0 || traceparent.size() == kTraceParentLen)
+            && ParseHex(p + 3, 16, &hi) && ParseHex(p + 19, 16, &lo)
+            && ParseHex(p + 36, 16, &parent) && ParseHex(p + 53, 2, &flags)
+            && (hi | lo) != 0 && parent != 0) {
+        trace_id_[0] = hi;
+        trace_id_[1] = lo;
+        parent_id_ = parent;
+        sampled_ = debug_ || (flags & 1);
+
+        return true;
+    }
+
+    trace_id_[0] = NewId();
+    trace_id_[1] = NewId();
+    parent_id_ = 0;
+    sampled_ = debug_ || sample;
+
+    return traceparent.empty();
+}
+
+
+void Trace::Inherit(const Trace& parent, int64_t start_usec) {
+    if(parent.span_id_ == 0) {
+        return;
+    }
+
+    trace_id_[0] = parent.trace_id_[0];
+    trace_id_[1] = parent.trace_id_[1];
+    parent_id_ = parent.current_;
+    span_id_ = current_ = NewId();
+    start_usec_ = start_usec;
+    sampled_ = parent.sampled_;
+    debug_ = parent.debug_;
+}
+
+
+string Trace::TraceParent(uint64_t span_id) const {
+    string out;
+
+    out.reserve(kTraceParentLen);
+    out += "00-";
+    PutHex(out, trace_id_[0], 16);
+    PutHex(out, trace_id_[1], 16);
+    out += '-';
+    PutHex(out, span_id, 16);
+    out += sampled_ ? "-01" : "-00";
+
+    return out;
+}
+
+
+int Trace::StartSpan(const string& name) {
+    int span = AddSpan(name, NewId(), current_, SPAN_KIND_INTERNAL, NowUs(), 0);
+    if(span >= 0) {
+        current_ = spans_[span].span_id;
+    }
+
+    return span;
+}
+
+
+void Trace::SetAttribute(int span, const string& key, const string& value) {
+    if(span < 0 || (size_t)span >= spans_.size()) {
+        return;
+    }
+
+    spans_[span].attributes.push_back(make_pair(key, value));
+}
+
+
+void Trace::SetError(int span) {
+    if(span < 0 || (size_t)span >= spans_.size()) {
+        return;
+    }
+
+    spans_[span].error = true;
+}
+
+
+void Trace::EndSpan(int span) {
+    if(span < 0 || (size_t)span >= spans_.size()) {
+        return;
+    }
+
+    spans_[span].end_usec = NowUs();
+    current_ = spans_[span].parent_id;
+}
+
+
+int Trace::AddSpan(const string& name, uint64_t span_id, uint64_t parent_id,
+        int kind, int64_t start_usec, int64_t end_usec) {
+    if(!sampled_) {
+        return -1;
+    }
+
+    spans_.push_back(Span());
+
+    Span& span = spans_.back();
+    span.span_id = span_id;
+    span.parent_id = parent_id;
+    span.kind = kind;
+    span.error = false;
+    span.name = name;
+    span.start_usec = start_usec;
+    span.end_usec = end_usec;
+
+    return spans_.size() - 1;
+}
+
+
+int Trace::Finish(const string& name, int kind, int64_t end_usec) {
+    return AddSpan(name, span_id_, parent_id_, kind, start_usec_, end_usec);
+}
+
+
+void Trace::Merge(Trace& child) {
+    spans_.insert(spans_.end(), child.spans_.begin(), child.spans_.end());
+    child.spans_.clear();
+}
+
+
+static void WriteTreeLines(const vector<Span>& spans,
+        const multimap<uint64_t, size_t>& children, uint64_t parent,
+        int64_t origin, int depth, vector<string>& lines) {
+    char buf[64];
+
+    pair<multimap<uint64_t, size_t>::const_iterator,
+        multimap<uint64_t, size_t>::const_iterator> range = children.equal_range(parent);
+
+    for(multimap<uint64_t, size_t>::const_iterator it = range.first;
+            it != range.second; it++) {
+        const Span& span = spans[it->second];
+        int64_t end = span.end_usec ? span.end_usec : span.start_usec;
+
+        snprintf(buf, sizeof(buf), " +%.3f %.3fms",
+                (span.start_usec - origin) / 1000.0, (end - span.start_usec) / 1000.0);
+
+        string line(depth * 2, '.');
+        line += span.name;
+        line += buf;
+        if(span.error) {
+            line += " error";
+        }
+        for(size_t i = 0; i < span.attributes.size(); i++) {
+            line += " " + span.attributes[i].first + "=" + span.attributes[i].second;
+        }
+        lines.push_back(line);
+
+        WriteTreeLines(spans, children, span.span_id, origin, depth + 1, lines);
+    }
+}
+
+
+void Trace::WriteTree(vector<string>& lines) const {
+    multimap<uint64_t, size_t> children;
+    map<uint64_t, size_t> ids;
+    int64_t origin = 0;
+
+    for(size_t i = 0; i < spans_.size(); i++) {
+        ids[spans_[i].span_id] = i;
+        if(origin == 0 || spans_[i].start_usec < origin) {
+            origin = spans_[i].start_usec;
+        }
+    }
+
+    /* spans whose parent isn't here hang off 0, the caller's span included */
+    for(size_t i = 0; i < spans_.size(); i++) {
+        uint64_t parent = spans_[i].parent_id;
+        if(ids.find(parent) == ids.end()) {
+            parent = 0;
+        }
+        children.insert(make_pair(parent, i));
+    }
+
+    WriteTreeLines(spans_, children, 0, origin, 0, lines);
+}
+
+
+static void PutJsonString(string& out, const string& s) {
+    char buf[8];
+
+    out += '"';
+    for(size_t i = 0; i < s.size(); i++) {
+        unsigned char c = s[i];
+
+        if(c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if(c < 0x20) {
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        } else {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+
+void Trace::WriteJson(const string& service, string& out) const {
+    char buf[64];
+    string trace_id;
+
+    PutHex(trace_id, trace_id_[0], 16);
+    PutHex(trace_id, trace_id_[1], 16);
+
+    out += "{\"resourceSpans\":[{\"resource\":{\"attributes\":[{\"key\":\"service.name\","
+        "\"value\":{\"stringValue\":";
+    PutJsonString(out, service);
+    out += "}}]},\"scopeSpans\":[{\"scope\":{\"name\":\"adfront\"},\"spans\":[";
+
+    for(size_t i = 0; i < spans_.size(); i++) {
+        const Span& span = spans_[i];
+        int64_t end = span.end_usec ? span.end_usec : span.start_usec;
+
+        if(i) {
+            out += ',';
+        }
+
+        out += "{\"traceId\":\"" + trace_id + "\",\"spanId\":\"";
+        PutHex(out, span.span_id, 16);
+        out += '"';
+        if(span.parent_id) {
+            out += ",\"parentSpanId\":\"";
+            PutHex(out, span.parent_id, 16);
+            out += '"';
+        }
+
+        out += ",\"name\":";
+        PutJsonString(out, span.name);
+
+        snprintf(buf, sizeof(buf), ",\"kind\":%d", span.kind);
+        out += buf;
+        snprintf(buf, sizeof(buf), ",\"startTimeUnixNano\":\"%lld000\"",
+                (long long)span.start_usec);
+        out += buf;
+        snprintf(buf, sizeof(buf), ",\"endTimeUnixNano\":\"%lld000\"", (long long)end);
+        out += buf;
+
+        out += ",\"attributes\":[";
+        for(size_t j = 0; j < span.attributes.size(); j++) {
+            if(j) {
+                out += ',';
+            }
+            out += "{\"key\":";
+            PutJsonString(out, span.attributes[j].first);
+            out += ",\"value\":{\"stringValue\":";
+            PutJsonString(out, span.attributes[j].second);
+            out += "}}";
+        }
+        out += ']';
+
+        /* STATUS_CODE_ERROR, unset otherwise */
+        if(span.error) {
+            out += ",\"status\":{\"code\":2}";
+        }
+
+        out += '}';
+    }
+
+    out += "]}]}]}\n";
+}
+
+
+int SpanExporter::Start(const string& path, const string& service) {
+    if(fd_ != -1) {
+        return 0;
+    }
+
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(fd == -1) {
+        Log(LOG_LEVEL_ERROR, "span exporter can't open").Field("path", path)
+            .Field("error", strerror(errno));
+        return -1;
+    }
+
+    service_ = service;
+    fd_ = fd;
+    stopping_ = false;
+
+    if(pthread_create(&writer_, NULL, WriterMain, NULL) != 0) {
+        Log(LOG_LEVEL_ERROR, "span exporter create thread error").Field("errno", errno);
+        close(fd);
+        fd_ = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void SpanExporter::Stop() {
+    if(fd_ == -1) {
+        return;
+    }
+
+    pthread_mutex_lock(&mutex_);
+    stopping_ = true;
+    pthread_cond_signal(&cond_);
+    pthread_mutex_unlock(&mutex_);
+
+    pthread_join(writer_, NULL);
+
+    close(fd_);
+    fd_ = -1;
+}
+
+
+bool SpanExporter::Export(const Trace& trace) {
+    string json;
+
+    if(fd_ == -1 || trace.Spans().empty()) {
+        return true;
+    }
+
+    trace.WriteJson(service_, json);
+
+    pthread_mutex_lock(&mutex_);
+
+    if(pending_.size() + json.size() > kMaxBytes) {
+        pthread_mutex_unlock(&mutex_);
+        return false;
+    }
+
+    pending_ += json;
+    if(pending_.size() >= kFlushBytes) {
+        pthread_cond_signal(&cond_);
+    }
+
+    pthread_mutex_unlock(&mutex_);
+
+    return true;
+}
+
+
+void* SpanExporter::WriterMain(void* arg) {
+    string out;
+    struct timespec ts;
+    bool stop = false;
+
+    while(!stop) {
+        pthread_mutex_lock(&mutex_);
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += 1;
+
+        while(pending_.size() < kFlushBytes && !stopping_) {
+            if(pthread_cond_timedwait(&cond_, &mutex_, &ts) == ETIMEDOUT) {
+                break;
+            }
+        }
+
+        /* Export runs on the thread stopping us, nothing comes after this */
+        stop = stopping_;
+        out.swap(pending_);
+        pthread_mutex_unlock(&mutex_);
+
+        size_t off = 0;
+        while(off < out.size()) {
+            ssize_t n = write(fd_, out.data() + off, out.size() - off);
+            if(n == -1 && errno == EINTR) {
+                continue;
+            }
+            if(n <= 0) {
+                Log(LOG_LEVEL_ERROR, "span exporter write error").Field("errno", errno);
+                break;
+            }
+            off += n;
+        }
+
+        out.clear();
+    }
+
+    return NULL;
+}
+
+}
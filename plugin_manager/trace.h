@@ -0,0 +1,173 @@
+#ifndef SHARELIB_PLUGINMANAGER_TRACE_H_
+#define SHARELIB_PLUGINMANAGER_TRACE_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace sharelib {
+
+/* OTLP span kinds */
+enum {
+    SPAN_KIND_INTERNAL = 1,
+    SPAN_KIND_SERVER = 2,
+    SPAN_KIND_CLIENT = 3
+};
+
+struct Span {
+    uint64_t span_id;
+    uint64_t parent_id;                 /* 0 for the root of the trace */
+    int kind;
+    bool error;
+    std::string name;
+    int64_t start_usec;                 /* unix time */
+    int64_t end_usec;                   /* 0 until ended */
+    std::vector<std::pair<std::string, std::string> > attributes;
+};
+
+/*
+ * W3C trace context of a request and the spans recorded for it in this
+ * process. Ids are made for every request so they can go downstream in a
+ * traceparent, spans are kept only if it's sampled. The framework records
+ * the request, the plugin calls and the subrequests, a plugin adds its own
+ * under the call it's in:
+ *
+ *      ScopedSpan span(ctx.trace_, "rank");
+ *      span.SetAttribute("candidates", "120");
+ *
+ * Not thread safe, spans are added by the thread running the plugin.
+ */
+class Trace {
+public:
+    Trace();
+
+    /*
+     * New trace, or the one of a "00-<trace id>-<parent id>-<flags>"
+     * traceparent, whose sampled flag wins over sample. false if traceparent
+     * was given but malformed, a new trace is started then.
+     */
+    bool Start(const std::string& traceparent, bool sample, int64_t start_usec);
+
+    /* trace of a local call, a child of parent's current span if it has one */
+    void Inherit(const Trace& parent, int64_t start_usec);
+
+    /* sampled and returned in the response, whatever the traceparent said */
+    void SetDebug() { sampled_ = true; debug_ = true; }
+
+    bool Sampled() const { return sampled_; }
+
+    bool Debug() const { return debug_; }
+
+    /* span of the request in this process, the parent of what it sends */
+    uint64_t SpanId() const { return span_id_; }
+
+    /* "00-<trace id>-<span id>-<flags>" */
+    std::string TraceParent(uint64_t span_id) const;
+
+    /* a child of the current span, which it becomes; -1 if not sampled */
+    int StartSpan(const std::string& name);
+
+    void SetAttribute(int span, const std::string& key, const std::string& value);
+
+    void SetError(int span);
+
+    /* back to its parent as the current span */
+    void EndSpan(int span);
+
+    /* span with its times known, -1 if not sampled */
+    int AddSpan(const std::string& name, uint64_t span_id, uint64_t parent_id,
+            int kind, int64_t start_usec, int64_t end_usec);
+
+    /* ends the span of SpanId() */
+    int Finish(const std::string& name, int kind, int64_t end_usec);
+
+    /* takes the spans of a local call's trace */
+    void Merge(Trace& child);
+
+    const std::vector<Span>& Spans() const { return spans_; }
+
+    void Clear() { spans_.clear(); }
+
+    /* one line per span, indented under its parent, with msec offsets */
+    void WriteTree(std::vector<std::string>& lines) const;
+
+    /* OTLP JSON of the spans, one ExportTraceServiceRequest */
+    void WriteJson(const std::string& service, std::string& out) const;
+
+    /* random, never 0 */
+    static uint64_t NewId();
+
+private:
+    uint64_t trace_id_[2];
+    uint64_t span_id_;
+    uint64_t parent_id_;                /* remote parent or caller's span */
+    uint64_t current_;                  /* parent of StartSpan */
+    int64_t start_usec_;
+    bool sampled_;
+    bool debug_;
+    std::vector<Span> spans_;
+};
+
+
+/* plugin span for a scope, nothing if the trace isn't sampled */
+class ScopedSpan {
+public:
+    ScopedSpan(Trace& trace, const std::string& name)
+        : trace_(trace), span_(trace.StartSpan(name)) {}
+
+    ~ScopedSpan() { trace_.EndSpan(span_); }
+
+    void SetAttribute(const std::string& key, const std::string& value) {
+        trace_.SetAttribute(span_, key, value);
+    }
+
+    void SetError() { trace_.SetError(span_); }
+
+private:
+    Trace& trace_;
+    int span_;
+};
+
+
+/*
+ * Appends sampled traces to a file as OTLP JSON lines, which collectors
+ * with a file receiver and most trace viewers import. Export only copies
+ * into a buffer, a thread of its own writes it out every second or once
+ * it's past kFlushBytes; while the buffer is full traces are dropped.
+ *
+ * Start in the process exporting, threads don't survive fork.
+ */
+class SpanExporter {
+public:
+    static const size_t kFlushBytes = 64 << 10;
+    static const size_t kMaxBytes = 8 << 20;
+
+    static int Start(const std::string& path, const std::string& service);
+
+    /* writes out what's pending and joins the writer */
+    static void Stop();
+
+    static bool Running() { return fd_ != -1; }
+
+    /* false if dropped */
+    static bool Export(const Trace& trace);
+
+private:
+    static void* WriterMain(void* arg);
+
+    static int fd_;
+    static bool stopping_;
+    static std::string service_;
+    static std::string pending_;
+    static pthread_t writer_;
+    static pthread_mutex_t mutex_;
+    static pthread_cond_t cond_;
+};
+
+}
+
+#endif // end SHARELIB_PLUGINMANAGER_TRACE_H_